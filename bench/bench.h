@@ -0,0 +1,40 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+/* Helpers shared by the benchmarks. Included after the header defining nn_real,
+ * which is either the public or the internal one. */
+
+#ifndef NN_BENCH_H
+#define NN_BENCH_H
+
+#include <stdlib.h>
+#include <time.h>
+
+static inline double seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static inline nn_real uniform(void) {
+    return (nn_real)rand() / RAND_MAX;
+}
+
+/* Thread counts are swept over the powers of two up to maxthreads,
+ * which is measured as well: returns the count following the given one. */
+static inline int next_threads(int threads, int maxthreads) {
+    return threads * 2 < maxthreads ? threads * 2 : maxthreads;
+}
+
+#endif
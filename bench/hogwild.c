@@ -0,0 +1,137 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+/* Compares asynchronous (Hogwild) training with the synchronous modes:
+ * sequential per-sample steps of nn_backpropagate and data-parallel mini-batches.
+ * Every run trains the same network from the same weights for the same number
+ * of epochs on synthetic data with sparse inputs, then reports the throughput
+ * and the loss over the whole dataset. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "nn/nn.h"
+#include "bench.h"
+
+#define INPUTS 784
+#define OUTPUTS 10
+#define SAMPLES 8192
+#define EPOCHS 3
+#define DENSITY 10 /* percent of nonzero inputs */
+#define LEARNING_RATE 0.1
+#define BATCH 32 /* of the synchronous mini-batch mode */
+#define BATCH_LEARNING_RATE 1.0 /* for the averaged gradients of a batch */
+
+enum { SERIAL, SYNC, HOGWILD };
+static const char *names[] = { "sgd", "sync batch", "hogwild" };
+
+static nn_real *input, *target;
+static int hidden;
+
+/* Generates a dataset of noisy sparse class prototypes. */
+static int generate(void) {
+    input = calloc((size_t)SAMPLES * INPUTS, sizeof(nn_real));
+    target = calloc((size_t)SAMPLES * OUTPUTS, sizeof(nn_real));
+    nn_real *prototypes = calloc(OUTPUTS * INPUTS, sizeof(nn_real));
+    if (!input || !target || !prototypes) {
+        free(prototypes);
+        return 0;
+    }
+
+    srand(1);
+    for (int i = 0; i < OUTPUTS * INPUTS; i++)
+        prototypes[i] = rand() % 100 < DENSITY ? uniform() : 0;
+
+    for (long s = 0; s < SAMPLES; s++) {
+        int c = rand() % OUTPUTS;
+        for (int i = 0; i < INPUTS; i++) {
+            nn_real p = prototypes[c*INPUTS + i];
+            input[s*INPUTS + i] = p > 0 ? p * (nn_real)0.5 + uniform() * (nn_real)0.5 : 0;
+        }
+        target[s*OUTPUTS + c] = 1;
+    }
+
+    free(prototypes);
+    return 1;
+}
+
+static void run(int mode, int threads) {
+    /* Every run starts from the same initial weights. */
+    neuralnetwork *nn = nn_create(INPUTS);
+    nn_seed(nn, 1);
+    nn_addlayer(nn, hidden, NULL, NULL, SIGMOID);
+    nn_addlayer(nn, OUTPUTS, NULL, NULL, SIGMOID);
+
+    nn_trainer *trainer = mode != SERIAL ? nn_trainer_create(nn, threads) : NULL;
+
+    double start = seconds();
+    for (int epoch = 0; epoch < EPOCHS; epoch++) {
+        switch (mode) {
+        case SERIAL:
+            for (int s = 0; s < SAMPLES; s++)
+                nn_backpropagate(nn, input + (long)s * INPUTS, target + (long)s * OUTPUTS, LEARNING_RATE);
+            break;
+        case SYNC:
+            for (int s = 0; s + BATCH <= SAMPLES; s += BATCH)
+                nn_trainer_train_batch(trainer, input + (long)s * INPUTS, target + (long)s * OUTPUTS,
+                                       BATCH, BATCH_LEARNING_RATE);
+            break;
+        case HOGWILD:
+            nn_trainer_train_hogwild(trainer, input, target, SAMPLES, LEARNING_RATE);
+            break;
+        }
+    }
+    double rate = (double)EPOCHS * SAMPLES / (seconds() - start);
+
+    /* Loss of the trained network over the whole dataset. */
+    double loss = nn_train_batch(nn, input, target, SAMPLES, 0);
+    printf("%-12s %7d %12.1f %10.6f\n", names[mode], threads, rate, loss);
+
+    nn_trainer_destroy(trainer);
+    nn_destroy(nn);
+}
+
+int main(int argc, char *argv[]) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    int maxthreads = argc > 1 ? atoi(argv[1]) : online > 0 ? online : 1;
+    hidden = argc > 2 ? atoi(argv[2]) : 300;
+    if (maxthreads < 1 || hidden < 1) {
+        fprintf(stderr, "Usage: %s [max threads] [hidden neurons]\n", argv[0]);
+        return 1;
+    }
+
+    if (!generate()) {
+        perror(argv[0]);
+        return 1;
+    }
+
+    printf("%d-%d-%d network, %d samples, %d epochs, %d%% dense inputs\n",
+           INPUTS, hidden, OUTPUTS, SAMPLES, EPOCHS, DENSITY);
+    printf("mode         threads    samples/s       loss\n");
+
+    run(SERIAL, 1);
+
+    /* The sequential steps have no threads to scale with, unlike the other modes. */
+    for (int mode = SYNC; mode <= HOGWILD; mode++) {
+        for (int threads = 1; ; threads = next_threads(threads, maxthreads)) {
+            run(mode, threads);
+            if (threads == maxthreads) break;
+        }
+    }
+
+    free(input);
+    free(target);
+    return 0;
+}
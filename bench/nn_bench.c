@@ -0,0 +1,450 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+/* Benchmark suite of the library. Sweeps layer shapes and batch sizes over the
+ * matrix and activation kernels, then measures the end-to-end paths: forward pass,
+ * training step and file load. Every case reports the throughput, the latency
+ * percentiles of single iterations and the memory allocated per iteration,
+ * as a table and optionally as JSON, so that runs can be compared.
+ *
+ * The kernels are internal, hence the benchmark is built against the sources
+ * rather than nn/nn.h. Allocations are counted by wrapping the allocator
+ * at link time, see CMakeLists.txt. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+#include "neuralnetwork.h"
+#include "trainer.h"
+#include "util.h"
+#include "simd.h"
+#include "bench.h"
+
+#define MAX_ITERATIONS 100000
+#define MIN_SAMPLE 10e-6 /* seconds, shorter calls are timed in groups */
+
+/* Allocator wrappers, counting every allocation of the library and the benchmark. */
+static atomic_ullong alloc_bytes, alloc_count;
+
+#ifdef NN_BENCH_WRAP
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+void *__real_aligned_alloc(size_t alignment, size_t size);
+
+static void count_alloc(size_t size) {
+    atomic_fetch_add_explicit(&alloc_bytes, size, memory_order_relaxed);
+    atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+}
+
+void *__wrap_malloc(size_t size) {
+    count_alloc(size);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    count_alloc(n * size);
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+    count_alloc(size);
+    return __real_realloc(p, size);
+}
+
+void *__wrap_aligned_alloc(size_t alignment, size_t size) {
+    count_alloc(size);
+    return __real_aligned_alloc(alignment, size);
+}
+#endif
+
+typedef struct result {
+    const char *suite;
+    char name[48];
+    int iterations;
+    double flops; /* per iteration, 0 where it does not apply */
+    double items; /* samples or elements per iteration */
+    double mean, p50, p90, p99; /* seconds per iteration */
+    double bytes, allocs; /* allocated per iteration */
+} result;
+
+static result *results;
+static int nresults;
+
+static double min_time = 0.25; /* seconds spent measuring every case */
+static const char *filter; /* suite to run, all if NULL */
+
+static nn_real *random_array(size_t n) {
+    nn_real *a = malloc(n * sizeof(nn_real));
+    if (!a) {
+        perror(__func__);
+        exit(1);
+    }
+    for (size_t i = 0; i < n; i++) a[i] = uniform() - (nn_real)0.5;
+    return a;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int selected(const char *suite) {
+    return filter == NULL || strcmp(filter, suite) == 0;
+}
+
+/* Measures fn until min_time has passed, recording the time of every iteration.
+ * Calls shorter than MIN_SAMPLE are timed in groups, whose mean is the sample. */
+static void measure(const char *suite, const char *name, void (*fn)(void *), void *arg,
+                    double flops, double items) {
+    /* Warm-up, which also allocates the buffers of the contexts. */
+    double t = seconds();
+    fn(arg);
+    t = seconds() - t;
+
+    int group = t < MIN_SAMPLE ? MIN_SAMPLE / (t > 1e-9 ? t : 1e-9) + 1 : 1;
+    double *samples = malloc(MAX_ITERATIONS * sizeof(double));
+    if (!samples) {
+        perror(__func__);
+        exit(1);
+    }
+
+    unsigned long long bytes = atomic_load(&alloc_bytes), allocs = atomic_load(&alloc_count);
+    int n = 0, calls = 0;
+    double start = seconds(), total = 0;
+    while (n < MAX_ITERATIONS && (total < min_time || n < 5)) {
+        double t0 = seconds();
+        for (int k = 0; k < group; k++) fn(arg);
+        double dt = seconds() - t0;
+
+        samples[n++] = dt / group;
+        calls += group;
+        total = seconds() - start;
+    }
+    bytes = atomic_load(&alloc_bytes) - bytes;
+    allocs = atomic_load(&alloc_count) - allocs;
+
+    qsort(samples, n, sizeof(double), compare_doubles);
+
+    result *r = realloc(results, (nresults + 1) * sizeof(result));
+    if (!r) {
+        perror(__func__);
+        exit(1);
+    }
+    results = r;
+    r = &results[nresults++];
+
+    r->suite = suite;
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->iterations = calls;
+    r->flops = flops;
+    r->items = items;
+    r->mean = total / calls;
+    r->p50 = samples[n / 2];
+    r->p90 = samples[(int)(n * 0.9)];
+    r->p99 = samples[(int)(n * 0.99)];
+    r->bytes = (double)bytes / calls;
+    r->allocs = (double)allocs / calls;
+
+    printf("%-10s %-28s %9d %9.2f %12.1f %10.2f %10.2f %10.2f %10.0f %7.2f\n",
+           r->suite, r->name, r->iterations, r->flops / r->mean * 1e-9, r->items / r->mean,
+           r->p50 * 1e6, r->p90 * 1e6, r->p99 * 1e6, r->bytes, r->allocs);
+    fflush(stdout);
+
+    free(samples);
+}
+
+/* Kernels */
+
+struct product_args {
+    matrix a, b, out;
+};
+
+static void run_product(void *arg) {
+    struct product_args *p = arg;
+    matrix_product(&p->a, &p->b, &p->out);
+}
+
+/* y = A*x (GEMV) if batch is 1, Y = A*X (GEMM) otherwise, as in a layer of m outputs and n inputs. */
+static void bench_product(const char *suite, int m, int n, int batch) {
+    struct product_args p = {
+        { m, n, random_array((size_t)m * n) },
+        { n, batch, random_array((size_t)n * batch) },
+        { m, batch, random_array((size_t)m * batch) },
+    };
+
+    char name[48];
+    if (batch == 1) {
+        snprintf(name, sizeof(name), "%dx%d", m, n);
+    } else snprintf(name, sizeof(name), "%dx%d batch %d", m, n, batch);
+
+    measure(suite, name, run_product, &p, 2.0 * m * n * batch, batch);
+
+    free(p.a.data);
+    free(p.b.data);
+    free(p.out.data);
+}
+
+struct activation_args {
+    int activation, n;
+    nn_real *net, *out;
+};
+
+/* Softmax normalizes batches of this many outputs, the other activations are elementwise. */
+#define BENCH_CLASSES 16
+
+static void run_activation(void *arg) {
+    struct activation_args *a = arg;
+    int rows = a->activation == SOFTMAX ? BENCH_CLASSES : a->n;
+    activation_forward(a->activation, a->net, a->out, rows, a->n / rows);
+}
+
+static void bench_activations(void) {
+    static const char *names[ACTIVATIONS_N] = {
+        "identity", "step", "tanh", "relu", "relu_leaky", "gaussian", "sigmoid", "softplus",
+        "softmax"
+    };
+    const int n = 1 << 16;
+
+    struct activation_args a = { 0, n, random_array(n), random_array(n) };
+    for (a.activation = 0; a.activation < ACTIVATIONS_N; a.activation++)
+        measure("activation", names[a.activation], run_activation, &a, 0, n);
+
+    free(a.net);
+    free(a.out);
+}
+
+struct update_args {
+    neuralnetwork *nn;
+    nn_real *grads;
+    optimizer_step step;
+};
+
+static void run_update(void *arg) {
+    struct update_args *a = arg;
+    optimizer_update(a->nn, &a->step, a->grads, 0, a->nn->nparams);
+}
+
+/* A single update of a 1024-1024-1024 network's parameters, items being the parameters. */
+static void bench_optimizers(void) {
+    static const char *names[OPTIMIZERS_N] = { "sgd", "momentum", "nesterov", "adam" };
+
+    struct update_args a = { .nn = nn_create(1024) };
+    nn_addlayer(a.nn, 1024, NULL, NULL, SIGMOID);
+    nn_addlayer(a.nn, 1024, NULL, NULL, SIGMOID);
+    a.grads = random_array(a.nn->nparams);
+
+    for (int type = 0; type < OPTIMIZERS_N; type++) {
+        nn_setoptimizer(a.nn, type, 0, 0);
+        optimizer_coefficients(a.nn, 1e-6, optimizer_begin(a.nn, 1), &a.step);
+        measure("optimizer", names[type], run_update, &a,
+                (1 + 4.0 * optimizer_nstates(type)) * a.nn->nparams, a.nn->nparams);
+    }
+
+    free(a.grads);
+    nn_destroy(a.nn);
+}
+
+/* End-to-end */
+
+/* Network of the given widths, the first one being the inputs, with sigmoid layers. */
+static neuralnetwork *create_network(const int *widths, int nwidths) {
+    neuralnetwork *nn = nn_create(widths[0]);
+    for (int i = 1; i < nwidths; i++)
+        nn_addlayer(nn, widths[i], NULL, NULL, SIGMOID);
+    return nn;
+}
+
+/* Floating point operations of the products of a forward pass of a sample. */
+static double forward_flops(const int *widths, int nwidths) {
+    double flops = 0;
+    for (int i = 1; i < nwidths; i++)
+        flops += 2.0 * widths[i-1] * widths[i];
+    return flops;
+}
+
+static void network_name(char *name, size_t size, const int *widths, int nwidths, int batch) {
+    int len = 0;
+    for (int i = 0; i < nwidths; i++)
+        len += snprintf(name + len, size - len, i ? "-%d" : "%d", widths[i]);
+    if (batch > 1)
+        snprintf(name + len, size - len, " batch %d", batch);
+}
+
+struct network_args {
+    neuralnetwork *nn;
+    nn_trainer *trainer;
+    nn_real *input, *target;
+    int batch;
+    const char *filename;
+};
+
+static void run_forward(void *arg) {
+    struct network_args *a = arg;
+    if (a->batch == 1) {
+        nn_forwardpropagate(a->nn, a->input);
+    } else nn_forwardpropagate_batch(a->nn, a->input, a->batch);
+}
+
+static void run_train(void *arg) {
+    struct network_args *a = arg;
+    if (a->trainer) {
+        nn_trainer_train_batch(a->trainer, a->input, a->target, a->batch, 0.01);
+    } else if (a->batch == 1) {
+        nn_backpropagate(a->nn, a->input, a->target, 0.01);
+    } else nn_train_batch(a->nn, a->input, a->target, a->batch, 0.01);
+}
+
+static void run_load(void *arg) {
+    struct network_args *a = arg;
+    neuralnetwork *nn = nn_readfile(a->filename);
+    if (!nn) exit(1);
+
+    /* Includes touching every page of the parameters once. */
+    nn_forwardpropagate(nn, a->input);
+    nn_destroy(nn);
+}
+
+static void bench_network(const int *widths, int nwidths) {
+    static const int batches[] = { 1, 32, 256 };
+    const int nbatches = sizeof(batches) / sizeof(batches[0]);
+    const int maxbatch = batches[nbatches-1];
+
+    struct network_args a = { create_network(widths, nwidths), NULL,
+                              random_array((size_t)maxbatch * widths[0]),
+                              random_array((size_t)maxbatch * widths[nwidths-1]), 1, NULL };
+    double flops = forward_flops(widths, nwidths);
+    char name[48];
+
+    for (int b = 0; b < nbatches && selected("forward"); b++) {
+        a.batch = batches[b];
+        network_name(name, sizeof(name), widths, nwidths, a.batch);
+        measure("forward", name, run_forward, &a, flops * a.batch, a.batch);
+    }
+
+    /* The backward pass computes two products per layer, the first layer's delta aside. */
+    for (int b = 0; b < nbatches && selected("train"); b++) {
+        a.batch = batches[b];
+        network_name(name, sizeof(name), widths, nwidths, a.batch);
+        measure("train", name, run_train, &a, 3 * flops * a.batch, a.batch);
+    }
+
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    if (online > 1 && selected("train")) {
+        a.trainer = nn_trainer_create(a.nn, 0);
+        a.batch = maxbatch;
+        network_name(name, sizeof(name), widths, nwidths, a.batch);
+        snprintf(name + strlen(name), sizeof(name) - strlen(name), " x%ld", online);
+        measure("train", name, run_train, &a, 3 * flops * a.batch, a.batch);
+        nn_trainer_destroy(a.trainer);
+        a.trainer = NULL;
+    }
+
+    if (selected("load")) {
+        char filename[64];
+        snprintf(filename, sizeof(filename), "/tmp/nn_bench_%d.nn", (int)getpid());
+        if (nn_writefile(a.nn, filename)) {
+            a.filename = filename;
+            network_name(name, sizeof(name), widths, nwidths, 1);
+            measure("load", name, run_load, &a, 0, 1);
+            remove(filename);
+        }
+    }
+
+    free(a.input);
+    free(a.target);
+    nn_destroy(a.nn);
+}
+
+static void write_json(const char *filename) {
+    FILE *file = fopen(filename, "w");
+    if (!file) {
+        perror(filename);
+        return;
+    }
+
+    fprintf(file, "{\n  \"precision\": \"%s\",\n  \"isa\": \"%s\",\n  \"results\": [\n",
+            sizeof(nn_real) == sizeof(double) ? "double" : "float", simd_isa_name(simd_isa()));
+
+    for (int i = 0; i < nresults; i++) {
+        const result *r = &results[i];
+        fprintf(file, "    {\"suite\": \"%s\", \"name\": \"%s\", \"iterations\": %d, "
+                "\"gflops\": %.4f, \"items_per_sec\": %.2f, "
+                "\"latency_us\": {\"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f}, "
+                "\"alloc_bytes\": %.1f, \"allocs\": %.3f}%s\n",
+                r->suite, r->name, r->iterations, r->flops / r->mean * 1e-9, r->items / r->mean,
+                r->mean * 1e6, r->p50 * 1e6, r->p90 * 1e6, r->p99 * 1e6,
+                r->bytes, r->allocs, i + 1 < nresults ? "," : "");
+    }
+
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+}
+
+int main(int argc, char *argv[]) {
+    const char *json = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            min_time = 0.05;
+        } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json = argv[++i];
+        } else if (strcmp(argv[i], "--suite") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--quick] [--json output.json] "
+                    "[--suite gemv|gemm|activation|optimizer|forward|train|load]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    srand(1);
+
+    printf("%s precision, %s kernels\n", sizeof(nn_real) == sizeof(double) ? "double" : "single",
+           simd_isa_name(simd_isa()));
+    printf("%-10s %-28s %9s %9s %12s %10s %10s %10s %10s %7s\n", "suite", "case", "iters",
+           "GFLOP/s", "items/s", "p50 us", "p90 us", "p99 us", "alloc B", "allocs");
+
+    static const int shapes[][2] = { { 10, 300 }, { 300, 784 }, { 1024, 1024 }, { 4096, 1024 } };
+    const int nshapes = sizeof(shapes) / sizeof(shapes[0]);
+
+    for (int s = 0; s < nshapes && selected("gemv"); s++)
+        bench_product("gemv", shapes[s][0], shapes[s][1], 1);
+
+    static const int batches[] = { 16, 64, 256 };
+    for (int s = 1; s < nshapes - 1 && selected("gemm"); s++) {
+        for (int b = 0; b < (int)(sizeof(batches) / sizeof(batches[0])); b++)
+            bench_product("gemm", shapes[s][0], shapes[s][1], batches[b]);
+    }
+
+    if (selected("activation"))
+        bench_activations();
+
+    if (selected("optimizer"))
+        bench_optimizers();
+
+    static const int mnist[] = { 784, 300, 10 };
+    static const int wide[] = { 784, 1024, 1024, 10 };
+    bench_network(mnist, sizeof(mnist) / sizeof(mnist[0]));
+    bench_network(wide, sizeof(wide) / sizeof(wide[0]));
+
+    if (json)
+        write_json(json);
+
+    free(results);
+    return 0;
+}
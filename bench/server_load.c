@@ -0,0 +1,215 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+/* Loads nn_server with concurrent clients, each sending requests of random inputs
+ * one after another. Reports the throughput and latencies seen by the clients,
+ * followed by the statistics of the server. Given the network file, every reply
+ * is checked against nn_forwardpropagate of the same network. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "nn/nn.h"
+#include "../tools/server.h"
+#include "bench.h"
+
+/* Batched and single forward passes sum in different orders. */
+#ifdef NN_FLOAT
+#define TOLERANCE 1e-4
+#else
+#define TOLERANCE 1e-9
+#endif
+
+typedef struct client {
+    const char *path;
+    const neuralnetwork *nn; /* reference, may be NULL */
+    int requests;
+    unsigned seed;
+
+    double *latency; /* us, per request */
+    long mismatches;
+    int failed;
+} client;
+
+/* Connects and checks the hello, returns -1 on failure. */
+static int connect_server(const char *path, server_hello *hello) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    if (!read_full(fd, hello, sizeof(*hello)) || hello->magic != SERVER_MAGIC ||
+        hello->version != SERVER_VERSION || hello->realsize != sizeof(nn_real)) {
+        fprintf(stderr, "%s: not a compatible server\n", path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void *client_main(void *arg) {
+    client *c = arg;
+    server_hello hello;
+    int fd = connect_server(c->path, &hello);
+    if (fd < 0) {
+        c->failed = 1;
+        return NULL;
+    }
+
+    nn_context *ctx = c->nn ? nn_context_create(c->nn) : NULL;
+    uint32_t op = SERVER_INFER;
+    size_t size = sizeof(op) + hello.inputs * sizeof(nn_real);
+    char *message = malloc(size);
+    nn_real *input = (nn_real *)(message + sizeof(op));
+    nn_real *output = malloc(hello.outputs * sizeof(nn_real));
+    if (!message || !output || (c->nn && !ctx)) {
+        perror(__func__);
+        exit(1);
+    }
+    memcpy(message, &op, sizeof(op));
+
+    for (int i = 0; i < c->requests; i++) {
+        for (uint32_t j = 0; j < hello.inputs; j++)
+            input[j] = (nn_real)rand_r(&c->seed) / RAND_MAX;
+
+        double start = seconds();
+        if (!write_full(fd, message, size) ||
+            !read_full(fd, output, hello.outputs * sizeof(nn_real))) {
+            fprintf(stderr, "%s: connection lost\n", c->path);
+            c->failed = 1;
+            break;
+        }
+        c->latency[i] = (seconds() - start) * 1e6;
+
+        if (ctx) {
+            nn_real *expected = nn_context_forwardpropagate(ctx, input);
+            for (uint32_t j = 0; j < hello.outputs; j++) {
+                if (fabs(output[j] - expected[j]) > TOLERANCE * (1 + fabs(expected[j]))) {
+                    c->mismatches++;
+                    break;
+                }
+            }
+        }
+    }
+
+    close(fd);
+    free(output);
+    free(message);
+    if (ctx) nn_context_destroy(ctx);
+    return NULL;
+}
+
+static int compare(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Prints the statistics of the server. */
+static int print_stats(const char *path) {
+    server_hello hello;
+    int fd = connect_server(path, &hello);
+    if (fd < 0)
+        return 0;
+
+    uint32_t op = SERVER_STATS, len;
+    char *text = NULL;
+    int ok = write_full(fd, &op, sizeof(op)) && read_full(fd, &len, sizeof(len)) &&
+             (text = malloc(len)) && read_full(fd, text, len);
+    if (ok) {
+        printf("server:\n");
+        fwrite(text, 1, len, stdout);
+    }
+    free(text);
+    close(fd);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    int nclients = argc > 2 ? atoi(argv[2]) : 16;
+    int requests = argc > 3 ? atoi(argv[3]) : 1000;
+    if (argc < 2 || argc > 5 || nclients < 1 || requests < 1) {
+        fprintf(stderr, "Usage: %s socket [clients] [requests per client] [network.nn]\n", argv[0]);
+        return 1;
+    }
+
+    neuralnetwork *nn = NULL;
+    if (argc > 4 && !(nn = nn_readfile(argv[4]))) {
+        fprintf(stderr, "%s: failed to read the network\n", argv[4]);
+        return 1;
+    }
+
+    client *clients = calloc(nclients, sizeof(client));
+    pthread_t *threads = malloc(nclients * sizeof(pthread_t));
+    double *latency = malloc((size_t)nclients * requests * sizeof(double));
+    if (!clients || !threads || !latency) {
+        perror(argv[0]);
+        return 1;
+    }
+
+    double start = seconds();
+    int started = 0, failed = 0;
+    for (; started < nclients; started++) {
+        int i = started;
+        clients[i] = (client){
+            .path = argv[1], .nn = nn, .requests = requests, .seed = i + 1,
+            .latency = latency + (size_t)i * requests,
+        };
+        int err = pthread_create(&threads[i], NULL, client_main, &clients[i]);
+        if (err) {
+            fprintf(stderr, "%s: pthread_create failed with %d\n", argv[0], err);
+            failed = 1;
+            break;
+        }
+    }
+
+    /* Only the clients started are waited for, the rest never ran. */
+    long mismatches = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        mismatches += clients[i].mismatches;
+        failed |= clients[i].failed;
+    }
+    double elapsed = seconds() - start;
+    if (failed)
+        return 1;
+
+    long total = (long)nclients * requests;
+    qsort(latency, total, sizeof(double), compare);
+    printf("%d clients, %ld requests in %.3f s: %.0f requests/s\n",
+           nclients, total, elapsed, total / elapsed);
+    printf("latency (us): p50 %.0f, p90 %.0f, p99 %.0f, max %.0f\n",
+           latency[total / 2], latency[total * 9 / 10], latency[total * 99 / 100], latency[total - 1]);
+    if (nn)
+        printf("mismatches: %ld\n", mismatches);
+
+    int ok = print_stats(argv[1]);
+
+    free(latency);
+    free(threads);
+    free(clients);
+    if (nn) nn_destroy(nn);
+    return ok && mismatches == 0 ? 0 : 1;
+}
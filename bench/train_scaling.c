@@ -0,0 +1,99 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+/* Measures the scaling of the multithreaded trainer over the number of threads.
+ * Every run trains the same MNIST sized network from the same weights
+ * on the same synthetic data, so the final errors should agree up to rounding. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "nn/nn.h"
+#include "bench.h"
+
+#define INPUTS 784
+#define OUTPUTS 10
+#define BATCHES 16 /* distinct batches of the dataset */
+#define STEPS 48
+#define LEARNING_RATE 0.5
+
+int main(int argc, char *argv[]) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    int maxthreads = argc > 1 ? atoi(argv[1]) : online > 0 ? online : 1;
+    int batch = argc > 2 ? atoi(argv[2]) : 256;
+    int hidden = argc > 3 ? atoi(argv[3]) : 300;
+    if (maxthreads < 1 || batch < 1 || hidden < 1) {
+        fprintf(stderr, "Usage: %s [max threads] [batch size] [hidden neurons]\n", argv[0]);
+        return 1;
+    }
+
+    /* Fixed initial weights and dataset. */
+    srand(1);
+    nn_real *w1 = malloc((size_t)hidden * INPUTS * sizeof(nn_real));
+    nn_real *w2 = malloc((size_t)OUTPUTS * hidden * sizeof(nn_real));
+    nn_real *input = malloc((size_t)BATCHES * batch * INPUTS * sizeof(nn_real));
+    nn_real *target = calloc((size_t)BATCHES * batch * OUTPUTS, sizeof(nn_real));
+    if (!w1 || !w2 || !input || !target) {
+        perror(argv[0]);
+        return 1;
+    }
+
+    for (long i = 0; i < (long)hidden * INPUTS; i++) w1[i] = (uniform() - 0.5) * 0.1;
+    for (long i = 0; i < (long)OUTPUTS * hidden; i++) w2[i] = (uniform() - 0.5) * 0.1;
+    for (long s = 0; s < (long)BATCHES * batch; s++) {
+        for (int i = 0; i < INPUTS; i++) input[s*INPUTS + i] = uniform();
+        target[s*OUTPUTS + rand() % OUTPUTS] = 1;
+    }
+
+    printf("%d-%d-%d network, batch %d, %d steps, %s precision\n", INPUTS, hidden, OUTPUTS,
+           batch, STEPS, sizeof(nn_real) == sizeof(double) ? "double" : "single");
+    printf("threads    samples/s   speedup  efficiency     error\n");
+
+    double base = 0;
+    for (int threads = 1; ; threads = next_threads(threads, maxthreads)) {
+        neuralnetwork *nn = nn_create(INPUTS);
+        nn_addlayer(nn, hidden, w1, NULL, SIGMOID);
+        nn_addlayer(nn, OUTPUTS, w2, NULL, SIGMOID);
+
+        nn_trainer *trainer = nn_trainer_create(nn, threads);
+        if (!trainer) return 1;
+
+        /* The first batch allocates the buffers of the workers. */
+        nn_trainer_train_batch(trainer, input, target, batch, LEARNING_RATE);
+
+        double error = 0, start = seconds();
+        for (int step = 0; step < STEPS; step++) {
+            long offset = (long)(step % BATCHES) * batch;
+            error = nn_trainer_train_batch(trainer, input + offset * INPUTS,
+                                           target + offset * OUTPUTS, batch, LEARNING_RATE);
+        }
+        double rate = (double)STEPS * batch / (seconds() - start);
+
+        if (threads == 1) base = rate;
+        printf("%7d %12.1f %9.2f %10.1f%% %9.6f\n", threads, rate, rate / base,
+               100 * rate / base / threads, error);
+
+        nn_trainer_destroy(trainer);
+        nn_destroy(nn);
+
+        if (threads == maxthreads) break;
+    }
+
+    free(w1);
+    free(w2);
+    free(input);
+    free(target);
+    return 0;
+}
@@ -15,8 +15,12 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdint.h>
-#include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb/stb_image.h"
@@ -25,148 +29,296 @@
 #include "stb/stb_image_resize.h"
 
 #include "nn/nn.h"
+#include "../tools/tools.h"
 
-#define LEARNING_RATE 0.5
+#define LEARNING_RATE 0.05
 #define PIXEL_ROWS 28
 #define PIXEL_COLS 28
-
-/* MNIST database is stored in Big Endian. */
-#ifndef __BIG_ENDIAN__
-#define betoh(x)                                                \
-    ((((x) & 0xff000000u) >> 24) | (((x) & 0x00ff0000u) >> 8)	\
-     | (((x) & 0x0000ff00u) << 8) | (((x) & 0x000000ffu) << 24))
-#else
-#define betoh(x) (x)
-#endif
+#define DIGITS 10
+#define BATCH 64 /* samples converted at once by the loader thread, images classified at once */
+#define PIPELINE 4 /* batches of images decoded ahead of the classification */
 
 /* Path to the pretrained network. */
 const char *netfile = "mnist/net.nn";
 
-/* Used for MNIST training. */
-struct {
-    FILE *images;
-    FILE *labels;
-    double *pixels;
-    double *target;
-    uint32_t nleft;
-} imageset = { NULL, NULL, NULL, NULL, 0 };
-
-/* Closes opened training set. */
-void imageset_close() {
-    if (imageset.images) fclose(imageset.images);
-    if (imageset.labels) fclose(imageset.labels);
-    if (imageset.pixels) free(imageset.pixels);
-    if (imageset.target) free(imageset.target);
-}
+/* Trains the network and saves it to the path. */
+int train() {
+    nn_dataset *ds = nn_dataset_open("mnist/train-images-idx3-ubyte", "mnist/train-labels-idx1-ubyte",
+                                     BATCH, 0);
+    if (!ds) {
+        return -1;
+    }
 
-/* Opens and reads the necessary values from the MNIST database. */
-int imageset_open(const char *images, const char *labels) {
-    imageset.images = fopen(images, "rb");
-    imageset.labels = fopen(labels, "rb");
+    if (nn_dataset_ninputs(ds) != PIXEL_ROWS*PIXEL_COLS || nn_dataset_nclasses(ds) != DIGITS) {
+        fprintf(stderr, "%s: not a dataset of %dx%d digits\n", __func__, PIXEL_ROWS, PIXEL_COLS);
+        nn_dataset_close(ds);
+        return -1;
+    }
 
-    if (!imageset.images || !imageset.labels) {
-        imageset_close();
-        return 0;
+    neuralnetwork *nn = nn_create(PIXEL_ROWS*PIXEL_COLS);
+    nn_addlayer(nn, 300, NULL, NULL, SIGMOID);
+    nn_addlayer(nn, DIGITS, NULL, NULL, SOFTMAX);
+
+    /* One epoch, sample by sample, while the next batch is being loaded. */
+    int n, nleft = nn_dataset_size(ds);
+    nn_real *pixels, *target;
+    while ((n = nn_dataset_next(ds, &pixels, &target, NULL)) > 0) {
+        double Etotal = 0;
+        for (int i = 0; i < n; i++) {
+            Etotal += nn_backpropagate(nn, pixels + i*PIXEL_ROWS*PIXEL_COLS, target + i*DIGITS,
+                                       LEARNING_RATE);
+        }
+
+        nleft -= n;
+        printf("Etotal = %lf | %d\n", Etotal / n, nleft);
     }
 
-    uint32_t magic_number;
-    fread(&magic_number, sizeof(magic_number), 1, imageset.images);
-    if (betoh(magic_number) != 0x00000803) {
-        fprintf(stderr, "%s: %s: magic number does not match: %X\n", __func__, images, magic_number);
-        imageset_close();
+    nn_writefile(nn, netfile);
+    
+    nn_dataset_close(ds);
+    nn_destroy(nn);
+
+    return 0;
+}
+
+/* Loads the image, resized to the network's input. Pixels are inverted,
+ * as the digits are dark on a light background. Returns 0 on failure. */
+static int load_image(const char *filename, nn_real *input) {
+    /* Do not change this. */
+    const int bytes_per_pixel = 1;
+
+    int x, y;
+    uint8_t *image = stbi_load(filename, &x, &y, NULL, bytes_per_pixel);
+    if (image == NULL)
         return 0;
+
+    /* Resize the image to match the number of inputs. */
+    uint8_t raw[PIXEL_ROWS*PIXEL_COLS];
+    if (x != PIXEL_ROWS || y != PIXEL_COLS) {
+        stbir_resize_uint8(image, x, y, 0, raw, PIXEL_ROWS, PIXEL_COLS, 0, bytes_per_pixel);
+    } else memcpy(raw, image, PIXEL_ROWS*PIXEL_COLS);
+
+    for (int i = 0; i < PIXEL_ROWS*PIXEL_COLS; i++) {
+        input[i] = (nn_real)(255-raw[i]) / 255;
     }
 
-    fread(&magic_number, sizeof(magic_number), 1, imageset.labels);
-    if (betoh(magic_number) != 0x00000801) {
-        fprintf(stderr, "%s: %s: magic number does not match: %X\n", __func__, labels, magic_number);
-        imageset_close();
-        return 0;
+    stbi_image_free(image);
+    return 1;
+}
+
+/* Classifies a single image, printing the whole output of the network. */
+static int classify(neuralnetwork *nn, const char *filename) {
+    nn_real input[PIXEL_ROWS*PIXEL_COLS];
+    if (!load_image(filename, input)) {
+        fprintf(stderr, "Unable to load image %s\n", filename);
+        return 1;
     }
 
-    /* Read number of elements in the database. */
-    uint32_t nleft_i, nleft_l;
-    fread(&nleft_i, sizeof(uint32_t), 1, imageset.images);
-    fread(&nleft_l, sizeof(uint32_t), 1, imageset.labels);
-    if (nleft_i != nleft_l) {
-        imageset_close();
-        return 0;
+    nn_real *output = nn_forwardpropagate(nn, input);
+
+    printf("Neural network output:\n[ ");
+    for (int i = 0; i < nn_noutputs(nn); i++) {
+        printf("%.3lf ", output[i]);
     }
-    
-    imageset.nleft = betoh(nleft_i);
+    printf("]\n => Guess: '%d'\n", argmax(output, nn_noutputs(nn)));
+    return 0;
+}
+
+/* Bulk scoring: decoder threads load the images into a ring of batches,
+ * while the main thread classifies the complete ones in order. */
+typedef struct scorer {
+    char **files;
+    int n;
+    int batch;
+
+    nn_real *input; /* PIPELINE batches of images stored as rows */
+    uint8_t *loaded; /* whether the image of the row has been loaded */
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* signals a change of next, pending or consumed */
+    int next; /* next image to be decoded */
+    int pending[PIPELINE]; /* images of the batch in the slot not decoded yet */
+    int consumed; /* batches classified so far */
+} scorer;
+
+static int batch_size(const scorer *s, int b) {
+    int left = s->n - b * s->batch;
+    return left < s->batch ? (left > 0 ? left : 0) : s->batch;
+}
+
+static void *decoder_main(void *arg) {
+    scorer *s = arg;
+
+    pthread_mutex_lock(&s->lock);
+    while (1) {
+        /* Wait until the slot of the next image's batch is free. */
+        while (s->next < s->n && s->next / s->batch >= s->consumed + PIPELINE)
+            pthread_cond_wait(&s->cond, &s->lock);
+        if (s->next >= s->n) break;
 
-    /* Skip image dimensions, we already know it's PIXEL_ROWS x PIXEL_COLS */
-    fseek(imageset.images, 2*sizeof(uint32_t), SEEK_CUR);
+        int i = s->next++;
+        pthread_mutex_unlock(&s->lock);
 
-    imageset.pixels = malloc(PIXEL_ROWS * PIXEL_COLS * sizeof(double));
-    imageset.target = malloc(10 /* digits */ * sizeof(double));
-    if (!imageset.pixels || !imageset.target) {
-        imageset_close();
-        return 0;        
+        int slot = i / s->batch % PIPELINE;
+        size_t row = (size_t)slot * s->batch + i % s->batch;
+        s->loaded[row] = load_image(s->files[i], s->input + row * PIXEL_ROWS*PIXEL_COLS);
+
+        pthread_mutex_lock(&s->lock);
+        if (--s->pending[slot] == 0)
+            pthread_cond_broadcast(&s->cond);
     }
+    pthread_mutex_unlock(&s->lock);
 
-    return 1;
+    return NULL;
 }
 
-/* Loads next image data into the imageset struct. */
-int imageset_next() {
-    assert(imageset.images);
+/* Prints a line of the file, the guess and its output for every image. */
+static int score(neuralnetwork *nn, char **files, int n, int batch, int nthreads) {
+    scorer s = { .files = files, .n = n, .batch = batch };
+    s.input = calloc((size_t)PIPELINE * batch * PIXEL_ROWS*PIXEL_COLS, sizeof(nn_real));
+    s.loaded = calloc((size_t)PIPELINE * batch, 1);
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    if (!s.input || !s.loaded || !threads) {
+        perror(__func__);
+        free(s.input);
+        free(s.loaded);
+        free(threads);
+        return 1;
+    }
+
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.cond, NULL);
+    for (int b = 0; b < PIPELINE; b++)
+        s.pending[b] = batch_size(&s, b);
 
-    if (imageset.nleft <= 0)
-        return -1;
+    double start = seconds();
+    int started = 0;
+    for (; started < nthreads; started++) {
+        if (pthread_create(&threads[started], NULL, decoder_main, &s) != 0) break;
+    }
 
-    uint8_t *rawpixels = malloc(PIXEL_ROWS*PIXEL_COLS);
-    if (fread(rawpixels, 1, PIXEL_ROWS*PIXEL_COLS, imageset.images) \
-        < PIXEL_ROWS * PIXEL_COLS) {
-        free(rawpixels);
-        return -1;
+    int failed = 0;
+    if (started == 0) {
+        fprintf(stderr, "Unable to start the decoder threads\n");
+        failed = n;
     }
 
-    /* Normalize brightness values between [0, 1] */
-    for (int i = 0; i < PIXEL_ROWS * PIXEL_COLS; i++) {
-        imageset.pixels[i] = rawpixels[i] / 255.0;
+    int outputs = nn_noutputs(nn);
+    for (int b = 0; started > 0 && b * batch < n; b++) {
+        int slot = b % PIPELINE, m = batch_size(&s, b);
+
+        pthread_mutex_lock(&s.lock);
+        while (s.pending[slot] > 0)
+            pthread_cond_wait(&s.cond, &s.lock);
+        pthread_mutex_unlock(&s.lock);
+
+        nn_real *output = nn_forwardpropagate_batch(nn, s.input + (size_t)slot * batch * PIXEL_ROWS*PIXEL_COLS, m);
+        for (int i = 0; i < m; i++) {
+            const char *file = files[b * batch + i];
+            if (!s.loaded[(size_t)slot * batch + i]) {
+                fprintf(stderr, "Unable to load image %s\n", file);
+                failed++;
+                continue;
+            }
+
+            int k = argmax(output + i * outputs, outputs);
+            printf("%s\t%d\t%.3lf\n", file, k, output[i * outputs + k]);
+        }
+
+        /* Hand the slot over to the batch PIPELINE batches ahead. */
+        pthread_mutex_lock(&s.lock);
+        s.pending[slot] = batch_size(&s, b + PIPELINE);
+        s.consumed++;
+        pthread_cond_broadcast(&s.cond);
+        pthread_mutex_unlock(&s.lock);
     }
 
-    free(rawpixels);
+    for (int t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
 
-    /* Read label and create target output. */
-    uint8_t label;
-    if (fread(&label, 1, 1, imageset.labels) < 1 || label < 0 || label > 9) {
-        return -1;
+    double elapsed = seconds() - start;
+    fprintf(stderr, "%d images in %.3lf s, %.1lf images/s, %d failed\n",
+            n, elapsed, elapsed > 0 ? n / elapsed : 0, failed);
+
+    pthread_cond_destroy(&s.cond);
+    pthread_mutex_destroy(&s.lock);
+    free(s.input);
+    free(s.loaded);
+    free(threads);
+    return failed > 0;
+}
+
+/* Growable list of the files to be scored. */
+typedef struct filelist {
+    char **files;
+    int n, size;
+} filelist;
+
+static int filelist_add(filelist *l, const char *file) {
+    if (l->n == l->size) {
+        int size = l->size ? 2 * l->size : 64;
+        char **files = realloc(l->files, size * sizeof(char *));
+        if (files == NULL) {
+            perror(__func__);
+            return 0;
+        }
+        l->files = files;
+        l->size = size;
     }
 
-    for (int i = 0; i < 10; i++) {
-        if (i == label)
-            imageset.target[i] = 1.00;
-        else imageset.target[i] = 0.00;
+    if ((l->files[l->n] = strdup(file)) == NULL) {
+        perror(__func__);
+        return 0;
     }
+    l->n++;
+    return 1;
+}
 
-    imageset.nleft--;
-    return label;
+static int compare_files(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
 }
 
-/* Trains the network and saves it to the path. */
-int train() {
-    neuralnetwork *nn = nn_create(PIXEL_ROWS*PIXEL_COLS);
-    if (!imageset_open("mnist/train-images-idx3-ubyte", "mnist/train-labels-idx1-ubyte")) {
-        return -1;
+/* Adds the regular files of the directory, skipping the hidden ones, sorted by name. */
+static int filelist_directory(filelist *l, const char *path) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        perror(path);
+        return 0;
     }
 
-    nn_addlayer(nn, 300, NULL, NULL, SIGMOID);
-    nn_addlayer(nn, 10, NULL, NULL, SIGMOID);
-    
-    int label;
-    while ((label = imageset_next()) != -1) {
-        double Etotal = nn_backpropagate(nn, imageset.pixels, imageset.target, LEARNING_RATE);
-        printf("Etotal = %lf | %d\n", Etotal, imageset.nleft);
+    int first = l->n, ok = 1;
+    struct dirent *entry;
+    while (ok && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+
+        char file[4096];
+        struct stat st;
+        snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+        if (stat(file, &st) == 0 && S_ISREG(st.st_mode))
+            ok = filelist_add(l, file);
     }
+    closedir(dir);
 
-    nn_writefile(nn, netfile);
-    
-    imageset_close();
-    nn_destroy(nn);
+    qsort(l->files + first, l->n - first, sizeof(char *), compare_files);
+    return ok;
+}
 
-    return 0;
+/* Adds a file per line of the stream. */
+static int filelist_stream(filelist *l, FILE *stream) {
+    char line[4096];
+    while (fgets(line, sizeof(line), stream)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] != '\0' && !filelist_add(l, line))
+            return 0;
+    }
+    return 1;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s image\n"
+            "       %s [-j threads] [-b batch] image|directory|- ...\n"
+            "The second form scores the images in batches, - reads their paths from stdin.\n",
+            program, program);
 }
 
 int main(int argc, char *argv[]) {
@@ -179,46 +331,56 @@ int main(int argc, char *argv[]) {
         return exit_code;
     }
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s image\n", argv[0]);
-        return 1;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = online > 0 ? online : 1, batch = BATCH, options = 0, opt;
+    while ((opt = getopt(argc, argv, "j:b:")) != -1) {
+        switch (opt) {
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        case 'b':
+            batch = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+        options++;
     }
 
-    /* Do not change this. */
-    const int bytes_per_pixel = 1;
-    
-    int x, y, n;
-    uint8_t *image = stbi_load(argv[1], &x, &y, NULL, bytes_per_pixel);
-    if (image == NULL) {
-        fprintf(stderr, "Unable to load image %s\n", argv[1]);
+    if (optind >= argc || nthreads < 1 || batch < 1) {
+        usage(argv[0]);
         return 1;
     }
 
-    /* Resize the image to match the number of inputs. */
-    uint8_t raw[PIXEL_ROWS*PIXEL_COLS];
-    if (x != PIXEL_ROWS || y != PIXEL_COLS) {
-        stbir_resize_uint8(image, x, y, 0, raw, PIXEL_ROWS, PIXEL_COLS, 0, bytes_per_pixel);
-    } else memcpy(raw, image, PIXEL_ROWS*PIXEL_COLS);
-
     /* Read the pretrained network. */
     neuralnetwork *nn = nn_readfile(netfile);
+    if (nn == NULL) return 1;
+
+    /* A single image, as it has always been. */
+    struct stat st;
+    if (options == 0 && optind + 1 == argc && strcmp(argv[optind], "-") != 0 &&
+        !(stat(argv[optind], &st) == 0 && S_ISDIR(st.st_mode))) {
+        int exit_code = classify(nn, argv[optind]);
+        nn_destroy(nn);
+        return exit_code;
+    }
 
-    double input[PIXEL_ROWS*PIXEL_COLS];
-    for (int i = 0; i < PIXEL_ROWS*PIXEL_COLS; i++) {
-        input[i] = (double)(255-raw[i]) / 255.0;
+    filelist list = { 0 };
+    int ok = 1;
+    for (int i = optind; i < argc && ok; i++) {
+        if (strcmp(argv[i], "-") == 0) {
+            ok = filelist_stream(&list, stdin);
+        } else if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+            ok = filelist_directory(&list, argv[i]);
+        } else ok = filelist_add(&list, argv[i]);
     }
 
-    double *output = nn_forwardpropagate(nn, input);
+    int exit_code = ok ? score(nn, list.files, list.n, batch, nthreads) : 1;
 
-    printf("Neural network output:\n[ ");
-    int k = 0;
-    for (int i = 0; i < nn_noutputs(nn); i++) {
-        printf("%.3lf ", output[i]);
-        if (output[i] > output[k]) k = i;
-    }
-    printf("]\n => Guess: '%d'\n", k);
-    
-    stbi_image_free(image);
-    nn_destroy(nn);    
-    return 0;
+    for (int i = 0; i < list.n; i++)
+        free(list.files[i]);
+    free(list.files);
+    nn_destroy(nn);
+    return exit_code;
 }
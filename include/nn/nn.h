@@ -22,16 +22,44 @@
 #ifndef NN_NN_H
 #define NN_NN_H
 
+/**
+ * Floating point type of the weights, inputs and outputs.
+ * The library is built in double precision, unless it is configured
+ * with NN_FLOAT (cmake -DNN_FLOAT=ON), which halves the memory traffic
+ * and doubles the width of the vector kernels.
+ * The define is exported by the CMake target, so the users see the same type.
+ */
+#ifdef NN_FLOAT
+typedef float nn_real;
+#else
+typedef double nn_real;
+#endif
+
 /**
  * Enumeration of all implemented activation functions.
  */
 enum activations {
     IDENTITY = 0, STEP, TANH, RELU, RELU_LEAKY, GAUSSIAN, SIGMOID, SOFTPLUS,
+    SOFTMAX, /* normalizes the outputs of the layer to probabilities, trained with cross-entropy loss */
     ACTIVATIONS_N /* used as the array size for declaration */
 };
 
+/**
+ * Enumeration of the optimizers applying the gradients, see nn_setoptimizer.
+ */
+enum optimizers {
+    SGD = 0, /* plain gradient descent, the default */
+    MOMENTUM, /* gradient descent with momentum */
+    NESTEROV, /* Nesterov accelerated gradient */
+    ADAM, /* adaptive moment estimation, usually with a learning rate of about 0.001 */
+    OPTIMIZERS_N /* used as the array size for declaration */
+};
+
 /**
  * Struct representing a neural network.
+ * Functions not taking a context use one owned by the network, created on first use,
+ * and write its buffers even to propagate forward. Only the nn_context_* functions
+ * are reentrant: a network can be shared by threads through their own contexts.
  */
 typedef struct neuralnetwork neuralnetwork;
 
@@ -48,6 +76,16 @@ neuralnetwork *nn_create(int inputs);
  */
 void nn_destroy(neuralnetwork *nn);
 
+/**
+ * Seeds the random initialization of the layers added to the network afterwards.
+ * Networks are seeded from the clock on creation, a fixed seed makes the initial
+ * weights reproducible: they do not depend on the number of threads filling them,
+ * and differ across CPUs only by rounding of the vector instructions.
+ * @param nn The pointer to the neural network struct.
+ * @param seed Any value.
+ */
+void nn_seed(neuralnetwork *nn, unsigned long long seed);
+
 /**
  * Adds a new layer to the network with specified number of neurons.
  * @param nn The pointer to the neural network struct.
@@ -57,15 +95,55 @@ void nn_destroy(neuralnetwork *nn);
  * @param biases Vector of the biases stored like as an array. NULL initializes biases with zeroes.
  * @param activation Activation function index from the enum.
  */
-void nn_addlayer(neuralnetwork *nn, int nodes, double *weights, double *biases, int activation);
+void nn_addlayer(neuralnetwork *nn, int nodes, nn_real *weights, nn_real *biases, int activation);
+
+/**
+ * Struct holding the buffers written during the forward propagation.
+ * The network is only read through a context, so a single network can be used
+ * by any number of threads at once, each with its own context.
+ */
+typedef struct nn_context nn_context;
 
 /**
  * Forward propagates a given input through the network.
+ * Uses the context owned by the network, hence concurrent calls with the same network
+ * are not allowed. Use nn_context_forwardpropagate for that.
  * @param nn The pointer to the neural network struct.
  * @param input Input vector as an array.
  * @return A pointer to the output array.
  */
-double *nn_forwardpropagate(const neuralnetwork *nn, const double *input);
+nn_real *nn_forwardpropagate(neuralnetwork *nn, const nn_real *input);
+
+/**
+ * Allocates a new execution context for the network.
+ * The context stays valid until the network is destroyed or a layer is added to it.
+ * @param nn The pointer to the neural network struct.
+ * @return A pointer to the heap allocated context. NULL is returned in case of failure.
+ */
+nn_context *nn_context_create(const neuralnetwork *nn);
+
+/**
+ * Deallocates the context.
+ * @param ctx The pointer to the context to be deallocated.
+ */
+void nn_context_destroy(nn_context *ctx);
+
+/**
+ * Forward propagates a given input through the network of the context.
+ * @param ctx The pointer to the context, which must not be used by another thread at the same time.
+ * @param input Input vector as an array.
+ * @return A pointer to the output array owned by the context.
+ */
+nn_real *nn_context_forwardpropagate(nn_context *ctx, const nn_real *input);
+
+/**
+ * Batch version of nn_context_forwardpropagate, see nn_forwardpropagate_batch.
+ * @param ctx The pointer to the context, which must not be used by another thread at the same time.
+ * @param input N x inputs matrix stored as an array, i.e. an input vector per row.
+ * @param n Number of samples N in the batch.
+ * @return A pointer to the N x outputs array owned by the context.
+ */
+nn_real *nn_context_forwardpropagate_batch(nn_context *ctx, const nn_real *input, int n);
 
 /**
  * Performs forward propagation followed by the backpropagation to teach the network. 
@@ -74,9 +152,150 @@ double *nn_forwardpropagate(const neuralnetwork *nn, const double *input);
  * @param target Target output vector as an array.
  * @param learningrate Learning rate for the pass.
  * Passing learning rate of 0 will not perform the back propagation. 
- * @return Mean squared error of the forward pass.
+ * With SGD, the weights are updated in place as the gradients are computed,
+ * without storing them.
+ * @return Mean squared error of the forward pass, or its cross-entropy
+ * if the output layer is SOFTMAX.
+ */
+double nn_backpropagate(neuralnetwork *nn, const nn_real *input, const nn_real *target, double learningrate);
+
+/**
+ * Forward propagates a batch of inputs through the network.
+ * Every layer is applied to the whole batch at once, which is considerably faster
+ * than propagating the samples one by one.
+ * @param nn The pointer to the neural network struct.
+ * @param input N x inputs matrix stored as an array, i.e. an input vector per row.
+ * @param n Number of samples N in the batch.
+ * @return A pointer to the N x outputs array of output vectors stored as rows.
+ * It stays valid until the next call with the same network.
+ */
+nn_real *nn_forwardpropagate_batch(neuralnetwork *nn, const nn_real *input, int n);
+
+/**
+ * Performs mini-batch gradient descent step. Gradients are averaged over the batch
+ * before a single update of the weights.
+ * @param nn The pointer to the neural network struct.
+ * @param input N x inputs matrix stored as an array, i.e. an input vector per row.
+ * @param target N x outputs matrix of target output vectors stored as rows.
+ * @param n Number of samples N in the batch.
+ * @param learningrate Learning rate for the pass.
+ * Passing learning rate of 0 will not perform the back propagation.
+ * @return Error of the forward pass averaged over the batch.
+ */
+double nn_train_batch(neuralnetwork *nn, const nn_real *input, const nn_real *target, int n, double learningrate);
+
+/**
+ * Forward propagates a batch of sparse inputs, given as compressed rows: the inputs
+ * of the j-th sample which are not 0 are index[start[j]] ... index[start[j+1] - 1],
+ * of the values value[start[j]] ... value[start[j+1] - 1], in any order.
+ * Only the weights of these inputs are read by the first layer, which makes inputs
+ * of mostly zeros considerably faster to propagate than stored densely.
+ * Uses the context owned by the network, as nn_forwardpropagate_batch does.
+ * @param nn The pointer to the neural network struct.
+ * @param start N + 1 offsets of the samples in index and value, start[0] being 0.
+ * @param index Indices of the nonzero inputs, each less than the number of inputs.
+ * @param value Values of the nonzero inputs.
+ * @param n Number of samples N in the batch.
+ * @return A pointer to the N x outputs array of output vectors stored as rows,
+ * NULL if the sparse input is invalid.
+ */
+nn_real *nn_forwardpropagate_sparse(neuralnetwork *nn, const int *start, const int *index,
+                                    const nn_real *value, int n);
+
+/**
+ * Context version of nn_forwardpropagate_sparse.
+ * @param ctx The pointer to the context, which must not be used by another thread at the same time.
+ * @return A pointer to the N x outputs array owned by the context, NULL if the input is invalid.
+ */
+nn_real *nn_context_forwardpropagate_sparse(nn_context *ctx, const int *start, const int *index,
+                                            const nn_real *value, int n);
+
+/**
+ * Performs mini-batch gradient descent step with sparse inputs, given as compressed rows
+ * as by nn_forwardpropagate_sparse. Besides the forward pass, only the gradients
+ * of the first layer's weights of the nonzero inputs are computed, the others being 0.
+ * Otherwise the same as nn_train_batch.
+ * @return Error of the forward pass averaged over the batch, NAN if the input is invalid.
+ */
+double nn_train_sparse(neuralnetwork *nn, const int *start, const int *index, const nn_real *value,
+                       const nn_real *target, int n, double learningrate);
+
+/**
+ * Sets the fraction of zero inputs, at which the dense inputs given to any of the functions
+ * are compressed and propagated as sparse ones (see nn_forwardpropagate_sparse).
+ * The default is 0.95, a threshold above 1 disables it. Checking the input costs
+ * a pass over it, which stops once it has turned out to be too dense.
+ * @param nn The pointer to the neural network struct.
+ * @param threshold Fraction of the inputs of a batch which are 0.
+ * @return 1 for success, 0 if the threshold is negative.
+ */
+int nn_setsparsity(neuralnetwork *nn, double threshold);
+
+/**
+ * Selects the optimizer of all the training functions of the network.
+ * Its state (velocities or moments) is kept in arrays laid out like the weights,
+ * allocated on the first step, and every step updates the weights together with
+ * the state in a single pass. Selecting an optimizer, or adding a layer, resets the state.
+ * @param nn The pointer to the neural network struct.
+ * @param optimizer One of enum optimizers.
+ * @param beta1 Momentum of MOMENTUM and NESTEROV, decay of the first moment of ADAM.
+ * 0 selects the default of 0.9.
+ * @param beta2 Decay of the second moment of ADAM, 0 selects the default of 0.999.
+ * @return 1 for success, 0 if the arguments are out of range.
  */
-double nn_backpropagate(const neuralnetwork *nn, const double *input, const double *target, double learningrate);
+int nn_setoptimizer(neuralnetwork *nn, int optimizer, double beta1, double beta2);
+
+/**
+ * Pool of threads training a network together, see nn_trainer_create.
+ */
+typedef struct nn_trainer nn_trainer;
+
+/**
+ * Creates a data-parallel trainer for the network.
+ * Every batch is split among the threads, each computing the gradients of its part
+ * into a buffer of its own. The gradients are then summed in parallel,
+ * every thread taking a slice of the parameters, and applied in a single update.
+ * The trainer stays valid until the network is destroyed or a layer is added to it.
+ * @param nn The pointer to the neural network struct.
+ * @param nthreads Number of threads including the calling one, 0 uses all the online processors.
+ * @return A pointer to the heap allocated trainer. NULL is returned in case of failure.
+ */
+nn_trainer *nn_trainer_create(neuralnetwork *nn, int nthreads);
+
+/**
+ * Terminates the threads and deallocates the trainer.
+ */
+void nn_trainer_destroy(nn_trainer *trainer);
+
+/**
+ * Performs mini-batch gradient descent step using all the threads of the trainer,
+ * see nn_train_batch. Results differ from nn_train_batch only by rounding.
+ * @param trainer The pointer to the trainer, which must not be used by another thread at the same time.
+ * @param input N x inputs matrix stored as an array, i.e. an input vector per row.
+ * @param target N x outputs matrix of target output vectors stored as rows.
+ * @param n Number of samples N in the batch.
+ * @param learningrate Learning rate for the pass.
+ * @return Error of the forward pass averaged over the batch.
+ */
+double nn_trainer_train_batch(nn_trainer *trainer, const nn_real *input, const nn_real *target,
+                              int n, double learningrate);
+
+/**
+ * Asynchronous (Hogwild) stochastic gradient descent using all the threads of the trainer.
+ * The samples are split among the threads, each performing a step per sample,
+ * as nn_backpropagate does, with its own buffers. The shared weights are updated
+ * in place without any locking, so concurrent updates may occasionally overwrite each other.
+ * The same holds for the state of the optimizer.
+ * Trades the determinism for the throughput, results depend on the scheduling.
+ * @param trainer The pointer to the trainer, which must not be used by another thread at the same time.
+ * @param input N x inputs matrix stored as an array, i.e. an input vector per row.
+ * @param target N x outputs matrix of target output vectors stored as rows.
+ * @param n Number of samples N.
+ * @param learningrate Learning rate of every step.
+ * @return Error of the samples, each measured before its own step, averaged over them.
+ */
+double nn_trainer_train_hogwild(nn_trainer *trainer, const nn_real *input, const nn_real *target,
+                                int n, double learningrate);
 
 /**
  * Returns fan-in of the input layer of the network.
@@ -88,7 +307,11 @@ int nn_ninputs(const neuralnetwork *nn);
 int nn_noutputs(const neuralnetwork *nn);
 
 /**
- * Stores the network as a binary file (to keep the double precision).
+ * Stores the network as a binary file (to keep the precision).
+ * The file holds a versioned header with the layer table, followed by the parameters
+ * as nn_real, every tensor 64 byte aligned, just like they are laid out in memory.
+ * It is written under a temporary name first and then renamed over the target.
+ * Weights of the layers pruned by nn_prune are stored as compressed rows when it is smaller.
  * @param nn The pointer to the neural network struct.
  * @param filename The relative path to the file. The file will be overwritten/created.
  * @return Positive integer is returned for success.
@@ -96,11 +319,193 @@ int nn_noutputs(const neuralnetwork *nn);
 int nn_writefile(const neuralnetwork *nn, const char *filename);
 
 /**
- * Reads the network from a binary file created by nn_writefile
- * @param filename The relative path to the file. The file will be overwritten/created.
+ * Reads the network from a binary file created by nn_writefile.
+ * Files of the library's precision are mapped into memory and used in place without copying,
+ * the pages are loaded on first use and shared by all processes reading the same file.
+ * Training modifies private copies of the pages only, never the file.
+ * Files of the other precision or with compressed layers are accepted and converted to nn_real,
+ * as well as the files of the original format without magic, which store doubles.
+ * Compressed layers are read as pruned.
+ * @param filename The relative path to the file.
  * @return Pointer to the newly allocated network struct is returned for success.
  * NULL is returned in case of failure. The error message is printed to stderr.
  */
 neuralnetwork *nn_readfile(const char *filename);
 
+/**
+ * Prunes the weights of the smallest magnitude to zero. The pruned weights stay zero
+ * through any later training, which fine-tunes the remaining ones, and pruning again
+ * only adds to them. Layers with no more than a quarter of nonzero weights are
+ * evaluated by the sparse kernels, touching the nonzero weights only.
+ * @param nn The pointer to the neural network struct.
+ * @param layer Index of the layer to prune, -1 prunes every layer.
+ * @param sparsity Fraction of the weights of every layer to be zeroed at least, from 0 to 1.
+ * @param threshold Weights of smaller magnitude are zeroed as well, 0 for none.
+ * @return Number of the nonzero weights left in the pruned layers, -1 if the arguments are invalid.
+ */
+long nn_prune(neuralnetwork *nn, int layer, double sparsity, double threshold);
+
+/**
+ * Network with int8 weights for inference, see nn_quantize.
+ */
+typedef struct nn_quantized nn_quantized;
+
+/**
+ * Quantizes the weights of a trained network to int8 with a scale for every row.
+ * The inputs of every layer are quantized as well, with a scale per layer calibrated
+ * on the sample inputs, so that the layers are evaluated with integer products.
+ * @param nn The pointer to the neural network struct, which is not modified.
+ * @param input N x inputs matrix of representative samples stored as an array, i.e. a sample per row.
+ * @param n Number of samples N.
+ * @return A pointer to the heap allocated quantized network. NULL is returned in case of failure.
+ */
+nn_quantized *nn_quantize(const neuralnetwork *nn, const nn_real *input, int n);
+
+/**
+ * Deallocates the quantized network.
+ */
+void nn_quantized_destroy(nn_quantized *q);
+
+/**
+ * Forward propagates a given input through the quantized network.
+ * Concurrent calls with the same network are not allowed.
+ * @param q The pointer to the quantized network.
+ * @param input Input vector as an array. Values beyond the calibrated range are saturated.
+ * @return A pointer to the output array owned by the network.
+ */
+nn_real *nn_quantized_forwardpropagate(nn_quantized *q, const nn_real *input);
+
+/**
+ * Stores the quantized network as a binary file, see nn_writefile.
+ */
+int nn_quantized_writefile(const nn_quantized *q, const char *filename);
+
+/**
+ * Reads the quantized network from a binary file created by nn_quantized_writefile.
+ * @return Pointer to the newly allocated network is returned for success.
+ * NULL is returned in case of failure. The error message is printed to stderr.
+ */
+nn_quantized *nn_quantized_readfile(const char *filename);
+
+/**
+ * Labelled dataset stored as a pair of IDX files, e.g. MNIST.
+ */
+typedef struct nn_dataset nn_dataset;
+
+/**
+ * Opens a dataset of unsigned byte IDX images and their labels. The files are mapped
+ * into memory, a background thread converts the next mini-batch while the current one
+ * is being used, so the training does not wait for the I/O and the conversion.
+ * @param images Path to the IDX file of the images, the first dimension counting the samples.
+ * @param labels Path to the IDX file of the labels.
+ * @param batch Maximum number of samples in a mini-batch.
+ * @param shuffle Non-zero to visit the samples in a new random order every epoch.
+ * The order is a permutation of indices, the data itself is never copied.
+ * @return A pointer to the heap allocated dataset. NULL is returned in case of failure,
+ * the error message is printed to stderr.
+ */
+nn_dataset *nn_dataset_open(const char *images, const char *labels, int batch, int shuffle);
+
+/**
+ * Stops the background thread and deallocates the dataset.
+ */
+void nn_dataset_close(nn_dataset *ds);
+
+/**
+ * Returns the number of samples of the dataset.
+ */
+int nn_dataset_size(const nn_dataset *ds);
+
+/**
+ * Returns the number of values of every sample, i.e. the product of the dimensions of an image.
+ */
+int nn_dataset_ninputs(const nn_dataset *ds);
+
+/**
+ * Returns the number of classes, i.e. the greatest label + 1, which is the width of the targets.
+ */
+int nn_dataset_nclasses(const nn_dataset *ds);
+
+/**
+ * Takes the next mini-batch of the dataset. The arrays stay valid until the next call.
+ * @param input Set to the N x inputs matrix of the images stored as an array, a sample per row,
+ * normalized to [0, 1]. May be NULL.
+ * @param target Set to the N x classes matrix of one-hot targets of the samples. May be NULL.
+ * @param labels Set to the array of N labels. May be NULL.
+ * @return Number of samples N. 0 is returned after the last batch of every epoch,
+ * the following call starts the next epoch.
+ */
+int nn_dataset_next(nn_dataset *ds, nn_real **input, nn_real **target,
+                    const unsigned char **labels);
+
+/**
+ * Phases of the hot paths recorded by the profiler.
+ * Loss is recorded for the whole network, the other phases for every layer.
+ */
+enum nn_profile_phase {
+    NN_PROFILE_FORWARD = 0, /* product, bias and activation of the forward pass */
+    NN_PROFILE_LOSS, /* error of the output and its derivative */
+    NN_PROFILE_BACKWARD, /* delta of the previous layer */
+    NN_PROFILE_GRADIENT, /* gradients of the weights and biases */
+    NN_PROFILE_UPDATE, /* addition of the gradients to the parameters */
+    NN_PROFILE_PHASES /* used as the array size for declaration */
+};
+
+/**
+ * Pseudo layer of the work not belonging to a single layer,
+ * i.e. the loss and the updates of the multithreaded trainer.
+ */
+#define NN_PROFILE_NETWORK -1
+
+/**
+ * Totals of a layer and phase since the last reset.
+ * FLOPs and bytes are computed from the shapes, not measured.
+ */
+typedef struct nn_profile_stats {
+    unsigned long long calls;
+    double seconds;
+    double flops;
+    double bytes;
+} nn_profile_stats;
+
+/**
+ * Returns whether the library records the profile, i.e. it is configured
+ * with NN_PROFILE (cmake -DNN_PROFILE=ON). Otherwise the hot paths are not
+ * instrumented at all and the functions below report nothing.
+ * The profile is shared by all networks and threads of the process,
+ * layers are identified by their index.
+ */
+int nn_profile_enabled(void);
+
+/**
+ * Clears the profile. Must not be called concurrently with the profiled functions.
+ */
+void nn_profile_reset(void);
+
+/**
+ * Returns the number of layers recorded, i.e. the greatest layer index + 1.
+ */
+int nn_profile_nlayers(void);
+
+/**
+ * Retrieves the totals of a layer and phase.
+ * @param layer Index of the layer or NN_PROFILE_NETWORK.
+ * @param phase Phase from enum nn_profile_phase.
+ * @return 1 for success, 0 if profiling is disabled or the arguments are out of range,
+ * in which case the stats are zeroed.
+ */
+int nn_profile_get(int layer, int phase, nn_profile_stats *stats);
+
+/**
+ * Prints the profile as a table of time, share, GFLOP/s and GB/s of every layer and phase to stdout.
+ */
+void nn_profile_print(void);
+
+/**
+ * Writes the recorded calls as a Chrome trace (JSON), which can be opened in chrome://tracing
+ * or Perfetto. Up to 65536 calls after the reset are kept.
+ * @return Positive integer is returned for success.
+ */
+int nn_profile_write_trace(const char *filename);
+
 #endif
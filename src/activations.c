@@ -13,53 +13,245 @@
  */
 
 #include <math.h>
+#include <string.h>
 
 #include "activations.h"
+#include "simd.h"
 
-static double activation_identity(double x) { return x; }
-static double activation_identity_prime(double x) { return 1; }
+#if SIMD_X86
+#include <immintrin.h>
+#endif
 
-static double activation_step(double x) { return x > 0 ? 1 : 0; }
-static double activation_step_prime(double x) { return x != 0 ? 0 : INFINITY; }
+/* Portable whole-vector kernels. Simple enough to be vectorized by the compiler,
+ * except for the ones calling into libm. */
 
-static double activation_tanh(double x) { return tanh(x); }
-static double activation_tanh_prime(double x) { return 1 - activation_tanh(x) * activation_tanh(x); }
+static void identity_forward(const nn_real *net, nn_real *out, int n) {
+    memmove(out, net, n * sizeof(nn_real));
+}
 
-static double activation_relu(double x) { return x > 0 ? x : 0; }
-static double activation_relu_prime(double x) { return x > 0 ? 1 : 0; }
+static void step_forward(const nn_real *net, nn_real *out, int n) {
+    for (int i = 0; i < n; i++) out[i] = net[i] > 0 ? 1 : 0;
+}
 
-static double activation_relu_leaky(double x) { return x > 0 ? x : RELU_LEAKY_LEAKAGE*x; }
-static double activation_relu_leaky_prime(double x) { return x > 0 ? 1 : RELU_LEAKY_LEAKAGE; }
+static void tanh_forward(const nn_real *net, nn_real *out, int n) {
+    for (int i = 0; i < n; i++) out[i] = tanh(net[i]);
+}
 
-static double activation_gaussian(double x) { return exp(-x*x); }
-static double activation_gaussian_prime(double x) { return -2*x*activation_gaussian(x); }
+static void relu_forward(const nn_real *net, nn_real *out, int n) {
+    for (int i = 0; i < n; i++) out[i] = net[i] > 0 ? net[i] : 0;
+}
 
-static double activation_sigmoid(double x) { return 1.0/(1+exp(-x)); }
-static double activation_sigmoid_prime(double x) { return activation_sigmoid(x)*(1-activation_sigmoid(x)); }
+static void relu_leaky_forward(const nn_real *net, nn_real *out, int n) {
+    for (int i = 0; i < n; i++) out[i] = net[i] > 0 ? net[i] : RELU_LEAKY_LEAKAGE*net[i];
+}
 
-static double activation_softplus(double x) { return log(1+exp(x)); }
-static double activation_softplus_prime(double x) { return 1/(1+exp(-x)); }
+static void gaussian_forward(const nn_real *net, nn_real *out, int n) {
+    for (int i = 0; i < n; i++) out[i] = exp(-net[i]*net[i]);
+}
 
-/* Activation functions. */
-double (*activations[])(double) = {
-    activation_identity,
-    activation_step,
-    activation_tanh,
-    activation_relu,
-    activation_relu_leaky,
-    activation_gaussian,
-    activation_sigmoid,
-    activation_softplus
+static void sigmoid_forward(const nn_real *net, nn_real *out, int n) {
+    for (int i = 0; i < n; i++) out[i] = 1.0/(1+exp(-net[i]));
+}
+
+static void softplus_forward(const nn_real *net, nn_real *out, int n) {
+    for (int i = 0; i < n; i++) out[i] = log(1+exp(net[i]));
+}
+
+static void exp_forward(const nn_real *net, nn_real *out, int n) {
+    for (int i = 0; i < n; i++) out[i] = exp(net[i]);
+}
+
+static void identity_backward(const nn_real *net, const nn_real *out, nn_real *delta, int n) {
+    /* f' = 1 */
+}
+
+static void step_backward(const nn_real *net, const nn_real *out, nn_real *delta, int n) {
+    for (int i = 0; i < n; i++) delta[i] *= net[i] != 0 ? 0 : INFINITY;
+}
+
+static void tanh_backward(const nn_real *net, const nn_real *out, nn_real *delta, int n) {
+    for (int i = 0; i < n; i++) delta[i] *= 1 - out[i]*out[i];
+}
+
+static void relu_backward(const nn_real *net, const nn_real *out, nn_real *delta, int n) {
+    for (int i = 0; i < n; i++) delta[i] = net[i] > 0 ? delta[i] : 0;
+}
+
+static void relu_leaky_backward(const nn_real *net, const nn_real *out, nn_real *delta, int n) {
+    for (int i = 0; i < n; i++) delta[i] *= net[i] > 0 ? 1 : RELU_LEAKY_LEAKAGE;
+}
+
+static void gaussian_backward(const nn_real *net, const nn_real *out, nn_real *delta, int n) {
+    for (int i = 0; i < n; i++) delta[i] *= -2*net[i]*out[i];
+}
+
+static void sigmoid_backward(const nn_real *net, const nn_real *out, nn_real *delta, int n) {
+    for (int i = 0; i < n; i++) delta[i] *= out[i]*(1-out[i]);
+}
+
+static void softplus_backward(const nn_real *net, const nn_real *out, nn_real *delta, int n) {
+    for (int i = 0; i < n; i++) delta[i] *= 1/(1+exp(-net[i]));
+}
+
+#if SIMD_X86
+#define SIMD_TARGET SIMD_SSE2
+#include "simd_ops.h"
+#include "simd_math.h"
+#include "activations_kernels.h"
+#undef SIMD_TARGET
+
+#define SIMD_TARGET SIMD_AVX2
+#include "simd_ops.h"
+#include "simd_math.h"
+#include "activations_kernels.h"
+#undef SIMD_TARGET
+
+#define SIMD_TARGET SIMD_AVX512
+#include "simd_ops.h"
+#include "simd_math.h"
+#include "activations_kernels.h"
+#undef SIMD_TARGET
+#endif
+
+typedef void (*forward_kernel)(const nn_real *net, nn_real *out, int n);
+typedef void (*backward_kernel)(const nn_real *net, const nn_real *out, nn_real *delta, int n);
+
+/* Kernels for every instruction set, indexed by the instruction set and the activation.
+ * Only the activations bound by exp() have dedicated vector kernels, softmax normalizes
+ * whole columns and is not dispatched through the tables,
+ * simd_isa() never exceeds SIMD_SCALAR on other architectures. */
+static const forward_kernel forward_kernels[SIMD_ISA_N][ACTIVATIONS_N] = {
+    {
+        identity_forward, step_forward, tanh_forward, relu_forward,
+        relu_leaky_forward, gaussian_forward, sigmoid_forward, softplus_forward,
+        NULL /* softmax_forward */
+    },
+#if SIMD_X86
+    {
+        identity_forward, step_forward, tanh_forward_sse2, relu_forward,
+        relu_leaky_forward, gaussian_forward_sse2, sigmoid_forward_sse2, softplus_forward,
+        NULL /* softmax_forward */
+    },
+    {
+        identity_forward, step_forward, tanh_forward_avx2, relu_forward,
+        relu_leaky_forward, gaussian_forward_avx2, sigmoid_forward_avx2, softplus_forward,
+        NULL /* softmax_forward */
+    },
+    {
+        identity_forward, step_forward, tanh_forward_avx512, relu_forward,
+        relu_leaky_forward, gaussian_forward_avx512, sigmoid_forward_avx512, softplus_forward,
+        NULL /* softmax_forward */
+    },
+#endif
+};
+
+static const backward_kernel backward_kernels[SIMD_ISA_N][ACTIVATIONS_N] = {
+    {
+        identity_backward, step_backward, tanh_backward, relu_backward,
+        relu_leaky_backward, gaussian_backward, sigmoid_backward, softplus_backward,
+        NULL /* softmax_backward */
+    },
+#if SIMD_X86
+    {
+        identity_backward, step_backward, tanh_backward_sse2, relu_backward,
+        relu_leaky_backward, gaussian_backward_sse2, sigmoid_backward_sse2, softplus_backward,
+        NULL /* softmax_backward */
+    },
+    {
+        identity_backward, step_backward, tanh_backward_avx2, relu_backward,
+        relu_leaky_backward, gaussian_backward_avx2, sigmoid_backward_avx2, softplus_backward,
+        NULL /* softmax_backward */
+    },
+    {
+        identity_backward, step_backward, tanh_backward_avx512, relu_backward,
+        relu_leaky_backward, gaussian_backward_avx512, sigmoid_backward_avx512, softplus_backward,
+        NULL /* softmax_backward */
+    },
+#endif
 };
 
-/* Derivatives of activation functions. */
-double (*activations_primes[])(double) = {
-    activation_identity_prime,
-    activation_step_prime,
-    activation_tanh_prime,
-    activation_relu_prime,
-    activation_relu_leaky_prime,
-    activation_gaussian_prime,
-    activation_sigmoid_prime,
-    activation_softplus_prime
+static const forward_kernel exp_kernels[SIMD_ISA_N] = {
+    exp_forward,
+#if SIMD_X86
+    exp_forward_sse2, exp_forward_avx2, exp_forward_avx512,
+#endif
 };
+
+/* Columns of a matrix normalized together by softmax, sized for the per-column sums to stay on the stack. */
+#define SOFTMAX_CHUNK 64
+
+/* out = exp(net - max) / sum(exp(net - max)) for every column, subtracting the column's
+ * maximum so that exp() never overflows. net and out may be the same array. */
+static void softmax_forward(const nn_real *net, nn_real *out, int rows, int cols) {
+    forward_kernel vexp = exp_kernels[simd_isa()];
+
+    for (int c0 = 0; c0 < cols; c0 += SOFTMAX_CHUNK) {
+        int w = cols - c0 < SOFTMAX_CHUNK ? cols - c0 : SOFTMAX_CHUNK;
+        nn_real max[SOFTMAX_CHUNK], sum[SOFTMAX_CHUNK];
+
+        for (int j = 0; j < w; j++) {
+            max[j] = rows > 0 ? net[c0 + j] : 0;
+            sum[j] = 0;
+        }
+        for (int i = 1; i < rows; i++) {
+            const nn_real *row = net + (size_t)i * cols + c0;
+            for (int j = 0; j < w; j++) max[j] = row[j] > max[j] ? row[j] : max[j];
+        }
+
+        for (int i = 0; i < rows; i++) {
+            const nn_real *src = net + (size_t)i * cols + c0;
+            nn_real *dst = out + (size_t)i * cols + c0;
+            for (int j = 0; j < w; j++) dst[j] = src[j] - max[j];
+        }
+
+        /* A single column is contiguous, exponentiated by one call. */
+        if (cols == 1) {
+            vexp(out, out, rows);
+        } else {
+            for (int i = 0; i < rows; i++) vexp(out + (size_t)i * cols + c0, out + (size_t)i * cols + c0, w);
+        }
+
+        for (int i = 0; i < rows; i++) {
+            const nn_real *row = out + (size_t)i * cols + c0;
+            for (int j = 0; j < w; j++) sum[j] += row[j];
+        }
+        for (int j = 0; j < w; j++) sum[j] = 1 / sum[j];
+        for (int i = 0; i < rows; i++) {
+            nn_real *row = out + (size_t)i * cols + c0;
+            for (int j = 0; j < w; j++) row[j] *= sum[j];
+        }
+    }
+}
+
+/* delta = out * (delta - sum(delta * out)) for every column, the product of the
+ * softmax Jacobian diag(out) - out * out^T with delta. */
+static void softmax_backward(const nn_real *out, nn_real *delta, int rows, int cols) {
+    for (int c0 = 0; c0 < cols; c0 += SOFTMAX_CHUNK) {
+        int w = cols - c0 < SOFTMAX_CHUNK ? cols - c0 : SOFTMAX_CHUNK;
+        nn_real dot[SOFTMAX_CHUNK] = { 0 };
+
+        for (int i = 0; i < rows; i++) {
+            const nn_real *o = out + (size_t)i * cols + c0;
+            const nn_real *d = delta + (size_t)i * cols + c0;
+            for (int j = 0; j < w; j++) dot[j] += o[j] * d[j];
+        }
+        for (int i = 0; i < rows; i++) {
+            const nn_real *o = out + (size_t)i * cols + c0;
+            nn_real *d = delta + (size_t)i * cols + c0;
+            for (int j = 0; j < w; j++) d[j] = o[j] * (d[j] - dot[j]);
+        }
+    }
+}
+
+void activation_forward(int activation, const nn_real *net, nn_real *out, int rows, int cols) {
+    if (activation == SOFTMAX) {
+        softmax_forward(net, out, rows, cols);
+    } else forward_kernels[simd_isa()][activation](net, out, rows * cols);
+}
+
+void activation_backward(int activation, const nn_real *net, const nn_real *out, nn_real *delta,
+                         int rows, int cols) {
+    if (activation == SOFTMAX) {
+        softmax_backward(out, delta, rows, cols);
+    } else backward_kernels[simd_isa()][activation](net, out, delta, rows * cols);
+}
@@ -15,17 +15,28 @@
 #ifndef NN_ACTIVATIONS_H
 #define NN_ACTIVATIONS_H
 
+#include "matrix.h"
+
 #ifndef RELU_LEAKY_LEAKAGE
 #define RELU_LEAKY_LEAKAGE 0.01
 #endif
 
 /* Neuron activation functions and their derivatives. */
 enum {
-    IDENTITY = 0, STEP, TANH, RELU, RELU_LEAKY, GAUSSIAN, SIGMOID, SOFTPLUS,
+    IDENTITY = 0, STEP, TANH, RELU, RELU_LEAKY, GAUSSIAN, SIGMOID, SOFTPLUS, SOFTMAX,
     ACTIVATIONS_N /* used as the array size for declaration */
 };
 
-extern double (*activations[ACTIVATIONS_N])(double);
-extern double (*activations_primes[ACTIVATIONS_N])(double);
+/* Whole-matrix kernels, dispatched once per call rather than once per element.
+ * The arrays are rows x cols matrices with a column for every sample. All the activations
+ * are elementwise, except for SOFTMAX, which normalizes every column. */
+
+/* out = f(net). */
+void activation_forward(int activation, const nn_real *net, nn_real *out, int rows, int cols);
+
+/* delta = f'(net)^T * delta for every column, where out = f(net), i.e. delta[i] *= f'(net[i])
+ * for the elementwise activations. The derivative is computed from out wherever the math allows. */
+void activation_backward(int activation, const nn_real *net, const nn_real *out, nn_real *delta,
+                         int rows, int cols);
 
 #endif
@@ -0,0 +1,90 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+/* Activation kernels, instantiated by activations.c once per instruction set.
+ * Has no include guard on purpose, see simd_ops.h. Requires simd_math.h. */
+
+/* Applies the vector function F to n elements of in, storing them in out.
+ * The tail is padded to a full vector, so every element goes through F. */
+#define K_MAP(F, in, out, n) do {                                       \
+        int i_ = 0;                                                     \
+        for (; i_ + VW <= (n); i_ += VW)                                \
+            vstore((out) + i_, F(vload((in) + i_)));                    \
+        if (i_ < (n)) {                                                 \
+            nn_real t_[VW] = { 0 };                                     \
+            memcpy(t_, (in) + i_, ((n) - i_) * sizeof(nn_real));        \
+            vstore(t_, F(vload(t_)));                                   \
+            memcpy((out) + i_, t_, ((n) - i_) * sizeof(nn_real));       \
+        }                                                               \
+    } while (0)
+
+static SIMD_ATTR void K(sigmoid_forward)(const nn_real *net, nn_real *out, int n) {
+    K_MAP(K(vsigmoid), net, out, n);
+}
+
+static SIMD_ATTR void K(tanh_forward)(const nn_real *net, nn_real *out, int n) {
+    K_MAP(K(vtanh), net, out, n);
+}
+
+static SIMD_ATTR void K(gaussian_forward)(const nn_real *net, nn_real *out, int n) {
+    K_MAP(K(vgaussian), net, out, n);
+}
+
+/* Plain exponent, used by softmax. */
+static SIMD_ATTR void K(exp_forward)(const nn_real *net, nn_real *out, int n) {
+    K_MAP(K(vexp), net, out, n);
+}
+
+#undef K_MAP
+
+/* Derivatives are computed from the stored output, no exponent is evaluated again. */
+
+/* sigmoid' = out * (1 - out) */
+static SIMD_ATTR void K(sigmoid_backward)(const nn_real *net, const nn_real *out, nn_real *delta, int n) {
+    vreal one = vset1(1.0);
+
+    int i = 0;
+    for (; i + VW <= n; i += VW) {
+        vreal o = vload(out + i);
+        vstore(delta + i, vmul(vload(delta + i), vmul(o, vsub(one, o))));
+    }
+    for (; i < n; i++)
+        delta[i] *= out[i] * (1 - out[i]);
+}
+
+/* tanh' = 1 - out^2 */
+static SIMD_ATTR void K(tanh_backward)(const nn_real *net, const nn_real *out, nn_real *delta, int n) {
+    vreal one = vset1(1.0);
+
+    int i = 0;
+    for (; i + VW <= n; i += VW) {
+        vreal o = vload(out + i);
+        vstore(delta + i, vmul(vload(delta + i), vsub(one, vmul(o, o))));
+    }
+    for (; i < n; i++)
+        delta[i] *= 1 - out[i] * out[i];
+}
+
+/* gaussian' = -2 * net * out */
+static SIMD_ATTR void K(gaussian_backward)(const nn_real *net, const nn_real *out, nn_real *delta, int n) {
+    vreal m2 = vset1(-2.0);
+
+    int i = 0;
+    for (; i + VW <= n; i += VW) {
+        vreal d = vmul(vmul(m2, vload(net + i)), vload(out + i));
+        vstore(delta + i, vmul(vload(delta + i), d));
+    }
+    for (; i < n; i++)
+        delta[i] *= -2 * net[i] * out[i];
+}
@@ -0,0 +1,388 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dataset.h"
+#include "simd.h"
+
+#if SIMD_X86
+#include <immintrin.h>
+#endif
+
+/* Fixed seed, so that the shuffled orders are the same on every run. */
+#define DATASET_SEED 0x9e3779b97f4a7c15u
+
+/* Conversion kernels: dst = src / 255 for n bytes, normalizing them to [0, 1]. */
+
+static void convert_scalar(size_t n, const uint8_t *src, nn_real *dst) {
+    const nn_real scale = (nn_real)1 / 255;
+    for (size_t i = 0; i < n; i++)
+        dst[i] = src[i] * scale;
+}
+
+#if SIMD_X86
+static __attribute__((target("sse2")))
+void convert_sse2(size_t n, const uint8_t *src, nn_real *dst) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i lo = _mm_unpacklo_epi8(b, zero), hi = _mm_unpackhi_epi8(b, zero);
+        __m128i q[4] = {
+            _mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero),
+            _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero),
+        };
+
+        for (int k = 0; k < 4; k++) {
+#ifdef NN_FLOAT
+            const __m128 scale = _mm_set1_ps(1.0f / 255);
+            _mm_storeu_ps(dst + i + 4*k, _mm_mul_ps(_mm_cvtepi32_ps(q[k]), scale));
+#else
+            const __m128d scale = _mm_set1_pd(1.0 / 255);
+            _mm_storeu_pd(dst + i + 4*k, _mm_mul_pd(_mm_cvtepi32_pd(q[k]), scale));
+            _mm_storeu_pd(dst + i + 4*k + 2,
+                          _mm_mul_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(q[k], 0x4e)), scale));
+#endif
+        }
+    }
+
+    convert_scalar(n - i, src + i, dst + i);
+}
+
+static __attribute__((target("avx2")))
+void convert_avx2(size_t n, const uint8_t *src, nn_real *dst) {
+    size_t i = 0;
+
+#ifdef NN_FLOAT
+    const __m256 scale = _mm256_set1_ps(1.0f / 255);
+    for (; i + 8 <= n; i += 8) {
+        __m256i q = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(q), scale));
+    }
+#else
+    const __m256d scale = _mm256_set1_pd(1.0 / 255);
+    for (; i + 8 <= n; i += 8) {
+        __m256i q = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + i)));
+        _mm256_storeu_pd(dst + i, _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(q)), scale));
+        _mm256_storeu_pd(dst + i + 4,
+                         _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(q, 1)), scale));
+    }
+#endif
+
+    convert_scalar(n - i, src + i, dst + i);
+}
+#endif
+
+/* Kernels indexed by the instruction set, the conversion is bound by the stores
+ * well before AVX-512 would matter. */
+static void (*const convert_kernels[SIMD_ISA_N])(size_t n, const uint8_t *src, nn_real *dst) = {
+    convert_scalar,
+#if SIMD_X86
+    convert_sse2,
+    convert_avx2,
+    convert_avx2,
+#endif
+};
+
+/* Allocates size bytes, there is no point in continuing on failure. */
+static void *dataset_alloc(size_t size) {
+    void *p = calloc(1, size);
+    if (p == NULL) {
+        perror(__func__);
+        assert(p != NULL);
+    }
+    return p;
+}
+
+/* IDX files are stored in Big Endian. */
+static uint32_t read_be32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/* Maps the whole file read-only, returning NULL on failure.
+ * The kernel is asked to read it ahead, so the loader rarely waits for a page fault. */
+static uint8_t *map_file(const char *filename, size_t *size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror(filename);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror(filename);
+
+        close(fd);
+        return NULL;
+    }
+
+    if (st.st_size == 0) {
+        fprintf(stderr, "%s: %s is empty\n", __func__, filename);
+
+        close(fd);
+        return NULL;
+    }
+
+    *size = st.st_size;
+    uint8_t *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(filename);
+        return NULL;
+    }
+
+    madvise(map, *size, MADV_WILLNEED);
+    return map;
+}
+
+/* xorshift64*, good enough for permutations. */
+static uint64_t dataset_random(nn_dataset *ds) {
+    ds->rng ^= ds->rng >> 12;
+    ds->rng ^= ds->rng << 25;
+    ds->rng ^= ds->rng >> 27;
+    return ds->rng * 0x2545f4914f6cdd1du;
+}
+
+/* Fisher-Yates shuffle of the order of the samples. */
+static void dataset_shuffle(nn_dataset *ds) {
+    for (int i = ds->n - 1; i > 0; i--) {
+        int j = dataset_random(ds) % (i + 1);
+        uint32_t t = ds->order[i];
+        ds->order[i] = ds->order[j];
+        ds->order[j] = t;
+    }
+}
+
+/* Converts the next batch of the epoch into the buffer.
+ * After the last one an empty batch is produced and the next epoch begins. */
+static void dataset_fill(nn_dataset *ds, dataset_buffer *b) {
+    if (ds->position == ds->n) {
+        ds->position = 0;
+        if (ds->shuffle)
+            dataset_shuffle(ds);
+
+        b->n = 0;
+        return;
+    }
+
+    int n = ds->n - ds->position < ds->batch ? ds->n - ds->position : ds->batch;
+    void (*convert)(size_t, const uint8_t *, nn_real *) = convert_kernels[simd_isa()];
+
+    if (ds->order == NULL) {
+        /* Consecutive samples are converted at once. */
+        convert((size_t)n * ds->inputs, ds->images + (size_t)ds->position * ds->inputs, b->input);
+        memcpy(b->labels, ds->labels + ds->position, n);
+    } else {
+        for (int s = 0; s < n; s++) {
+            uint32_t index = ds->order[ds->position + s];
+            convert(ds->inputs, ds->images + (size_t)index * ds->inputs,
+                    b->input + (size_t)s * ds->inputs);
+            b->labels[s] = ds->labels[index];
+        }
+    }
+
+    memset(b->target, 0, (size_t)n * ds->classes * sizeof(nn_real));
+    for (int s = 0; s < n; s++)
+        b->target[(size_t)s * ds->classes + b->labels[s]] = 1;
+
+    ds->position += n;
+    b->n = n;
+}
+
+/* Loader thread, fills the buffers in turn as soon as the consumer releases them. */
+static void *dataset_main(void *arg) {
+    nn_dataset *ds = arg;
+    int k = 0;
+
+    pthread_mutex_lock(&ds->lock);
+    while (1) {
+        while (ds->buffers[k].ready && !ds->quit)
+            pthread_cond_wait(&ds->cond, &ds->lock);
+        if (ds->quit) break;
+
+        /* The buffer belongs to the loader until it is marked ready. */
+        pthread_mutex_unlock(&ds->lock);
+        dataset_fill(ds, &ds->buffers[k]);
+        pthread_mutex_lock(&ds->lock);
+
+        ds->buffers[k].ready = 1;
+        pthread_cond_broadcast(&ds->cond);
+        k ^= 1;
+    }
+    pthread_mutex_unlock(&ds->lock);
+
+    return NULL;
+}
+
+/* Releases everything but the thread. */
+static void dataset_free(nn_dataset *ds) {
+    for (int k = 0; k < 2; k++) {
+        free(ds->buffers[k].input);
+        free(ds->buffers[k].target);
+        free(ds->buffers[k].labels);
+    }
+    free(ds->order);
+
+    if (ds->imap) munmap(ds->imap, ds->isize);
+    if (ds->lmap) munmap(ds->lmap, ds->lsize);
+    free(ds);
+}
+
+/* Checks the headers of both files and finds the samples in them.
+ * Images are unsigned bytes of any number of dimensions, the first one
+ * counting the samples. Returns 0 if the files do not make a dataset. */
+static int dataset_parse(nn_dataset *ds, const char *images, const char *labels) {
+    const uint8_t *i = ds->imap, *l = ds->lmap;
+    if (ds->isize < 8 || i[0] != 0 || i[1] != 0 || i[2] != 0x08 || i[3] < 1 ||
+        ds->lsize < 8 || read_be32(l) != 0x00000801) {
+        fprintf(stderr, "%s: %s or %s is not an IDX file\n", __func__, images, labels);
+        return 0;
+    }
+
+    int ndims = i[3];
+    size_t header = 4 + 4 * (size_t)ndims;
+    if (ds->isize < header) {
+        fprintf(stderr, "%s: %s: Unexpected EOF\n", __func__, images);
+        return 0;
+    }
+
+    uint64_t inputs = 1;
+    for (int d = 1; d < ndims; d++)
+        inputs *= read_be32(i + 4 + 4*d);
+
+    uint64_t n = read_be32(i + 4);
+    if (n < 1 || n != read_be32(l + 4) || inputs < 1 || inputs > INT32_MAX || n > INT32_MAX ||
+        ds->isize - header < n * inputs || ds->lsize - 8 < n) {
+        fprintf(stderr, "%s: %s and %s do not match\n", __func__, images, labels);
+        return 0;
+    }
+
+    ds->images = i + header;
+    ds->labels = l + 8;
+    ds->n = n;
+    ds->inputs = inputs;
+
+    ds->classes = 0;
+    for (int s = 0; s < ds->n; s++) {
+        if (ds->labels[s] >= ds->classes)
+            ds->classes = ds->labels[s] + 1;
+    }
+
+    return 1;
+}
+
+nn_dataset *nn_dataset_open(const char *images, const char *labels, int batch, int shuffle) {
+    if (batch < 1) return NULL;
+
+    nn_dataset *ds = dataset_alloc(sizeof(nn_dataset));
+    ds->imap = map_file(images, &ds->isize);
+    ds->lmap = map_file(labels, &ds->lsize);
+
+    if (!ds->imap || !ds->lmap || !dataset_parse(ds, images, labels)) {
+        dataset_free(ds);
+        return NULL;
+    }
+
+    ds->batch = batch < ds->n ? batch : ds->n;
+    for (int k = 0; k < 2; k++) {
+        ds->buffers[k].input = dataset_alloc((size_t)ds->batch * ds->inputs * sizeof(nn_real));
+        ds->buffers[k].target = dataset_alloc((size_t)ds->batch * ds->classes * sizeof(nn_real));
+        ds->buffers[k].labels = dataset_alloc(ds->batch);
+    }
+
+    ds->shuffle = shuffle;
+    if (shuffle) {
+        ds->rng = DATASET_SEED;
+        ds->order = dataset_alloc(ds->n * sizeof(uint32_t));
+        for (int s = 0; s < ds->n; s++)
+            ds->order[s] = s;
+        dataset_shuffle(ds);
+    }
+
+    pthread_mutex_init(&ds->lock, NULL);
+    pthread_cond_init(&ds->cond, NULL);
+
+    int err = pthread_create(&ds->thread, NULL, dataset_main, ds);
+    if (err) {
+        fprintf(stderr, "%s: pthread_create failed with %d\n", __func__, err);
+
+        pthread_mutex_destroy(&ds->lock);
+        pthread_cond_destroy(&ds->cond);
+        dataset_free(ds);
+        return NULL;
+    }
+
+    return ds;
+}
+
+void nn_dataset_close(nn_dataset *ds) {
+    if (!ds) return;
+
+    pthread_mutex_lock(&ds->lock);
+    ds->quit = 1;
+    pthread_cond_broadcast(&ds->cond);
+    pthread_mutex_unlock(&ds->lock);
+    pthread_join(ds->thread, NULL);
+
+    pthread_mutex_destroy(&ds->lock);
+    pthread_cond_destroy(&ds->cond);
+    dataset_free(ds);
+}
+
+int nn_dataset_size(const nn_dataset *ds) {
+    return ds->n;
+}
+
+int nn_dataset_ninputs(const nn_dataset *ds) {
+    return ds->inputs;
+}
+
+int nn_dataset_nclasses(const nn_dataset *ds) {
+    return ds->classes;
+}
+
+/* Releases the buffer returned by the previous call to the loader
+ * and takes the other one, waiting only if it is not converted yet. */
+int nn_dataset_next(nn_dataset *ds, nn_real **input, nn_real **target,
+                    const unsigned char **labels) {
+    pthread_mutex_lock(&ds->lock);
+
+    if (ds->held) {
+        ds->buffers[ds->current ^ 1].ready = 0;
+        ds->held = 0;
+        pthread_cond_broadcast(&ds->cond);
+    }
+
+    dataset_buffer *b = &ds->buffers[ds->current];
+    while (!b->ready)
+        pthread_cond_wait(&ds->cond, &ds->lock);
+
+    ds->current ^= 1;
+    ds->held = 1;
+    pthread_mutex_unlock(&ds->lock);
+
+    if (input) *input = b->input;
+    if (target) *target = b->target;
+    if (labels) *labels = b->labels;
+    return b->n;
+}
@@ -0,0 +1,70 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+#ifndef NN_DATASET_H
+#define NN_DATASET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "matrix.h"
+
+/* Mini-batch converted by the loader thread. */
+typedef struct dataset_buffer {
+    nn_real *input; /* batch x inputs, a row for each sample */
+    nn_real *target; /* batch x classes, one-hot rows */
+    uint8_t *labels;
+    int n; /* samples of the batch, 0 marks the end of an epoch */
+    int ready; /* filled and not yet released by the consumer */
+} dataset_buffer;
+
+/* Labelled dataset read from a pair of mapped IDX files. A background thread
+ * converts the next batch while the consumer works with the current one. */
+typedef struct nn_dataset {
+    /* Mappings of the files. */
+    uint8_t *imap, *lmap;
+    size_t isize, lsize;
+
+    const uint8_t *images; /* n x inputs pixels following the IDX header */
+    const uint8_t *labels; /* n labels */
+    int n;
+    int inputs;
+    int classes; /* greatest label + 1 */
+    int batch;
+
+    int shuffle; /* whether every epoch visits the samples in a new order */
+    uint64_t rng; /* state of the shuffling generator */
+    uint32_t *order; /* permutation of the samples of the epoch being loaded */
+    int position; /* in order of the next sample to load */
+
+    dataset_buffer buffers[2];
+    int current; /* buffer the consumer takes next */
+    int held; /* whether the consumer holds the other one */
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* signals a change of ready or quit */
+    int quit;
+} nn_dataset;
+
+nn_dataset *nn_dataset_open(const char *images, const char *labels, int batch, int shuffle);
+void nn_dataset_close(nn_dataset *ds);
+int nn_dataset_size(const nn_dataset *ds);
+int nn_dataset_ninputs(const nn_dataset *ds);
+int nn_dataset_nclasses(const nn_dataset *ds);
+int nn_dataset_next(nn_dataset *ds, nn_real **input, nn_real **target,
+                    const unsigned char **labels);
+
+#endif
@@ -21,9 +21,158 @@
 
 #include "matrix.h"
 #include "util.h"
+#include "simd.h"
+#include "activations.h"
+
+#if SIMD_X86
+#include <immintrin.h>
+#endif
+
+/* Cache blocking of the right-hand side of the matrix product:
+ * GEMM_KC x GEMM_NC block of doubles (256 KiB, or half of it for floats)
+ * fits into the L2 cache. */
+#define GEMM_KC 256
+#define GEMM_NC 128
+
+/* Rows completed at once by the fused matrix-vector kernel,
+ * at least a vector's width, i.e. 64 bytes for AVX-512. */
+#define DENSE_ROWS (64 / (int)sizeof(nn_real))
+
+/* Final step of the fused kernels, applied to every element of the product. */
+struct epilogue {
+    const nn_real *bias; /* added to every element of the row */
+    int activation; /* applied after the bias */
+    nn_real *net; /* if not NULL, stores the elements before the activation */
+    int ldn; /* distance between the rows of net */
+};
+
+/* Derivative of the previous layer, applied by the backward kernel. */
+struct derivative {
+    int activation;
+    const nn_real *net, *out; /* of the previous layer */
+};
+
+/* Portable kernels, also used on CPUs without any of the vector extensions. */
+static void gemv_scalar(int m, int n, const nn_real *a, int lda, const nn_real *x, nn_real *y) {
+    for (int i = 0; i < m; i++) {
+        const nn_real *row = a + i*lda;
+        nn_real sum = 0;
+        for (int k = 0; k < n; k++)
+            sum += row[k] * x[k];
+        y[i] = sum;
+    }
+}
+
+static void gemm_scalar(int m, int n, int k, const nn_real *a, int lda,
+                        const nn_real *b, int ldb, nn_real *c, int ldc) {
+    /* i-k-j order, so that both B and C are walked along their rows. */
+    for (int i = 0; i < m; i++) {
+        nn_real *crow = c + i*ldc;
+        memset(crow, 0, n * sizeof(nn_real));
+
+        for (int p = 0; p < k; p++) {
+            nn_real aip = a[i*lda + p];
+            const nn_real *brow = b + p*ldb;
+            for (int j = 0; j < n; j++)
+                crow[j] += aip * brow[j];
+        }
+    }
+}
+
+/* y = A^T * x, A walked along its rows. The derivative is applied separately. */
+static void gemv_t_scalar(int m, int n, const nn_real *a, int lda, const nn_real *x,
+                          const struct derivative *d, nn_real *y) {
+    memset(y, 0, n * sizeof(nn_real));
+    for (int i = 0; i < m; i++) {
+        const nn_real *row = a + i*lda;
+        for (int j = 0; j < n; j++)
+            y[j] += x[i] * row[j];
+    }
+
+    if (d) activation_backward(d->activation, d->net, d->out, y, n, 1);
+}
+
+/* A += alpha * x * y^T, a row at a time. Rows of x[i] == 0 are left as they are,
+ * e.g. those of the units a RELU has cut off. */
+static void ger_scalar(int m, int n, nn_real alpha, const nn_real *x, const nn_real *y,
+                       nn_real *a, int lda) {
+    for (int i = 0; i < m; i++) {
+        nn_real axi = alpha * x[i];
+        if (axi == 0) continue;
+
+        nn_real *row = a + i*lda;
+        for (int k = 0; k < n; k++)
+            row[k] += axi * y[k];
+    }
+}
+
+/* C = A*X for the sparse m-row matrix A of compressed rows and the matrix X of n columns. */
+static void csr_gemm_scalar(int m, int n, const int *start, const int *index, const nn_real *value,
+                            const nn_real *x, int ldx, nn_real *c, int ldc) {
+    for (int i = 0; i < m; i++) {
+        nn_real *crow = c + i*ldc;
+        memset(crow, 0, n * sizeof(nn_real));
+
+        for (int p = start[i]; p < start[i+1]; p++) {
+            const nn_real *xrow = x + index[p]*ldx;
+            for (int j = 0; j < n; j++)
+                crow[j] += value[p] * xrow[j];
+        }
+    }
+}
+
+#if SIMD_X86
+#define SIMD_TARGET SIMD_SSE2
+#include "simd_ops.h"
+#include "simd_math.h"
+#include "matrix_kernels.h"
+#undef SIMD_TARGET
+
+#define SIMD_TARGET SIMD_AVX2
+#include "simd_ops.h"
+#include "simd_math.h"
+#include "matrix_kernels.h"
+#undef SIMD_TARGET
+
+#define SIMD_TARGET SIMD_AVX512
+#include "simd_ops.h"
+#include "simd_math.h"
+#include "matrix_kernels.h"
+#undef SIMD_TARGET
+#endif
+
+/* Kernels for every instruction set, indexed by the instruction set.
+ * Fused kernels are not available in the scalar version. */
+static const struct {
+    void (*gemv)(int m, int n, const nn_real *a, int lda, const nn_real *x, nn_real *y);
+    void (*gemm)(int m, int n, int k, const nn_real *a, int lda,
+                 const nn_real *b, int ldb, nn_real *c, int ldc);
+    void (*dense_gemv)(int m, int n, const nn_real *a, int lda, const nn_real *x,
+                       const struct epilogue *ep, nn_real *out);
+    void (*dense_gemm)(int m, int n, int k, const nn_real *a, int lda, const nn_real *x, int ldx,
+                       const struct epilogue *ep, nn_real *out, int ldo);
+    void (*ger)(int m, int n, nn_real alpha, const nn_real *x, const nn_real *y,
+                nn_real *a, int lda);
+    void (*dense_gemv_t)(int m, int n, const nn_real *a, int lda, const nn_real *x,
+                         const struct derivative *d, nn_real *y);
+    void (*csr_gemv)(int m, const int *start, const int *index, const nn_real *value,
+                     const nn_real *x, const struct epilogue *ep, nn_real *out);
+    void (*csr_gemm)(int m, int n, const int *start, const int *index, const nn_real *value,
+                     const nn_real *x, int ldx, const struct epilogue *ep, nn_real *out, int ldo);
+} kernels[SIMD_ISA_N] = {
+    { gemv_scalar, gemm_scalar, NULL, NULL, ger_scalar, gemv_t_scalar, NULL, NULL },
+#if SIMD_X86
+    { gemv_sse2, gemm_sse2, dense_gemv_sse2, dense_gemm_sse2, ger_sse2, dense_gemv_t_sse2,
+      csr_gemv_sse2, csr_gemm_sse2 },
+    { gemv_avx2, gemm_avx2, dense_gemv_avx2, dense_gemm_avx2, ger_avx2, dense_gemv_t_avx2,
+      csr_gemv_avx2, csr_gemm_avx2 },
+    { gemv_avx512, gemm_avx512, dense_gemv_avx512, dense_gemm_avx512, ger_avx512,
+      dense_gemv_t_avx512, csr_gemv_avx512, csr_gemm_avx512 },
+#endif
+};
 
 /* Allocates new matrix on heap. */
-matrix *create_matrix(int rows, int cols, double *data) {
+matrix *create_matrix(int rows, int cols, const nn_real *data) {
     matrix *new = malloc(sizeof(matrix));
     if (new == NULL) {
         /* Allocation failed, there is no point in continuing. */
@@ -33,7 +182,7 @@ matrix *create_matrix(int rows, int cols, double *data) {
     
     new->rows = rows;
     new->cols = cols;
-    new->data = malloc(rows*cols * sizeof(double));
+    new->data = malloc(rows*cols * sizeof(nn_real));
     if (new->data == NULL) {
         free(new);
         perror(__func__);
@@ -42,35 +191,71 @@ matrix *create_matrix(int rows, int cols, double *data) {
     
     /* Copy data as the underlying array, of fill with zeroes. */
     if (data) {
-        memcpy(new->data, data, rows*cols * sizeof(data));
-    } else memset(new->data, 0, rows*cols * sizeof(data));
+        memcpy(new->data, data, rows*cols * sizeof(nn_real));
+    } else memset(new->data, 0, rows*cols * sizeof(nn_real));
 
     return new;
 }
 
-void matrix_apply(matrix *m, double (*f)(double), matrix *result) {
+void matrix_apply(const matrix *m, double (*f)(double), matrix *result) {
     /* Result matrix should be of the same dimensions as input. */
     assert(m->rows == result->rows && m->cols == result->cols);
 
     for (int i = 0; i < m->rows; i++) {
         for (int j = 0; j < m->cols; j++) {
-            *matrix_at(result, i, j) = f(*matrix_at(m, i, j));
+            *matrix_at(result, i, j) = f(matrix_get(m, i, j));
         }
     }
 }
 
-void matrix_add(matrix *mat, matrix *B) {
+void matrix_add(matrix *mat, const matrix *B) {
     /* Matrices should have equal dimensions. */
     assert(mat->rows == B->rows && mat->cols == B->cols);
 
     for (int i = 0; i < mat->rows; i++) {
         for (int j = 0; j < mat->cols; j++) {
-            *matrix_at(mat, i, j) += *matrix_at(B, i, j);
+            *matrix_at(mat, i, j) += matrix_get(B, i, j);
+        }
+    }
+}
+
+void matrix_add_columnwise(matrix *mat, const matrix *v) {
+    /* v should be a column vector with a row for each row of the matrix. */
+    assert(v->cols == 1 && mat->rows == v->rows);
+
+    for (int i = 0; i < mat->rows; i++) {
+        nn_real x = v->data[i];
+        for (int j = 0; j < mat->cols; j++) {
+            *matrix_at(mat, i, j) += x;
+        }
+    }
+}
+
+void matrix_rowsum(const matrix *mat, matrix *result) {
+    /* Result is a column vector with a row for each row of the matrix. */
+    assert(result->cols == 1 && mat->rows == result->rows);
+
+    for (int i = 0; i < mat->rows; i++) {
+        nn_real sum = 0;
+        for (int j = 0; j < mat->cols; j++) {
+            sum += matrix_get(mat, i, j);
+        }
+        result->data[i] = sum;
+    }
+}
+
+void matrix_transpose(const matrix *mat, matrix *result) {
+    assert(mat->rows == result->cols && mat->cols == result->rows);
+    assert(mat->data != result->data);
+
+    for (int i = 0; i < mat->rows; i++) {
+        for (int j = 0; j < mat->cols; j++) {
+            *matrix_at(result, j, i) = matrix_get(mat, i, j);
         }
     }
 }
 
-void matrix_scalarproduct(matrix *mat, double scalar) {
+void matrix_scalarproduct(matrix *mat, nn_real scalar) {
     for (int i = 0; i < mat->rows; i++) {
         for (int j = 0; j < mat->cols; j++) {
             *matrix_at(mat, i, j) *= scalar;
@@ -78,31 +263,205 @@ void matrix_scalarproduct(matrix *mat, double scalar) {
     }        
 }
 
-void matrix_multiply_elementwise(matrix *mat, matrix *B) {
+void matrix_multiply_elementwise(matrix *mat, const matrix *B) {
     /* Matrices should have equal dimensions. */
     assert(mat->rows == B->rows && mat->cols == B->cols);
 
     for (int i = 0; i < mat->rows; i++) {
         for (int j = 0; j < mat->cols; j++) {
-            *matrix_at(mat, i, j) *= *matrix_at(B, i, j);
+            *matrix_at(mat, i, j) *= matrix_get(B, i, j);
         }
     }    
 }
 
-void matrix_product(matrix *a, matrix *b, matrix *res) {
+/* Dispatches to the fastest kernel supported by the CPU.
+ * The summation order differs from the naive i-j-k loop, hence the result may
+ * differ from it by rounding only: every element of the result is within
+ * k * eps * sum(|a_ik * b_kj|) of the exact value, k being a->cols and eps
+ * being DBL_EPSILON, or FLT_EPSILON for NN_FLOAT. */
+void matrix_product(const matrix *a, const matrix *b, matrix *res) {
     /* Check inputs' dimensions. */
     assert(a->cols == b->rows);
 
     /* Check result matrix dimensions. */
     assert(res->rows == a->rows && res->cols == b->cols);
-    
-    for (int i = 0; i < a->rows; i++) {
-        for (int j = 0; j < b->cols; j++) {
-            double sum = 0;
-            for (int k = 0; k < a->cols; k++) {
-                sum += *matrix_at(a, i, k) * *matrix_at(b, k, j);
+
+    /* Result should not overlap with the inputs. */
+    assert(res->data != a->data && res->data != b->data);
+
+    int isa = simd_isa();
+    if (b->cols == 1) {
+        /* Matrix-vector product, e.g. layer applied to a single input. */
+        kernels[isa].gemv(a->rows, a->cols, a->data, a->cols, b->data, res->data);
+    } else {
+        kernels[isa].gemm(a->rows, b->cols, a->cols, a->data, a->cols,
+                          b->data, b->cols, res->data, res->cols);
+    }
+}
+
+/* Adds the outer product alpha * x * y^T to the matrix in place, x having a->rows
+ * and y a->cols elements. Does the work of a product, a scaling and an addition
+ * in a single pass over the matrix, without a temporary of its size. */
+void matrix_rank1_update(matrix *a, nn_real alpha, const nn_real *x, const nn_real *y) {
+    kernels[simd_isa()].ger(a->rows, a->cols, alpha, x, y, a->data, a->cols);
+}
+
+/* Whether the activation can be applied by the fused kernels. */
+static int dense_fusable(int activation) {
+    return activation != STEP && activation != SOFTPLUS && activation != SOFTMAX;
+}
+
+/* Evaluates a dense layer for every column of x in a single pass over the product:
+ * the bias is added and the activation applied before the result is stored.
+ * net, if not NULL, receives the values before the activation. */
+void matrix_dense(const matrix *w, const matrix *x, const matrix *bias, int activation,
+                  matrix *net, matrix *out) {
+    assert(w->cols == x->rows);
+    assert(bias->rows == w->rows && bias->cols == 1);
+    assert(out->rows == w->rows && out->cols == x->cols);
+    assert(!net || (net->rows == out->rows && net->cols == out->cols));
+
+    int isa = simd_isa();
+    if (kernels[isa].dense_gemv == NULL || w->cols == 0) {
+        /* Separate passes, the way the scalar code always does. */
+        matrix *result = net ? net : out;
+        matrix_product(w, x, result);
+        matrix_add_columnwise(result, bias);
+        activation_forward(activation, result->data, out->data, out->rows, out->cols);
+        return;
+    }
+
+    /* Activations without a vector version, and softmax normalizing whole columns,
+     * are applied to the stored net afterwards. */
+    int fused = dense_fusable(activation);
+    struct epilogue ep = { bias->data, fused ? activation : IDENTITY,
+                           net ? net->data : NULL, out->cols };
+
+    if (x->cols == 1) {
+        kernels[isa].dense_gemv(w->rows, w->cols, w->data, w->cols, x->data, &ep, out->data);
+    } else {
+        kernels[isa].dense_gemm(w->rows, x->cols, w->cols, w->data, w->cols,
+                                x->data, x->cols, &ep, out->data, out->cols);
+    }
+
+    if (!fused)
+        activation_forward(activation, out->data, out->data, out->rows, out->cols);
+}
+
+/* Propagates dE/dnet of a single sample back through a dense layer of the weights w:
+ * result = f'(net) * (w^T * delta), net and out being of the previous layer, whose
+ * activation is f. w is read along its rows, as by the forward pass, rather than
+ * down its columns, and the derivative is applied before the result is stored. */
+void matrix_dense_backward(const matrix *w, const nn_real *delta, int activation,
+                           const nn_real *net, const nn_real *out, nn_real *result) {
+    /* Activations without a vector version, and softmax, are applied afterwards. */
+    int fused = dense_fusable(activation);
+    struct derivative d = { activation, net, out };
+
+    kernels[simd_isa()].dense_gemv_t(w->rows, w->cols, w->data, w->cols, delta,
+                                     fused ? &d : NULL, result);
+    if (!fused)
+        activation_backward(activation, net, out, result, w->cols, 1);
+}
+
+/* Evaluates a layer of the sparse weights w, stored as compressed rows, for every column
+ * of x, like matrix_dense: only the nonzero weights are read and multiplied. */
+void matrix_csr_dense(const sparse_matrix *w, const matrix *x, const matrix *bias, int activation,
+                      matrix *net, matrix *out) {
+    assert(w->cols == x->rows);
+    assert(bias->rows == w->rows && bias->cols == 1);
+    assert(out->rows == w->rows && out->cols == x->cols);
+    assert(!net || (net->rows == out->rows && net->cols == out->cols));
+
+    int isa = simd_isa();
+    if (kernels[isa].csr_gemv == NULL) {
+        matrix *result = net ? net : out;
+        csr_gemm_scalar(w->rows, x->cols, w->start, w->index, w->value, x->data, x->cols,
+                        result->data, result->cols);
+        matrix_add_columnwise(result, bias);
+        activation_forward(activation, result->data, out->data, out->rows, out->cols);
+        return;
+    }
+
+    int fused = dense_fusable(activation);
+    struct epilogue ep = { bias->data, fused ? activation : IDENTITY,
+                           net ? net->data : NULL, out->cols };
+
+    if (x->cols == 1) {
+        kernels[isa].csr_gemv(w->rows, w->start, w->index, w->value, x->data, &ep, out->data);
+    } else {
+        kernels[isa].csr_gemm(w->rows, x->cols, w->start, w->index, w->value, x->data, x->cols,
+                              &ep, out->data, out->cols);
+    }
+
+    if (!fused)
+        activation_forward(activation, out->data, out->data, out->rows, out->cols);
+}
+
+/* Rows of the weights evaluated at once by the sparse kernel,
+ * sharing the loads of the indices and values. */
+#define SPARSE_ROWS 4
+
+/* Evaluates a dense layer for the samples stored as the sparse rows of x,
+ * i.e. out = f(w * x^T + bias), like matrix_dense. Only the columns of w
+ * of the nonzero inputs are read, a row of w serving all the samples
+ * before the next one is loaded. */
+void matrix_dense_sparse(const matrix *w, const sparse_matrix *x, const matrix *bias, int activation,
+                         matrix *net, matrix *out) {
+    assert(w->cols == x->cols);
+    assert(bias->rows == w->rows && bias->cols == 1);
+    assert(out->rows == w->rows && out->cols == x->rows);
+    assert(!net || (net->rows == out->rows && net->cols == out->cols));
+
+    matrix *result = net ? net : out;
+    int n = x->rows, ldw = w->cols;
+
+    int i = 0;
+    for (; i + SPARSE_ROWS <= w->rows; i += SPARSE_ROWS) {
+        const nn_real *a = w->data + (size_t)i*ldw;
+        for (int j = 0; j < n; j++) {
+            nn_real s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+            for (int p = x->start[j]; p < x->start[j+1]; p++) {
+                const nn_real *col = a + x->index[p];
+                nn_real v = x->value[p];
+                s0 += col[0] * v;
+                s1 += col[ldw] * v;
+                s2 += col[2*ldw] * v;
+                s3 += col[3*ldw] * v;
             }
-            *matrix_at(res, i, j) = sum;
+            result->data[i*n + j] = s0 + bias->data[i];
+            result->data[(i+1)*n + j] = s1 + bias->data[i+1];
+            result->data[(i+2)*n + j] = s2 + bias->data[i+2];
+            result->data[(i+3)*n + j] = s3 + bias->data[i+3];
+        }
+    }
+    for (; i < w->rows; i++) {
+        const nn_real *a = w->data + (size_t)i*ldw;
+        for (int j = 0; j < n; j++) {
+            nn_real sum = 0;
+            for (int p = x->start[j]; p < x->start[j+1]; p++)
+                sum += a[x->index[p]] * x->value[p];
+            result->data[i*n + j] = sum + bias->data[i];
+        }
+    }
+
+    activation_forward(activation, result->data, out->data, out->rows, out->cols);
+}
+
+/* Adds alpha * d * x to the matrix in place, x being sparse. Only the columns of
+ * the nonzero elements of x are written: a layer's weights of the inputs that were 0
+ * have no gradient. Like matrix_rank1_update, rows of d which are 0 are skipped. */
+void matrix_sparse_update(matrix *a, nn_real alpha, const matrix *d, const sparse_matrix *x) {
+    assert(a->rows == d->rows && d->cols == x->rows && a->cols == x->cols);
+
+    for (int i = 0; i < a->rows; i++) {
+        nn_real *row = a->data + (size_t)i*a->cols;
+        for (int j = 0; j < x->rows; j++) {
+            nn_real adij = alpha * d->data[i*d->cols + j];
+            if (adij == 0) continue;
+
+            for (int p = x->start[j]; p < x->start[j+1]; p++)
+                row[x->index[p]] += adij * x->value[p];
         }
     }
 }
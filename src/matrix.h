@@ -15,25 +15,57 @@
 #ifndef NN_MATRIX_H
 #define NN_MATRIX_H
 
+/* Element type of all the matrices, see nn_real in nn/nn.h. */
+#ifdef NN_FLOAT
+typedef float nn_real;
+#else
+typedef double nn_real;
+#endif
+
 typedef struct {
     int rows, cols;
-    double *data;
+    nn_real *data;
 } matrix;
 
-matrix *create_matrix(int rows, int cols, double *data);
+/* Compressed sparse rows: only the nonzero elements are stored, a row after another. */
+typedef struct {
+    int rows, cols;
+    int *start; /* rows + 1 offsets of the rows' elements, start[0] being 0 */
+    int *index; /* column of every element */
+    nn_real *value;
+} sparse_matrix;
 
-void matrix_product(matrix *A, matrix *B, matrix *out);
-void matrix_add(matrix *m, matrix *B);
-void matrix_apply(matrix *m, double (*op)(double), matrix *result);
+matrix *create_matrix(int rows, int cols, const nn_real *data);
 
-void matrix_scalarproduct(matrix *m, double scalar);
+void matrix_product(const matrix *A, const matrix *B, matrix *out);
+void matrix_add(matrix *m, const matrix *B);
+void matrix_add_columnwise(matrix *m, const matrix *v);
+void matrix_rowsum(const matrix *m, matrix *result);
+void matrix_transpose(const matrix *m, matrix *result);
+void matrix_apply(const matrix *m, double (*op)(double), matrix *result);
+void matrix_rank1_update(matrix *a, nn_real alpha, const nn_real *x, const nn_real *y);
+void matrix_dense(const matrix *w, const matrix *x, const matrix *bias, int activation,
+                  matrix *net, matrix *out);
+void matrix_dense_sparse(const matrix *w, const sparse_matrix *x, const matrix *bias, int activation,
+                         matrix *net, matrix *out);
+void matrix_csr_dense(const sparse_matrix *w, const matrix *x, const matrix *bias, int activation,
+                      matrix *net, matrix *out);
+void matrix_sparse_update(matrix *a, nn_real alpha, const matrix *d, const sparse_matrix *x);
+void matrix_dense_backward(const matrix *w, const nn_real *delta, int activation,
+                           const nn_real *net, const nn_real *out, nn_real *result);
+
+void matrix_scalarproduct(matrix *m, nn_real scalar);
 void matrix_subtract(matrix *m, matrix *B);
-void matrix_multiply_elementwise(matrix *m, matrix *B);
+void matrix_multiply_elementwise(matrix *m, const matrix *B);
 
 void matrix_destroy(matrix *m);
 
-static inline double *matrix_at(matrix *m, int row, int col) {
+static inline nn_real *matrix_at(matrix *m, int row, int col) {
     return &m->data[row*m->cols + col];
 }
 
+static inline nn_real matrix_get(const matrix *m, int row, int col) {
+    return m->data[row*m->cols + col];
+}
+
 #endif
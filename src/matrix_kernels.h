@@ -0,0 +1,514 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+/* Matrix product kernels, instantiated by matrix.c once per instruction set.
+ * Has no include guard on purpose, see simd_ops.h. Requires simd_math.h.
+ * All matrices are row-major, ld* being the distance between the rows. */
+
+/* Activation function applied by the fused kernels.
+ * Only called for the activations accepted by dense_fusable(). */
+static inline SIMD_ATTR vreal K(vactivate)(int activation, vreal x) {
+    switch (activation) {
+    case RELU:
+        return vmax(x, vzero());
+    case RELU_LEAKY:
+        return vmax(x, vmul(x, vset1(RELU_LEAKY_LEAKAGE)));
+    case TANH:
+        return K(vtanh)(x);
+    case GAUSSIAN:
+        return K(vgaussian)(x);
+    case SIGMOID:
+        return K(vsigmoid)(x);
+    default:
+        return x;
+    }
+}
+
+/* Completes the accumulated net of the fused kernels for the elements of a row:
+ * adds the bias, stores net if needed and returns the activated value. */
+static inline SIMD_ATTR vreal K(finish)(const struct epilogue *ep, vreal v, int row, nn_real *net) {
+    v = vadd(v, vset1(ep->bias[row]));
+    if (net) vstore(net, v);
+    return K(vactivate)(ep->activation, v);
+}
+
+/* Scalar version of finish for the tails of the rows. */
+static inline SIMD_ATTR nn_real K(finish1)(const struct epilogue *ep, nn_real x, int row, nn_real *net) {
+    x += ep->bias[row];
+    if (net) *net = x;
+    return vfirst(K(vactivate)(ep->activation, vset1(x)));
+}
+
+/* Dot products of four rows of A with x, stored in y[0..4).
+ * x is loaded once for the four rows. */
+static inline SIMD_ATTR void K(dot4)(int n, const nn_real *a, int lda, const nn_real *x, nn_real *y) {
+    const nn_real *a0 = a, *a1 = a0 + lda, *a2 = a1 + lda, *a3 = a2 + lda;
+
+    /* Two independent accumulators per row to hide the FMA latency. */
+    vreal s00 = vzero(), s01 = vzero(), s10 = vzero(), s11 = vzero();
+    vreal s20 = vzero(), s21 = vzero(), s30 = vzero(), s31 = vzero();
+
+    int k = 0;
+    for (; k + 2*VW <= n; k += 2*VW) {
+        vreal x0 = vload(x + k), x1 = vload(x + k + VW);
+        s00 = vfma(vload(a0 + k), x0, s00); s01 = vfma(vload(a0 + k + VW), x1, s01);
+        s10 = vfma(vload(a1 + k), x0, s10); s11 = vfma(vload(a1 + k + VW), x1, s11);
+        s20 = vfma(vload(a2 + k), x0, s20); s21 = vfma(vload(a2 + k + VW), x1, s21);
+        s30 = vfma(vload(a3 + k), x0, s30); s31 = vfma(vload(a3 + k + VW), x1, s31);
+    }
+    for (; k + VW <= n; k += VW) {
+        vreal x0 = vload(x + k);
+        s00 = vfma(vload(a0 + k), x0, s00);
+        s10 = vfma(vload(a1 + k), x0, s10);
+        s20 = vfma(vload(a2 + k), x0, s20);
+        s30 = vfma(vload(a3 + k), x0, s30);
+    }
+
+    nn_real t0 = K(vhsum)(vadd(s00, s01)), t1 = K(vhsum)(vadd(s10, s11));
+    nn_real t2 = K(vhsum)(vadd(s20, s21)), t3 = K(vhsum)(vadd(s30, s31));
+    for (; k < n; k++) {
+        t0 += a0[k] * x[k];
+        t1 += a1[k] * x[k];
+        t2 += a2[k] * x[k];
+        t3 += a3[k] * x[k];
+    }
+
+    y[0] = t0; y[1] = t1; y[2] = t2; y[3] = t3;
+}
+
+/* Dot product of a single row with x. */
+static inline SIMD_ATTR nn_real K(dot1)(int n, const nn_real *a, const nn_real *x) {
+    vreal s0 = vzero(), s1 = vzero();
+
+    int k = 0;
+    for (; k + 2*VW <= n; k += 2*VW) {
+        s0 = vfma(vload(a + k), vload(x + k), s0);
+        s1 = vfma(vload(a + k + VW), vload(x + k + VW), s1);
+    }
+    for (; k + VW <= n; k += VW)
+        s0 = vfma(vload(a + k), vload(x + k), s0);
+
+    nn_real t = K(vhsum)(vadd(s0, s1));
+    for (; k < n; k++)
+        t += a[k] * x[k];
+
+    return t;
+}
+
+/* y = A*x for the m x n matrix A. */
+static SIMD_ATTR void K(gemv)(int m, int n, const nn_real *a, int lda,
+                              const nn_real *x, nn_real *y) {
+    int i = 0;
+    for (; i + 4 <= m; i += 4)
+        K(dot4)(n, a + i*lda, lda, x, y + i);
+    for (; i < m; i++)
+        y[i] = K(dot1)(n, a + i*lda, x);
+}
+
+/* A += alpha * x * y^T for the m x n matrix A, see ger_scalar. */
+static SIMD_ATTR void K(ger)(int m, int n, nn_real alpha, const nn_real *x, const nn_real *y,
+                             nn_real *a, int lda) {
+    for (int i = 0; i < m; i++) {
+        nn_real axi = alpha * x[i];
+        if (axi == 0) continue;
+
+        nn_real *row = a + i*lda;
+        vreal s = vset1(axi);
+        int k = 0;
+        for (; k + 2*VW <= n; k += 2*VW) {
+            vstore(row + k, vfma(s, vload(y + k), vload(row + k)));
+            vstore(row + k + VW, vfma(s, vload(y + k + VW), vload(row + k + VW)));
+        }
+        for (; k + VW <= n; k += VW)
+            vstore(row + k, vfma(s, vload(y + k), vload(row + k)));
+        for (; k < n; k++)
+            row[k] += axi * y[k];
+    }
+}
+
+/* Completes the sums s of the rows i ... i + rows of a matrix-vector kernel,
+ * rows being at most DENSE_ROWS: stores f(s + bias) in out and s + bias in net, if given. */
+static inline SIMD_ATTR void K(finish_rows)(const struct epilogue *ep, int i, int rows,
+                                            nn_real *s, nn_real *out) {
+    nn_real b[DENSE_ROWS] = { 0 };
+
+    memcpy(b, ep->bias + i, rows * sizeof(nn_real));
+    for (int r = 0; r < DENSE_ROWS; r += VW) {
+        vreal v = vadd(vload(s + r), vload(b + r));
+        vstore(b + r, v);
+        vstore(s + r, K(vactivate)(ep->activation, v));
+    }
+
+    if (ep->net) memcpy(ep->net + i, b, rows * sizeof(nn_real));
+    memcpy(out + i, s, rows * sizeof(nn_real));
+}
+
+/* out = f(A*x + bias) for the m x n matrix A, also storing A*x + bias in net, if given.
+ * Rows are completed in blocks of DENSE_ROWS, which fill whole vectors
+ * for the activation while the sums are still at hand. */
+static SIMD_ATTR void K(dense_gemv)(int m, int n, const nn_real *a, int lda, const nn_real *x,
+                                    const struct epilogue *ep, nn_real *out) {
+    for (int i = 0; i < m; i += DENSE_ROWS) {
+        int rows = m - i < DENSE_ROWS ? m - i : DENSE_ROWS;
+        nn_real s[DENSE_ROWS] = { 0 };
+
+        int r = 0;
+        for (; r + 4 <= rows; r += 4)
+            K(dot4)(n, a + (i+r)*lda, lda, x, s + r);
+        for (; r < rows; r++)
+            s[r] = K(dot1)(n, a + (i+r)*lda, x);
+
+        K(finish_rows)(ep, i, rows, s, out);
+    }
+}
+
+/* Dot product of a sparse row, the elements value[0..n) in the columns index[0..n), with x. */
+static inline SIMD_ATTR nn_real K(csr_dot)(int n, const int *index, const nn_real *value,
+                                           const nn_real *x) {
+    vreal s0 = vzero(), s1 = vzero();
+
+    int p = 0;
+    for (; p + 2*VW <= n; p += 2*VW) {
+        s0 = vfma(vload(value + p), vgather(x, index + p), s0);
+        s1 = vfma(vload(value + p + VW), vgather(x, index + p + VW), s1);
+    }
+    for (; p + VW <= n; p += VW)
+        s0 = vfma(vload(value + p), vgather(x, index + p), s0);
+
+    nn_real t = K(vhsum)(vadd(s0, s1));
+    for (; p < n; p++)
+        t += value[p] * x[index[p]];
+
+    return t;
+}
+
+/* out = f(A*x + bias) for the sparse m-row matrix A stored as compressed rows,
+ * the elements of x being gathered by the columns of A's elements.
+ * Otherwise the same as dense_gemv. */
+static SIMD_ATTR void K(csr_gemv)(int m, const int *start, const int *index, const nn_real *value,
+                                  const nn_real *x, const struct epilogue *ep, nn_real *out) {
+    for (int i = 0; i < m; i += DENSE_ROWS) {
+        int rows = m - i < DENSE_ROWS ? m - i : DENSE_ROWS;
+        nn_real s[DENSE_ROWS] = { 0 };
+
+        for (int r = 0; r < rows; r++) {
+            int p = start[i+r];
+            s[r] = K(csr_dot)(start[i+r+1] - p, index + p, value + p, x);
+        }
+
+        K(finish_rows)(ep, i, rows, s, out);
+    }
+}
+
+/* out = f(A*X + bias) for the sparse m-row matrix A stored as compressed rows
+ * and the matrix X of n columns. A row of out is the sum of the rows of X
+ * selected by the row of A, scaled by its elements, accumulated in registers
+ * for 2*VW columns at a time. */
+static SIMD_ATTR void K(csr_gemm)(int m, int n, const int *start, const int *index,
+                                  const nn_real *value, const nn_real *x, int ldx,
+                                  const struct epilogue *ep, nn_real *out, int ldo) {
+#define NET(p, j) ((p) ? (p) + (j) : NULL)
+    for (int i = 0; i < m; i++) {
+        nn_real *o = out + i*ldo, *net = ep->net ? ep->net + i*ep->ldn : NULL;
+
+        int j = 0;
+        for (; j + 2*VW <= n; j += 2*VW) {
+            vreal s0 = vzero(), s1 = vzero();
+            for (int p = start[i]; p < start[i+1]; p++) {
+                const nn_real *row = x + index[p]*ldx + j;
+                vreal v = vset1(value[p]);
+                s0 = vfma(v, vload(row), s0);
+                s1 = vfma(v, vload(row + VW), s1);
+            }
+            vstore(o + j, K(finish)(ep, s0, i, NET(net, j)));
+            vstore(o + j + VW, K(finish)(ep, s1, i, NET(net, j + VW)));
+        }
+        for (; j + VW <= n; j += VW) {
+            vreal s0 = vzero();
+            for (int p = start[i]; p < start[i+1]; p++)
+                s0 = vfma(vset1(value[p]), vload(x + index[p]*ldx + j), s0);
+            vstore(o + j, K(finish)(ep, s0, i, NET(net, j)));
+        }
+        for (; j < n; j++) {
+            nn_real t = 0;
+            for (int p = start[i]; p < start[i+1]; p++)
+                t += value[p] * x[index[p]*ldx + j];
+            o[j] = K(finish1)(ep, t, i, NET(net, j));
+        }
+    }
+#undef NET
+}
+
+/* delta * f'(net) for the activations accepted by dense_fusable, out being f(net),
+ * computed the same way as by activation_backward. */
+static inline SIMD_ATTR vreal K(vbackward)(int activation, vreal delta, vreal net, vreal out) {
+    vreal one = vset1(1.0);
+    switch (activation) {
+    case RELU:
+        return vselect(net, delta, vzero());
+    case RELU_LEAKY:
+        return vmul(delta, vselect(net, one, vset1(RELU_LEAKY_LEAKAGE)));
+    case TANH:
+        return vmul(delta, vsub(one, vmul(out, out)));
+    case GAUSSIAN:
+        return vmul(delta, vmul(vmul(vset1(-2.0), net), out));
+    case SIGMOID:
+        return vmul(delta, vmul(out, vsub(one, out)));
+    default:
+        return delta;
+    }
+}
+
+/* y (+)= A[0..4, 0..n)^T * x[0..4), four rows of A combined per pass over y.
+ * y is only stored if first is set. */
+static inline SIMD_ATTR void K(axpy4)(int n, const nn_real *a, int lda, const nn_real *x,
+                                      nn_real *y, int first) {
+    const nn_real *a0 = a, *a1 = a0 + lda, *a2 = a1 + lda, *a3 = a2 + lda;
+    vreal x0 = vset1(x[0]), x1 = vset1(x[1]), x2 = vset1(x[2]), x3 = vset1(x[3]);
+
+    int j = 0;
+    for (; j + VW <= n; j += VW) {
+        vreal v = first ? vmul(x0, vload(a0 + j)) : vfma(x0, vload(a0 + j), vload(y + j));
+        v = vfma(x1, vload(a1 + j), v);
+        v = vfma(x2, vload(a2 + j), v);
+        vstore(y + j, vfma(x3, vload(a3 + j), v));
+    }
+    for (; j < n; j++) {
+        nn_real v = first ? x[0] * a0[j] : y[j] + x[0] * a0[j];
+        y[j] = v + x[1] * a1[j] + x[2] * a2[j] + x[3] * a3[j];
+    }
+}
+
+/* y (+)= A[0, 0..n)^T * x[0], a single row of A. */
+static inline SIMD_ATTR void K(axpy1)(int n, const nn_real *a, nn_real x, nn_real *y, int first) {
+    vreal xv = vset1(x);
+
+    int j = 0;
+    for (; j + VW <= n; j += VW)
+        vstore(y + j, first ? vmul(xv, vload(a + j)) : vfma(xv, vload(a + j), vload(y + j)));
+    for (; j < n; j++)
+        y[j] = first ? x * a[j] : y[j] + x * a[j];
+}
+
+/* y = f'(net) * (A^T * x) for the m x n matrix A, i.e. x being dE/dnet of a layer of
+ * the weights A, y is dE/dnet of the previous layer, whose net, out and activation
+ * are given by d. Without d, y = A^T * x. A is walked along its rows, accumulating
+ * into y, which stays in the L1 cache, until the derivative is applied to it. */
+static SIMD_ATTR void K(dense_gemv_t)(int m, int n, const nn_real *a, int lda, const nn_real *x,
+                                      const struct derivative *d, nn_real *y) {
+    int i = 0;
+    for (; i + 4 <= m; i += 4)
+        K(axpy4)(n, a + i*lda, lda, x + i, y, i == 0);
+    for (; i < m; i++)
+        K(axpy1)(n, a + i*lda, x[i], y, i == 0);
+
+    if (d == NULL)
+        return;
+
+    int j = 0;
+    for (; j + VW <= n; j += VW)
+        vstore(y + j, K(vbackward)(d->activation, vload(y + j), vload(d->net + j),
+                                   vload(d->out + j)));
+    for (; j < n; j++)
+        y[j] = vfirst(K(vbackward)(d->activation, vset1(y[j]), vset1(d->net[j]),
+                                   vset1(d->out[j])));
+}
+
+/* Register tile of 4 rows of C: C[0..4, 0..n) (+)= A[0..4, 0..k) * B[0..k, 0..n).
+ * Each element of A is broadcast and multiplied with the rows of B,
+ * so B is always walked along its rows.
+ * Epilogue, if given, is applied to the tile at C[row, col] before it is stored. */
+static SIMD_ATTR void K(gemm_tile4)(int n, int k, const nn_real *a, int lda,
+                                    const nn_real *b, int ldb, nn_real *c, int ldc, int accumulate,
+                                    const struct epilogue *ep, int row, int col) {
+    const nn_real *a0 = a, *a1 = a0 + lda, *a2 = a1 + lda, *a3 = a2 + lda;
+    nn_real *c0 = c, *c1 = c0 + ldc, *c2 = c1 + ldc, *c3 = c2 + ldc;
+
+    /* Rows of net for the epilogue. */
+    nn_real *n0 = NULL, *n1 = NULL, *n2 = NULL, *n3 = NULL;
+    if (ep && ep->net) {
+        n0 = ep->net + row*ep->ldn + col;
+        n1 = n0 + ep->ldn; n2 = n1 + ep->ldn; n3 = n2 + ep->ldn;
+    }
+#define NET(p, j) ((p) ? (p) + (j) : NULL)
+
+    int j = 0;
+    for (; j + 2*VW <= n; j += 2*VW) {
+        vreal r00, r01, r10, r11, r20, r21, r30, r31;
+        if (accumulate) {
+            r00 = vload(c0 + j); r01 = vload(c0 + j + VW);
+            r10 = vload(c1 + j); r11 = vload(c1 + j + VW);
+            r20 = vload(c2 + j); r21 = vload(c2 + j + VW);
+            r30 = vload(c3 + j); r31 = vload(c3 + j + VW);
+        } else {
+            r00 = r01 = r10 = r11 = r20 = r21 = r30 = r31 = vzero();
+        }
+
+        for (int p = 0; p < k; p++) {
+            vreal b0 = vload(b + p*ldb + j), b1 = vload(b + p*ldb + j + VW);
+            vreal x;
+            x = vset1(a0[p]); r00 = vfma(x, b0, r00); r01 = vfma(x, b1, r01);
+            x = vset1(a1[p]); r10 = vfma(x, b0, r10); r11 = vfma(x, b1, r11);
+            x = vset1(a2[p]); r20 = vfma(x, b0, r20); r21 = vfma(x, b1, r21);
+            x = vset1(a3[p]); r30 = vfma(x, b0, r30); r31 = vfma(x, b1, r31);
+        }
+
+        if (ep) {
+            r00 = K(finish)(ep, r00, row, NET(n0, j)); r01 = K(finish)(ep, r01, row, NET(n0, j + VW));
+            r10 = K(finish)(ep, r10, row+1, NET(n1, j)); r11 = K(finish)(ep, r11, row+1, NET(n1, j + VW));
+            r20 = K(finish)(ep, r20, row+2, NET(n2, j)); r21 = K(finish)(ep, r21, row+2, NET(n2, j + VW));
+            r30 = K(finish)(ep, r30, row+3, NET(n3, j)); r31 = K(finish)(ep, r31, row+3, NET(n3, j + VW));
+        }
+
+        vstore(c0 + j, r00); vstore(c0 + j + VW, r01);
+        vstore(c1 + j, r10); vstore(c1 + j + VW, r11);
+        vstore(c2 + j, r20); vstore(c2 + j + VW, r21);
+        vstore(c3 + j, r30); vstore(c3 + j + VW, r31);
+    }
+
+    for (; j + VW <= n; j += VW) {
+        vreal r0, r1, r2, r3;
+        if (accumulate) {
+            r0 = vload(c0 + j); r1 = vload(c1 + j); r2 = vload(c2 + j); r3 = vload(c3 + j);
+        } else r0 = r1 = r2 = r3 = vzero();
+
+        for (int p = 0; p < k; p++) {
+            vreal b0 = vload(b + p*ldb + j);
+            r0 = vfma(vset1(a0[p]), b0, r0);
+            r1 = vfma(vset1(a1[p]), b0, r1);
+            r2 = vfma(vset1(a2[p]), b0, r2);
+            r3 = vfma(vset1(a3[p]), b0, r3);
+        }
+
+        if (ep) {
+            r0 = K(finish)(ep, r0, row, NET(n0, j));
+            r1 = K(finish)(ep, r1, row+1, NET(n1, j));
+            r2 = K(finish)(ep, r2, row+2, NET(n2, j));
+            r3 = K(finish)(ep, r3, row+3, NET(n3, j));
+        }
+
+        vstore(c0 + j, r0); vstore(c1 + j, r1); vstore(c2 + j, r2); vstore(c3 + j, r3);
+    }
+
+    for (; j < n; j++) {
+        nn_real t0 = 0, t1 = 0, t2 = 0, t3 = 0;
+        if (accumulate) {
+            t0 = c0[j]; t1 = c1[j]; t2 = c2[j]; t3 = c3[j];
+        }
+
+        for (int p = 0; p < k; p++) {
+            nn_real bp = b[p*ldb + j];
+            t0 += a0[p] * bp; t1 += a1[p] * bp; t2 += a2[p] * bp; t3 += a3[p] * bp;
+        }
+
+        if (ep) {
+            t0 = K(finish1)(ep, t0, row, NET(n0, j));
+            t1 = K(finish1)(ep, t1, row+1, NET(n1, j));
+            t2 = K(finish1)(ep, t2, row+2, NET(n2, j));
+            t3 = K(finish1)(ep, t3, row+3, NET(n3, j));
+        }
+
+        c0[j] = t0; c1[j] = t1; c2[j] = t2; c3[j] = t3;
+    }
+}
+
+/* Same as gemm_tile4 for a single row of C. */
+static SIMD_ATTR void K(gemm_tile1)(int n, int k, const nn_real *a,
+                                    const nn_real *b, int ldb, nn_real *c, int accumulate,
+                                    const struct epilogue *ep, int row, int col) {
+    nn_real *n0 = (ep && ep->net) ? ep->net + row*ep->ldn + col : NULL;
+
+    int j = 0;
+    for (; j + 2*VW <= n; j += 2*VW) {
+        vreal r0 = accumulate ? vload(c + j) : vzero();
+        vreal r1 = accumulate ? vload(c + j + VW) : vzero();
+
+        for (int p = 0; p < k; p++) {
+            vreal x = vset1(a[p]);
+            r0 = vfma(x, vload(b + p*ldb + j), r0);
+            r1 = vfma(x, vload(b + p*ldb + j + VW), r1);
+        }
+
+        if (ep) {
+            r0 = K(finish)(ep, r0, row, NET(n0, j));
+            r1 = K(finish)(ep, r1, row, NET(n0, j + VW));
+        }
+
+        vstore(c + j, r0); vstore(c + j + VW, r1);
+    }
+
+    for (; j + VW <= n; j += VW) {
+        vreal r0 = accumulate ? vload(c + j) : vzero();
+        for (int p = 0; p < k; p++)
+            r0 = vfma(vset1(a[p]), vload(b + p*ldb + j), r0);
+
+        if (ep) r0 = K(finish)(ep, r0, row, NET(n0, j));
+        vstore(c + j, r0);
+    }
+
+    for (; j < n; j++) {
+        nn_real t = accumulate ? c[j] : 0;
+        for (int p = 0; p < k; p++)
+            t += a[p] * b[p*ldb + j];
+
+        if (ep) t = K(finish1)(ep, t, row, NET(n0, j));
+        c[j] = t;
+    }
+#undef NET
+}
+
+/* C = A*B for m x k matrix A and k x n matrix B, k > 0.
+ * B is split into GEMM_KC x GEMM_NC blocks, which stay in the cache
+ * while all the rows of A are passed over them.
+ * Epilogue, if given, is applied after the last block of k. */
+static SIMD_ATTR void K(gemm_epilogue)(int m, int n, int k, const nn_real *a, int lda,
+                                       const nn_real *b, int ldb, nn_real *c, int ldc,
+                                       const struct epilogue *ep) {
+    for (int jc = 0; jc < n; jc += GEMM_NC) {
+        int nc = n - jc < GEMM_NC ? n - jc : GEMM_NC;
+
+        for (int pc = 0; pc < k; pc += GEMM_KC) {
+            int kc = k - pc < GEMM_KC ? k - pc : GEMM_KC;
+            int accumulate = pc > 0;
+            const struct epilogue *last = pc + kc == k ? ep : NULL;
+
+            int i = 0;
+            for (; i + 4 <= m; i += 4)
+                K(gemm_tile4)(nc, kc, a + i*lda + pc, lda, b + pc*ldb + jc, ldb,
+                              c + i*ldc + jc, ldc, accumulate, last, i, jc);
+            for (; i < m; i++)
+                K(gemm_tile1)(nc, kc, a + i*lda + pc, b + pc*ldb + jc, ldb,
+                              c + i*ldc + jc, accumulate, last, i, jc);
+        }
+    }
+}
+
+/* C = A*B, see gemm_epilogue. */
+static SIMD_ATTR void K(gemm)(int m, int n, int k, const nn_real *a, int lda,
+                              const nn_real *b, int ldb, nn_real *c, int ldc) {
+    if (k == 0) {
+        for (int i = 0; i < m; i++)
+            memset(c + i*ldc, 0, n * sizeof(nn_real));
+        return;
+    }
+
+    K(gemm_epilogue)(m, n, k, a, lda, b, ldb, c, ldc, NULL);
+}
+
+/* out = f(A*X + bias) for every column of X, storing A*X + bias in net if given. */
+static SIMD_ATTR void K(dense_gemm)(int m, int n, int k, const nn_real *a, int lda,
+                                    const nn_real *x, int ldx, const struct epilogue *ep,
+                                    nn_real *out, int ldo) {
+    K(gemm_epilogue)(m, n, k, a, lda, x, ldx, out, ldo, ep);
+}
@@ -15,297 +15,845 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <time.h>
 #include <math.h>
 #include <assert.h>
+#include <sys/mman.h>
 
 #include "matrix.h"
 #include "neuralnetwork.h"
 #include "activations.h"
 #include "util.h"
+#include "profile.h"
+#include "prune.h"
 
-static inline int layer_ninputs(layer *layer) {
-    return layer->weights->cols;
+static inline int layer_ninputs(const layer *layer) {
+    return layer->weights.cols;
 }
 
-static inline int layer_noutputs(layer *layer) {
-    return layer->weights->rows;
+static inline int layer_noutputs(const layer *layer) {
+    return layer->weights.rows;
 }
 
-int nn_ninputs(neuralnetwork *nn) {
+int nn_ninputs(const neuralnetwork *nn) {
     return nn->inputs;
 }
 
-int nn_noutputs(neuralnetwork *nn) {
+int nn_noutputs(const neuralnetwork *nn) {
     return nn->outputs;
 }
 
 /* Returns output layer of the network. */
 static layer *nn_outputlayer(neuralnetwork *nn) {
-    layer *current = nn->head;
-    while (current->next != NULL)
-        current = current->next;
-    return current;
+    return &nn->layers[nn->nlayers-1];
 }
 
-/* Xavier weights initialization function. Uses truncated gaussian distribution with
- * standart deviation related to the number of inputs and outputs. */
-static double xavier_generate(int outputs, int inputs) {
-    /* Standart deviation. */
-    double sigma = sqrt(2.0 / (outputs+inputs));
+/* Xavier weights initialization uses truncated gaussian distribution with
+ * standart deviation related to the number of inputs and outputs, limited to max. */
+static double xavier_sigma(int outputs, int inputs, double *max) {
     /* Limit. */
-    double max = sqrt(6.0 / (outputs+inputs));
-    
-    double val = rand_normal_distribution(0, sigma);
+    *max = sqrt(6.0 / (outputs+inputs));
 
-    if (val < -max) {
-        return -max;
-    } else if (val > max) {
-        return max;
-    } else return val;
+    /* Standart deviation. */
+    return sqrt(2.0 / (outputs+inputs));
 }
 
-/* Kaiming weights initialization for ReLU units. */
-static double kaiming_generate(int inputs, double a) {
+/* Kaiming weights initialization for ReLU units, not truncated. */
+static double kaiming_sigma(int inputs, double a, double *max) {
+    *max = INFINITY;
+
     /* Standart deviation. */
-    double sigma = sqrt(2.0 / (inputs*(1+a*a)));
-    
-    return rand_normal_distribution(0, sigma);
+    return sqrt(2.0 / (inputs*(1+a*a)));
 }
 
 neuralnetwork *nn_create(int ninputs) {
     neuralnetwork *nn = malloc(sizeof(neuralnetwork));
     nn->inputs = ninputs;
-    nn->head = 0;
+    nn->outputs = 0;
+    nn->nlayers = 0;
+    nn->layers = NULL;
+    nn->params = NULL;
+    nn->grads = NULL;
+    nn->nparams = 0;
+    nn->optimizer = (nn_optimizer) { SGD, OPTIMIZER_BETA1, OPTIMIZER_BETA2, 0, { NULL, NULL } };
+    rng_seed(&nn->rng, rng_default_seed());
+    nn->sparsity = NN_SPARSITY;
+    nn->mapping = NULL;
+    nn->mapsize = 0;
+    nn->ctx = NULL;
     return nn;
 }
 
-/* Allocates and adds a new layer to the linked list,
+/* Returns n rounded up, so that n elements span a multiple of NN_ALIGN bytes. */
+size_t arena_padded(size_t n) {
+    const size_t pad = NN_ALIGN / sizeof(nn_real);
+    return (n + pad - 1) / pad * pad;
+}
+
+/* Allocates zeroed NN_ALIGN aligned array of n elements, n being padded. */
+nn_real *arena_create(size_t n) {
+    nn_real *arena = aligned_alloc(NN_ALIGN, n * sizeof(nn_real));
+    if (arena == NULL) {
+        /* Allocation failed, there is no point in continuing. */
+        perror(__func__);
+        assert(arena != NULL);
+    }
+
+    memset(arena, 0, n * sizeof(nn_real));
+    return arena;
+}
+
+/* Points the matrices of every layer to their place in the arenas. */
+static void nn_layout(neuralnetwork *nn) {
+    size_t offset = 0;
+    for (int i = 0; i < nn->nlayers; i++) {
+        layer *l = &nn->layers[i];
+
+        l->weights.data = nn->params + offset;
+        offset += arena_padded(l->weights.rows * l->weights.cols);
+
+        l->biases.data = nn->params + offset;
+        offset += arena_padded(l->biases.rows);
+    }
+
+    assert(offset == nn->nparams);
+}
+
+/* Frees the parameter arena, or unmaps the file it lives in. */
+static void nn_freeparams(neuralnetwork *nn) {
+    if (nn->mapping) {
+        munmap(nn->mapping, nn->mapsize);
+        nn->mapping = NULL;
+        nn->mapsize = 0;
+    } else free(nn->params);
+}
+
+/* Makes params, a part of the mapping laid out as the arena of the network's layers,
+ * its parameters. The layers' shapes must be already set, before any context is created.
+ * The mapping is owned by the network from now on. */
+void nn_mapparams(neuralnetwork *nn, nn_real *params, void *mapping, size_t mapsize) {
+    size_t nparams = 0;
+    for (int i = 0; i < nn->nlayers; i++) {
+        const layer *l = &nn->layers[i];
+        nparams += arena_padded(l->weights.rows * l->weights.cols) + arena_padded(l->biases.rows);
+    }
+
+    nn_freeparams(nn);
+    free(nn->grads);
+    optimizer_reset(&nn->optimizer);
+    nn->params = params;
+    nn->grads = NULL;
+    nn->nparams = nparams;
+    nn->mapping = mapping;
+    nn->mapsize = mapsize;
+
+    nn_layout(nn);
+}
+
+/* Appends a new layer to the array, growing the parameter arenas.
  * If weights is NULL, the weights will be generated by Xavier weights initialization function.
  * If biases is NULL, initialize biases as 0 vector. */
-void nn_addlayer(neuralnetwork *nn, int outputs, double *weights, double *biases, int activation) {
-    int inputs = 0;
-    layer *new = NULL; /* newly allocated layer struct */
-    if (nn->head == NULL) {
-        nn->head = calloc(sizeof(layer), 1);
-        new = nn->head;
-
-        new->prev = NULL;
-        inputs = nn->inputs;
-
-        /* Seed RNG on the first pass. */
-        srand(time(NULL));
-    
-    } else {
-        layer *current = nn->head;
-        while (current->next != NULL) current = current->next;
-
-        current->next = calloc(sizeof(layer), 1);
-        new = current->next;
-        
-        new->prev = current;
-        inputs = layer_noutputs(current);
+void nn_addlayer(neuralnetwork *nn, int outputs, nn_real *weights, nn_real *biases, int activation) {
+    int inputs = nn->nlayers > 0 ? layer_noutputs(nn_outputlayer(nn)) : nn->inputs;
+
+    /* Existing context does not fit the new topology. */
+    nn_context_destroy(nn->ctx);
+    nn->ctx = NULL;
+
+    layer *layers = realloc(nn->layers, (nn->nlayers + 1) * sizeof(layer));
+    if (layers == NULL) {
+        perror(__func__);
+        assert(layers != NULL);
     }
+    nn->layers = layers;
+
+    /* Parameters of the existing layers, allocated or mapped, are moved to the new arena.
+     * Gradients are transient, the optimizer starts over. */
+    size_t nparams = nn->nparams + arena_padded(outputs * inputs) + arena_padded(outputs);
+    nn_real *params = arena_create(nparams);
+    if (nn->params)
+        memcpy(params, nn->params, nn->nparams * sizeof(nn_real));
+
+    nn_freeparams(nn);
+    free(nn->grads);
+    optimizer_reset(&nn->optimizer);
+    nn->params = params;
+    nn->grads = NULL;
+    nn->nparams = nparams;
+
+    layer *new = &nn->layers[nn->nlayers++];
+    new->weights = (matrix) { outputs, inputs, NULL };
+    new->biases = (matrix) { outputs, 1, NULL };
+    new->activation = activation;
+    new->csr = (sparse_matrix) { 0 };
 
-    new->weights = create_matrix(outputs, inputs, weights);
-    new->weights_delta = create_matrix(outputs, inputs, NULL);
+    nn_layout(nn);
 
     /* Populate the weights matrix. */
-    if (weights == NULL) {    
-        for (int i = 0; i < new->weights->rows; i++) {
-            for (int j = 0; j < new->weights->cols; j++) {
-                switch (activation) {
-                case RELU: 
-                    *matrix_at(new->weights, i, j) = kaiming_generate(inputs, 0); break;
-                case RELU_LEAKY:
-                    *matrix_at(new->weights, i, j) = kaiming_generate(inputs, RELU_LEAKY_LEAKAGE); break;
-                default:
-                    *matrix_at(new->weights, i, j) = xavier_generate(outputs, inputs); break;
-                }
-            }
+    if (weights == NULL) {
+        double sigma, max;
+        switch (activation) {
+        case RELU:
+            sigma = kaiming_sigma(inputs, 0, &max); break;
+        case RELU_LEAKY:
+            sigma = kaiming_sigma(inputs, RELU_LEAKY_LEAKAGE, &max); break;
+        default:
+            sigma = xavier_sigma(outputs, inputs, &max); break;
         }
+        rng_normal(&nn->rng, new->weights.data, (size_t)outputs * inputs, sigma, max);
+    } else memcpy(new->weights.data, weights, outputs * inputs * sizeof(nn_real));
+
+    /* Biases are already zeroed otherwise. */
+    if (biases)
+        memcpy(new->biases.data, biases, outputs * sizeof(nn_real));
+
+    nn->outputs = outputs;
+}
+
+/* Returns the largest number of inputs or outputs over all layers. */
+static int nn_maxwidth(const neuralnetwork *nn) {
+    int width = nn->inputs;
+    for (int i = 0; i < nn->nlayers; i++) {
+        if (layer_noutputs(&nn->layers[i]) > width)
+            width = layer_noutputs(&nn->layers[i]);
     }
+    return width;
+}
 
-    new->biases = create_matrix(outputs, 1, biases);
-    new->biases_delta = create_matrix(outputs, 1, NULL);
+/* (Re)allocates all the buffers of the context for batches of up to n samples. */
+static void context_allocate(nn_context *ctx, int n) {
+    const neuralnetwork *nn = ctx->nn;
 
-    new->activation = activation;
+    for (int i = 0; i < nn->nlayers; i++) {
+        const layer *p = &nn->layers[i];
+        layer_state *state = &ctx->layers[i];
 
-    new->net = create_matrix(outputs, 1, NULL);
-    new->out = create_matrix(outputs, 1, NULL);
-    
-    new->next = NULL;
-    nn->outputs = outputs;
+        matrix_destroy(state->net);
+        matrix_destroy(state->out);
+        matrix_destroy(state->delta);
+
+        state->net = ctx->training ? create_matrix(layer_noutputs(p), n, NULL) : NULL;
+        state->out = create_matrix(layer_noutputs(p), n, NULL);
+        state->delta = ctx->training ? create_matrix(layer_noutputs(p), n, NULL) : NULL;
+    }
+
+    matrix_destroy(ctx->input);
+    matrix_destroy(ctx->output);
+
+    ctx->input = create_matrix(nn->inputs, n, NULL);
+    ctx->output = create_matrix(n, nn->outputs, NULL);
+
+    for (int k = 0; k < 2; k++) {
+        matrix_destroy(ctx->scratch[k]);
+        ctx->scratch[k] = ctx->training ? create_matrix(n, nn_maxwidth(nn), NULL) : NULL;
+    }
+
+    /* The elements are allocated once a sparse input is found. */
+    ctx->compressed.start = realloc(ctx->compressed.start, (n + 1) * sizeof(int));
+    if (ctx->compressed.start == NULL) {
+        perror(__func__);
+        assert(ctx->compressed.start != NULL);
+    }
+
+    ctx->batch = n;
+}
+
+nn_context *nn_context_create(const neuralnetwork *nn) {
+    nn_context *ctx = calloc(1, sizeof(nn_context));
+    if (ctx == NULL) {
+        perror(__func__);
+        return NULL;
+    }
+
+    ctx->nn = nn;
+    ctx->training = 0;
+
+    ctx->layers = calloc(nn->nlayers, sizeof(layer_state));
+    if (nn->nlayers > 0 && ctx->layers == NULL) {
+        perror(__func__);
+        nn_context_destroy(ctx);
+        return NULL;
+    }
+
+    context_allocate(ctx, 1);
+    return ctx;
+}
+
+void nn_context_destroy(nn_context *ctx) {
+    if (!ctx) return;
+
+    if (ctx->layers) {
+        for (int i = 0; i < ctx->nn->nlayers; i++) {
+            matrix_destroy(ctx->layers[i].net);
+            matrix_destroy(ctx->layers[i].out);
+            matrix_destroy(ctx->layers[i].delta);
+        }
+        free(ctx->layers);
+    }
+
+    matrix_destroy(ctx->input);
+    matrix_destroy(ctx->output);
+    matrix_destroy(ctx->scratch[0]);
+    matrix_destroy(ctx->scratch[1]);
+    free(ctx->compressed.start);
+    free(ctx->compressed.index);
+    free(ctx->compressed.value);
+    free(ctx);
+}
+
+/* Returns the context of the network's own functions. */
+static nn_context *nn_context_default(neuralnetwork *nn) {
+    if (nn->ctx == NULL)
+        nn->ctx = nn_context_create(nn);
+    return nn->ctx;
 }
 
-/* Recursive deallocation function. Can be changed to use a loop instead. */
-static void layers_destroy(layer *head) {
-    if (head != NULL) {
-        layers_destroy(head->next);
-        
-        matrix_destroy(head->weights);
-        matrix_destroy(head->weights_delta);
-
-        matrix_destroy(head->biases);
-        matrix_destroy(head->biases_delta);
-        
-        matrix_destroy(head->net);
-        matrix_destroy(head->out);
-        
-        free(head);
+/* Prepares the buffers for a batch of n samples.
+ * They are only reallocated if the batch is larger than any before,
+ * or the context is used for training the first time. */
+static void context_setbatch(nn_context *ctx, int n, int training) {
+    if (n > ctx->batch || (training && !ctx->training)) {
+        ctx->training |= training;
+        context_allocate(ctx, n > ctx->batch ? n : ctx->batch);
     }
+
+    for (int i = 0; i < ctx->nn->nlayers; i++) {
+        layer_state *state = &ctx->layers[i];
+
+        state->out->cols = n;
+        if (ctx->training) {
+            state->net->cols = n;
+            state->delta->cols = n;
+        }
+    }
+
+    ctx->input->cols = n;
+    ctx->output->rows = n;
+}
+
+/* Returns a rows x cols matrix backed by the k-th scratch buffer of the context. */
+static matrix context_scratch(nn_context *ctx, int k, int rows, int cols) {
+    assert(rows * cols <= ctx->scratch[k]->rows * ctx->scratch[k]->cols);
+
+    matrix m = { rows, cols, ctx->scratch[k]->data };
+    return m;
 }
 
 void nn_destroy(neuralnetwork *nn) {
-    layers_destroy(nn->head);
+    nn_context_destroy(nn->ctx);
+    for (int i = 0; i < nn->nlayers; i++)
+        prune_free(&nn->layers[i]);
+    free(nn->layers);
+    nn_freeparams(nn);
+    free(nn->grads);
+    optimizer_reset(&nn->optimizer);
     free(nn);
 }
 
-/* Computes the output of the given layer,
- * storing results in the layer struct. */
-static void layer_apply(layer *layer, matrix *invec) {
-    matrix_product(layer->weights, invec, layer->net);
-    matrix_add(layer->net, layer->biases);
+#ifdef NN_PROFILE
+/* Floating point operations of the product of the layer's weights with n samples,
+ * plus the bias terms of the gradient. */
+static double layer_flops(const layer *l, int n, int gradient) {
+    double m = layer_noutputs(l), k = layer_ninputs(l);
+    return 2 * m * k * n + (gradient ? m * (k + n) : m * n);
+}
 
-    matrix_apply(layer->net, activations[layer->activation], layer->out);
+/* Bytes of the weights read, or the gradients written, and of the inputs and outputs
+ * of the product with n samples, the transposes counted once. */
+static double layer_bytes(const layer *l, int n, int gradient) {
+    double m = layer_noutputs(l), k = layer_ninputs(l);
+    return sizeof(nn_real) * (m * (k + 1) * (gradient ? 2 : 1) + (m + k) * n * (gradient ? 2 : 1));
 }
 
-/* Forward propagates given input through the network. 
- * The output will be stored in the output buffer, if given. */
-double *nn_forwardpropagate(neuralnetwork *nn, double *input) {    
-    if (nn == NULL || nn->head == NULL) return NULL;
-    
-    /* Allocate a matrix on stack for the first layer.
-     * The out field of the layer is used as input for all the consecutive layers. */
-    matrix first = { nn->inputs, 1, input };
-    matrix *p = &first;
+/* Floating point operations and bytes of the optimizer's update of n parameters. */
+static double update_flops(const neuralnetwork *nn, size_t n) {
+    return (1 + 4.0 * optimizer_nstates(nn->optimizer.type)) * n;
+}
+
+static double update_bytes(const neuralnetwork *nn, size_t n) {
+    return (3.0 + 2 * optimizer_nstates(nn->optimizer.type)) * sizeof(nn_real) * n;
+}
+
+/* Of the first layer's product with the sparse input instead, which reads and writes
+ * only the weights of the nonzero inputs. */
+static double sparse_flops(const layer *l, const sparse_matrix *x) {
+    double m = layer_noutputs(l), nnz = x->start[x->rows];
+    return 2 * m * nnz + m * x->rows;
+}
+
+static double sparse_bytes(const layer *l, const sparse_matrix *x, int gradient) {
+    double m = layer_noutputs(l), nnz = x->start[x->rows];
+    return sizeof(nn_real) * (m * nnz * (gradient ? 2 : 1) + m * (1 + x->rows) + nnz) +
+           sizeof(int) * nnz;
+}
+#endif
+
+/* Computes the output of the given layer for every column of the input,
+ * storing results in the layer's state. Pruned layers sparse enough are
+ * evaluated by their nonzero weights only. */
+static void layer_apply(const layer *layer, layer_state *state, matrix *in) {
+    if (prune_sparse(layer)) {
+        matrix_csr_dense(&layer->csr, in, &layer->biases, layer->activation,
+                         state->net, state->out);
+    } else matrix_dense(&layer->weights, in, &layer->biases, layer->activation,
+                        state->net, state->out);
+}
+
+/* Propagates n samples stored as columns of the input matrix through the network.
+ * Returns the output of the last layer. */
+static matrix *context_forward(nn_context *ctx, matrix *input) {
+    /* The out field of the layer is used as input for all the consecutive layers. */
+    matrix *p = input;
     
-    int i = 0;
-    layer *current = nn->head;
-    while (current != NULL) {
-        layer_apply(current, p);
-        p = current->out;
-        
-        current = current->next;
+    for (int i = 0; i < ctx->nn->nlayers; i++) {
+        const layer *l = &ctx->nn->layers[i];
+        layer_state *state = &ctx->layers[i];
+        int sparse = i == 0 && ctx->sparse.rows;
+        PROFILE_START(t);
+        if (sparse)
+            matrix_dense_sparse(&l->weights, &ctx->sparse, &l->biases, l->activation,
+                                state->net, state->out);
+        else
+            layer_apply(l, state, p);
+        PROFILE_STOP(t, i, NN_PROFILE_FORWARD,
+                     sparse ? sparse_flops(l, &ctx->sparse) : layer_flops(l, p->cols, 0),
+                     sparse ? sparse_bytes(l, &ctx->sparse, 0) : layer_bytes(l, p->cols, 0));
+        p = state->out;
     }
 
-    return p->data;
+    return p;
+}
+
+/* Compresses n samples, given as rows, into the context's sparse input if at least
+ * the network's sparsity of the inputs are zeros. Returns 0, giving up as soon as
+ * there are more nonzero elements, if the input is denser than that. */
+static int context_compress(nn_context *ctx, const nn_real *input, int n) {
+    int inputs = ctx->nn->inputs;
+    if (ctx->nn->sparsity > 1 || inputs == 0)
+        return 0;
+
+    /* Counted first by a loop the compiler vectorizes, which makes dense inputs cheap to reject. */
+    int limit = (int)((1 - ctx->nn->sparsity) * n * inputs), nnz = 0;
+    for (int j = 0; j < n; j++) {
+        const nn_real *row = input + (size_t)j * inputs;
+        for (int k = 0; k < inputs; k++)
+            nnz += row[k] != 0;
+        if (nnz > limit)
+            return 0;
+    }
+
+    sparse_matrix *s = &ctx->compressed;
+    if (ctx->capacity < nnz) {
+        ctx->capacity = nnz;
+        s->index = realloc(s->index, nnz * sizeof(int));
+        s->value = realloc(s->value, nnz * sizeof(nn_real));
+        if (s->index == NULL || s->value == NULL) {
+            perror(__func__);
+            assert(s->index != NULL && s->value != NULL);
+        }
+    }
+
+    nnz = 0;
+    for (int j = 0; j < n; j++) {
+        const nn_real *row = input + (size_t)j * inputs;
+        s->start[j] = nnz;
+        for (int k = 0; k < inputs; k++) {
+            if (row[k] != 0) {
+                s->index[nnz] = k;
+                s->value[nnz++] = row[k];
+            }
+        }
+    }
+    s->start[n] = nnz;
+    s->rows = n;
+    s->cols = inputs;
+
+    ctx->sparse = *s;
+    return 1;
+}
+
+/* Stores n samples, given as rows, in the columns of the context's input matrix.
+ * Single sample is a column already and is used in place, the input being only read
+ * through the returned matrix. Sparse inputs are
+ * compressed instead and the returned matrix, holding no data, only gives the size.
+ * NULL input stands for the sparse input already given to the context. */
+static matrix context_loadinput(nn_context *ctx, const nn_real *input, int n) {
+    if (input == NULL || context_compress(ctx, input, n)) {
+        matrix empty = { ctx->nn->inputs, n, NULL };
+        return empty;
+    }
+    ctx->sparse.rows = 0;
+
+    if (n == 1) {
+        matrix column = { ctx->nn->inputs, 1, (nn_real *)input };
+        return column;
+    }
+
+    matrix rows = { n, ctx->nn->inputs, (nn_real *)input };
+    matrix_transpose(&rows, ctx->input);
+    return *ctx->input;
+}
+
+/* Forward propagates given input through the network. 
+ * The output will be stored in the output buffer, if given. */
+nn_real *nn_forwardpropagate(neuralnetwork *nn, const nn_real *input) {    
+    return nn_forwardpropagate_batch(nn, input, 1);
 };
 
+nn_real *nn_forwardpropagate_batch(neuralnetwork *nn, const nn_real *input, int n) {
+    if (nn == NULL || nn->nlayers == 0) return NULL;
+
+    return nn_context_forwardpropagate_batch(nn_context_default(nn), input, n);
+}
+
+nn_real *nn_context_forwardpropagate(nn_context *ctx, const nn_real *input) {
+    return nn_context_forwardpropagate_batch(ctx, input, 1);
+}
+
+/* Forward propagates n samples, or the context's sparse input if input is NULL. */
+static nn_real *context_forwardpropagate(nn_context *ctx, const nn_real *input, int n) {
+    context_setbatch(ctx, n, 0);
+
+    matrix in = context_loadinput(ctx, input, n);
+    matrix *out = context_forward(ctx, &in);
+
+    /* Output of a single sample can be returned as is. */
+    if (n == 1) return out->data;
+
+    matrix_transpose(out, ctx->output);
+    return ctx->output->data;
+}
+
+nn_real *nn_context_forwardpropagate_batch(nn_context *ctx, const nn_real *input, int n) {
+    if (ctx == NULL || ctx->nn->nlayers == 0 || n < 1) return NULL;
+
+    return context_forwardpropagate(ctx, input, n);
+}
+
+int nn_setsparsity(neuralnetwork *nn, double threshold) {
+    if (!(threshold >= 0)) {
+        fprintf(stderr, "%s: invalid threshold\n", __func__);
+        return 0;
+    }
+
+    nn->sparsity = threshold;
+    return 1;
+}
+
+/* Makes the n samples, given as compressed rows, the input of the context's next pass.
+ * Returns 0 if they are not valid input of the network. */
+static int context_setsparse(nn_context *ctx, const int *start, const int *index,
+                             const nn_real *value, int n, const char *caller) {
+    int inputs = ctx->nn->inputs;
+    int valid = start[0] == 0;
+    for (int j = 0; j < n && valid; j++) {
+        valid = start[j+1] >= start[j];
+        for (int p = start[j]; p < start[j+1] && valid; p++)
+            valid = index[p] >= 0 && index[p] < inputs;
+    }
+    if (!valid) {
+        fprintf(stderr, "%s: invalid sparse input\n", caller);
+        return 0;
+    }
+
+    ctx->sparse = (sparse_matrix) { n, inputs, (int *)start, (int *)index, (nn_real *)value };
+    return 1;
+}
+
+nn_real *nn_forwardpropagate_sparse(neuralnetwork *nn, const int *start, const int *index,
+                                    const nn_real *value, int n) {
+    if (nn == NULL || nn->nlayers == 0) return NULL;
+
+    return nn_context_forwardpropagate_sparse(nn_context_default(nn), start, index, value, n);
+}
+
+nn_real *nn_context_forwardpropagate_sparse(nn_context *ctx, const int *start, const int *index,
+                                            const nn_real *value, int n) {
+    if (ctx == NULL || ctx->nn->nlayers == 0 || n < 1 ||
+        !context_setsparse(ctx, start, index, value, n, __func__))
+        return NULL;
+
+    return context_forwardpropagate(ctx, NULL, n);
+}
+
 /* Return squared error for the given output and target. */
 static double squarederror(double out, double target) {
     return (target - out) * (target - out) / 2;
 }
 
-/* Compute dE/dnet of the previous layer for the backpropagation. */
-static void nextdelta(matrix **delta, layer *layer) {
-    matrix *nextdelta = create_matrix(1, layer_noutputs(layer->prev), NULL);
+/* Outputs are clamped away from 0, where the logarithm diverges. */
+#define CROSSENTROPY_MIN 1e-30
 
-    /* Transpose delta */
-    (*delta)->cols = (*delta)->rows;
-    (*delta)->rows = 1;
+static double crossentropy(double out, double target) {
+    return target != 0 ? -target * log(out > CROSSENTROPY_MIN ? out : CROSSENTROPY_MIN) : 0;
+}
 
-    matrix_product(*delta, layer->weights, nextdelta);
-        
-    /* Transpose newdelta */
-    nextdelta->rows = nextdelta->cols;
-    nextdelta->cols = 1;
+/* Compute dE/dnet of the previous layer for the backpropagation.
+ * Delta of the i-th layer holds its dE/dnet for every sample as a column. */
+static void nextdelta(nn_context *ctx, int i) {
+    const layer *layer = &ctx->nn->layers[i];
+    layer_state *state = &ctx->layers[i];
+    layer_state *prev = &ctx->layers[i-1];
+    int n = state->delta->cols;
+    int activation = ctx->nn->layers[i-1].activation;
+
+    /* A single sample is a column of delta, which a dedicated kernel multiplies by W^T,
+     * multiplied by dout/dnet of the previous layer on the way. */
+    if (n == 1) {
+        matrix_dense_backward(&layer->weights, state->delta->data, activation,
+                              prev->net->data, prev->out->data, prev->delta->data);
+        return;
+    }
 
-    matrix *doutdnet = create_matrix(layer_noutputs(layer->prev), 1, NULL);
-    matrix_apply(layer->prev->net, activations_primes[layer->prev->activation], doutdnet);
+    /* dE/dout of the previous layer is W^T * delta, computed as (delta^T * W)^T */
+    matrix deltat = context_scratch(ctx, 0, n, layer_noutputs(layer));
+    matrix_transpose(state->delta, &deltat);
 
-    matrix_multiply_elementwise(nextdelta, doutdnet);
+    matrix product = context_scratch(ctx, 1, n, layer_ninputs(layer));
+    matrix_product(&deltat, &layer->weights, &product);
 
-    matrix_destroy(doutdnet);
-    matrix_destroy(*delta);
+    matrix_transpose(&product, prev->delta);
 
-    *delta = nextdelta;
+    /* Multiply by dout/dnet of the previous layer. */
+    activation_backward(activation, prev->net->data, prev->out->data,
+                        prev->delta->data, prev->delta->rows, n);
 }
 
-static void update_weights(const neuralnetwork *nn) {
-    layer *p = nn->head;
-    while (p != NULL) {
-        matrix_add(p->weights, p->weights_delta);        
-        p = p->next;
+/* Applies the gradients with the network's optimizer, in a single pass over
+ * the parameters and the optimizer's state, a layer at a time. */
+static void update_parameters(neuralnetwork *nn, const optimizer_step *s) {
+    for (int i = 0; i < nn->nlayers; i++) {
+        size_t start = nn->layers[i].weights.data - nn->params;
+        size_t end = i + 1 < nn->nlayers ? (size_t)(nn->layers[i+1].weights.data - nn->params)
+                                         : nn->nparams;
+
+        PROFILE_START(t);
+        optimizer_update(nn, s, nn->grads, start, end);
+        prune_sync(&nn->layers[i]);
+        PROFILE_STOP(t, i, NN_PROFILE_UPDATE, update_flops(nn, end - start),
+                     update_bytes(nn, end - start));
     }
 }
 
-static void update_biases(const neuralnetwork *nn) {
-    layer *p = nn->head;
-    while (p != NULL) {
-        matrix_add(p->biases, p->biases_delta);        
-        p = p->next;
-    }    
+/* Returns the gradients of the layer's weights and biases stored in the arena,
+ * which is laid out the same way as the parameters. */
+static void layer_gradients(const neuralnetwork *nn, const layer *layer, nn_real *grads,
+                            matrix *weights, matrix *biases) {
+    *weights = layer->weights;
+    weights->data = grads + (layer->weights.data - nn->params);
+
+    *biases = layer->biases;
+    biases->data = grads + (layer->biases.data - nn->params);
 }
 
-double nn_backpropagate(neuralnetwork *nn, double *input, double *target, double learningrate) {    
-    layer *last = nn_outputlayer(nn);
+/* Forward propagates n samples and returns the sum of their errors.
+ * If gradient is set, dE/dnet of the output layer is stored in its delta. */
+static double context_loss(nn_context *ctx, const nn_real *input, const nn_real *target, int n,
+                           int gradient) {
+    const neuralnetwork *nn = ctx->nn;
+    const layer *last = &nn->layers[nn->nlayers-1];
     int outn = nn->outputs; /* quantity of network's outputs */
-    
-    double *output = nn_forwardpropagate(nn, input); /* forward propagate to get output */
 
-    double etotal = 0, dEdout[outn];
+    context_setbatch(ctx, n, gradient);
+
+    /* Forward propagate to get output, a column for each sample. */
+    matrix in = context_loadinput(ctx, input, n);
+    matrix *output = context_forward(ctx, &in);
+
+    /* Softmax outputs are probabilities, trained with cross-entropy loss. */
+    int softmax = last->activation == SOFTMAX;
+
+    PROFILE_START(tloss);
+    double etotal = 0;
     for (int i = 0; i < outn; i++) {
-        /* Calculate total squared error of the forward pass. */
-        etotal += squarederror(output[i], target[i]);
-        /* dE/dout = (d/dout)*[1/2*(target-out)^2] = out - target */
-        dEdout[i] = output[i] - target[i];
+        for (int j = 0; j < n; j++) {
+            /* Targets are stored as rows. */
+            double out = *matrix_at(output, i, j), t = target[j*outn + i];
+
+            /* Calculate total error of the forward pass. */
+            etotal += softmax ? crossentropy(out, t) : squarederror(out, t);
+        }
     }
 
-    /* What is the point of backpropagation with 0 learning rate? */
-    if (learningrate == 0) return etotal;
+    if (!gradient) {
+        PROFILE_STOP(tloss, NN_PROFILE_NETWORK, NN_PROFILE_LOSS, 3.0 * outn * n,
+                     2.0 * sizeof(nn_real) * outn * n);
+        return etotal;
+    }
+
+    layer_state *laststate = &ctx->layers[nn->nlayers-1];
+    for (int i = 0; i < outn; i++) {
+        for (int j = 0; j < n; j++) {
+            /* dE/dout = (d/dout)*[1/2*(target-out)^2] = out - target */
+            *matrix_at(laststate->delta, i, j) = *matrix_at(output, i, j) - target[j*outn + i];
+        }
+    }
 
-    /* Allocate a new matrix containing the dE/dout for each output. */
-    matrix *delta = create_matrix(outn, 1, dEdout);
+    /* dE/dout * dout/dnet = dE/dnet in delta, where dout/dnet = f'(net).
+     * For softmax with cross-entropy the Jacobian cancels out: dE/dnet = out - target
+     * for targets summing to 1, which is already in delta. */
+    if (!softmax)
+        activation_backward(last->activation, laststate->net->data, laststate->out->data,
+                            laststate->delta->data, outn, n);
+    PROFILE_STOP(tloss, NN_PROFILE_NETWORK, NN_PROFILE_LOSS, 5.0 * outn * n,
+                 5.0 * sizeof(nn_real) * outn * n);
 
-    /* dout/dnet = f'(net) */
-    matrix *doutdnet = create_matrix(outn, 1, NULL);
-    matrix_apply(last->net, activations_primes[last->activation], doutdnet);
+    return etotal;
+}
 
-    /* dE/dout * dout/dnet = dE/dnet in delta */
-    matrix_multiply_elementwise(delta, doutdnet);
-    
-    matrix_destroy(doutdnet);
+/* Forward propagates n samples and returns the sum of their errors.
+ * Unless grads is NULL, the gradients of the error multiplied by scale are
+ * stored in it, grads being an arena laid out the same way as the parameters.
+ * The network is only read, so that contexts may compute gradients concurrently.
+ * Apart from growing the context's buffers on the first call with a larger batch,
+ * no memory is allocated. */
+double context_train(nn_context *ctx, const nn_real *input, const nn_real *target, int n,
+                     nn_real scale, nn_real *grads) {
+    const neuralnetwork *nn = ctx->nn;
+    double etotal = context_loss(ctx, input, target, n, grads != NULL);
+    if (grads == NULL)
+        return etotal;
+
+    for (int i = nn->nlayers - 1; i >= 0; i--) {
+        const layer *current = &nn->layers[i];
+        matrix *delta = ctx->layers[i].delta;
+        PROFILE_START(tgrad);
+
+        matrix weights_delta, biases_delta;
+        layer_gradients(nn, current, grads, &weights_delta, &biases_delta);
 
-    layer *current = last;
-    while (current->prev != NULL) {
         /* dnet/dWij = output of the prev. layer,
          * as all the terms except outj*Wij in the net summation are treated as constants and
-         * therefore vanish after taking derivative. */
-        
-        /* Hacky transpose of prev. layer's out matrix for multiplication purposes. */
-        matrix dnetdw = { 1, current->prev->out->rows, current->prev->out->data };
+         * therefore vanish after taking derivative.
+         * Outputs of the prev. layer are needed as rows for the multiplication,
+         * which is how the input of the network is already stored. */
+        int sparse = i == 0 && ctx->sparse.rows;
+        matrix dnetdw = { n, nn->inputs, (nn_real *)input };
+        if (i > 0) {
+            dnetdw = context_scratch(ctx, 0, n, layer_ninputs(current));
+            matrix_transpose(ctx->layers[i-1].out, &dnetdw);
+        }
 
-        /* Yield the weights' gradients by multiplying dE/dnet by dnet/dWij */
-        matrix_product(delta, &dnetdw, current->weights_delta);
-        matrix_scalarproduct(current->weights_delta, -learningrate); /* apply the learning rate */
+        /* Yield the weights' gradients by multiplying dE/dnet by dnet/dWij,
+         * which sums them over the batch. The gradients of the weights of
+         * the inputs which are 0 are 0 themselves, and only the rest are computed. */
+        if (sparse) {
+            memset(weights_delta.data, 0, (size_t)weights_delta.rows * weights_delta.cols *
+                                          sizeof(nn_real));
+            matrix_sparse_update(&weights_delta, scale, delta, &ctx->sparse);
+        } else {
+            matrix_product(delta, &dnetdw, &weights_delta);
+            matrix_scalarproduct(&weights_delta, scale); /* see optimizer_scale */
+        }
 
         /* Derivative of net with respect to the biases (dnet/dB) is always 1.
          * Therefore bias gradients are delta * 1:
          * dE/dB = dE/dnet * dnet/dB = dE/dnet = delta */
-        memcpy(current->biases_delta->data, delta->data, delta->rows * sizeof(double));
-        matrix_scalarproduct(current->biases_delta, -learningrate);
+        matrix_rowsum(delta, &biases_delta);
+        matrix_scalarproduct(&biases_delta, scale);
 
-        /* get dE/dnet of the previous layer for the next iteration. */
-        nextdelta(&delta, current);
+        PROFILE_STOP(tgrad, i, NN_PROFILE_GRADIENT,
+                     sparse ? sparse_flops(current, &ctx->sparse) : layer_flops(current, n, 1),
+                     sparse ? sparse_bytes(current, &ctx->sparse, 1) : layer_bytes(current, n, 1));
 
-        current = current->prev;
+        /* get dE/dnet of the previous layer for the next iteration. */
+        if (i > 0) {
+            PROFILE_START(tback);
+            nextdelta(ctx, i);
+            PROFILE_STOP(tback, i, NN_PROFILE_BACKWARD, layer_flops(current, n, 0),
+                         layer_bytes(current, n, 0));
+        }
     }
 
-    /* Finally deal with the input layer. */
-    matrix dnetdw = { 1, nn->inputs, input };
+    return etotal;
+}
 
-    /* Yield the weights' gradients by multiplying dE/dnet by dnet/dWij */
-    matrix_product(delta, &dnetdw, nn->head->weights_delta);
-    matrix_scalarproduct(nn->head->weights_delta, -learningrate);
+/* Plain SGD step of a single sample, returns its error. The gradients, multiplied
+ * by scale, are added to the parameters in place without being stored: a layer's
+ * weights are updated by a rank-1 update, W += scale * delta * in^T, as soon as
+ * its delta has been propagated further back. The parameters of the network are
+ * written, which only Hogwild allows to happen concurrently. */
+double context_step(nn_context *ctx, const nn_real *input, const nn_real *target,
+                    nn_real scale) {
+    const neuralnetwork *nn = ctx->nn;
+    double etotal = context_loss(ctx, input, target, 1, 1);
+
+    for (int i = nn->nlayers - 1; i >= 0; i--) {
+        const layer *current = &nn->layers[i];
+        matrix *delta = ctx->layers[i].delta;
+
+        /* dE/dnet of the previous layer needs the weights before the update. */
+        if (i > 0) {
+            PROFILE_START(tback);
+            nextdelta(ctx, i);
+            PROFILE_STOP(tback, i, NN_PROFILE_BACKWARD, layer_flops(current, 1, 0),
+                         layer_bytes(current, 1, 0));
+        }
 
-    /* Store bias learning values. */
-    memcpy(current->biases_delta->data, delta->data, delta->rows * sizeof(double));
-    matrix_scalarproduct(current->biases_delta, -learningrate);
+        PROFILE_START(tupdate);
+        const nn_real *in = i > 0 ? ctx->layers[i-1].out->data : input;
+        int sparse = i == 0 && ctx->sparse.rows;
+        matrix weights = current->weights;
+        if (sparse)
+            matrix_sparse_update(&weights, scale, delta, &ctx->sparse);
+        else
+            matrix_rank1_update(&weights, scale, delta->data, in);
+
+        for (int r = 0; r < delta->rows; r++)
+            current->biases.data[r] += scale * delta->data[r];
+        prune_sync(current);
+        PROFILE_STOP(tupdate, i, NN_PROFILE_UPDATE,
+                     sparse ? sparse_flops(current, &ctx->sparse)
+                            : 2.0 * delta->rows * (layer_ninputs(current) + 1),
+                     sparse ? sparse_bytes(current, &ctx->sparse, 1) : layer_bytes(current, 1, 1));
+    }
 
-    update_weights(nn);
-    update_biases(nn);
-    
-    matrix_destroy(delta);
     return etotal;
 }
+
+double nn_backpropagate(neuralnetwork *nn, const nn_real *input, const nn_real *target,
+                        double learningrate) {    
+    return nn_train_batch(nn, input, target, 1, learningrate);
+}
+
+/* Gradients are averaged over the batch, so that the learning rate
+ * has the same meaning for any batch size. NULL input stands for the sparse
+ * input of the network's context. */
+static double network_train(neuralnetwork *nn, const nn_real *input, const nn_real *target, int n,
+                            double learningrate) {
+    nn_context *ctx = nn_context_default(nn);
+
+    /* What is the point of backpropagation with 0 learning rate? */
+    if (learningrate == 0)
+        return context_train(ctx, input, target, n, 0, NULL) / n;
+
+    /* A plain SGD step of a single sample is applied without storing the gradients. */
+    if (n == 1 && nn->optimizer.type == SGD) {
+        optimizer_begin(nn, 1);
+        return context_step(ctx, input, target, optimizer_scale(nn, learningrate, 1));
+    }
+
+    if (nn->grads == NULL)
+        nn->grads = arena_create(nn->nparams);
+
+    double etotal = context_train(ctx, input, target, n, optimizer_scale(nn, learningrate, n),
+                                  nn->grads);
+
+    optimizer_step s;
+    optimizer_coefficients(nn, learningrate, optimizer_begin(nn, 1), &s);
+    update_parameters(nn, &s);
+
+    return etotal / n;
+}
+
+double nn_train_batch(neuralnetwork *nn, const nn_real *input, const nn_real *target, int n,
+                      double learningrate) {
+    return network_train(nn, input, target, n, learningrate);
+}
+
+double nn_train_sparse(neuralnetwork *nn, const int *start, const int *index, const nn_real *value,
+                       const nn_real *target, int n, double learningrate) {
+    if (n < 1 || !context_setsparse(nn_context_default(nn), start, index, value, n, __func__))
+        return NAN;
+
+    return network_train(nn, NULL, target, n, learningrate);
+}
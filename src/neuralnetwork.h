@@ -15,43 +15,128 @@
 #ifndef NN_NEURALNETWORK_H
 #define NN_NEURALNETWORK_H
 
+#include <stddef.h>
+
 #include "matrix.h"
 #include "activations.h"
+#include "optimizer.h"
+#include "random.h"
 
-typedef struct layer {
-    matrix *weights; /* MxN matrix, where:
-                        * M - number of outputs,
-                        * N - number of inputs. */
-    matrix *weights_delta; /* weight gradients multiplied by the learning rate */
+/* Alignment of the parameter matrices in bytes, matches the cache line. */
+#define NN_ALIGN 64
+
+/* Default fraction of zero inputs, above which the first layer multiplies
+ * only the nonzero ones, see nn_setsparsity. */
+#define NN_SPARSITY 0.95
 
-    matrix *biases; /* biases */
-    matrix *biases_delta; /* bias gradients multiplied by the learning rate */
+typedef struct layer {
+    matrix weights; /* MxN matrix, where:
+                       * M - number of outputs,
+                       * N - number of inputs. */
+    matrix biases; /* biases */
     
     int activation; /* activation function index */
 
+    /* Nonzero weights of a pruned layer as compressed rows, also marking the zero ones
+     * to stay zero through the training. start is NULL if the layer is not pruned. */
+    sparse_matrix csr;
+} layer;
+
+/* Per layer part of the execution context. */
+typedef struct layer_state {
+    matrix *out; /* activation function of the weighted sum of inputs,
+                    a column for each sample of the batch */
+
+    /* Allocated only for training, inference never stores the pre-activations. */
     matrix *net; /* weighted sum of inputs */
-    matrix *out; /* net with applied activation function */
+    matrix *delta; /* dE/dnet */
+} layer_state;
 
-    struct layer *prev; /* pointer to the previous layer of the network */
-    struct layer *next; /* pointer to the next layer of the network */
-} layer;
+/* Everything written during the forward pass.
+ * The network itself is only read, so any number of contexts may use it concurrently. */
+typedef struct nn_context {
+    const struct neuralnetwork *nn;
+
+    int batch; /* number of samples the buffers are allocated for */
+
+    matrix *input; /* inputs x batch, samples of the batch as columns */
+    matrix *output; /* batch x outputs, network output with a row for each sample */
+
+    layer_state *layers; /* state of every layer, in the same order */
+
+    int training; /* whether the buffers for backpropagation are allocated */
+    matrix *scratch[2]; /* batch x widest layer, temporaries of the backpropagation */
+
+    /* Nonzero inputs of the batch as compressed rows, multiplied by the first layer
+     * instead of the dense input if rows is not 0. */
+    sparse_matrix sparse;
+    sparse_matrix compressed; /* buffers of the inputs the context found to be sparse */
+    int capacity; /* number of elements compressed can hold */
+} nn_context;
 
 typedef struct neuralnetwork {
     int inputs;
     int outputs;
-    layer *head;
+
+    int nlayers;
+    layer *layers; /* array of the layers, the first one taking the network's input */
+
+    /* Weights and biases of all layers, stored one after another.
+     * Every matrix starts at a NN_ALIGN byte boundary, the padding is kept at zero. */
+    nn_real *params;
+    nn_real *grads; /* gradients multiplied by the learning rate, laid out the same way as params,
+                       allocated on the first training step which needs them */
+    size_t nparams; /* length of both arrays, including padding */
+
+    nn_optimizer optimizer; /* applies the gradients, its state is laid out like params */
+    nn_rng rng; /* initializes the weights of the new layers */
+    double sparsity; /* least fraction of zero inputs to take the sparse path */
+
+    /* File mapping holding params if the network has been read by nn_readfile,
+     * NULL if they are allocated. */
+    void *mapping;
+    size_t mapsize;
+
+    nn_context *ctx; /* context of the functions not taking one, created on demand */
 } neuralnetwork;
 
 neuralnetwork *nn_create(int inputs);
-void nn_addlayer(neuralnetwork *head, int outputs, double *weights, double *biases,
+void nn_addlayer(neuralnetwork *head, int outputs, nn_real *weights, nn_real *biases,
                  int activation);
 
-int nn_ninputs(neuralnetwork *nn);
-int nn_noutputs(neuralnetwork *nn);
+int nn_ninputs(const neuralnetwork *nn);
+int nn_noutputs(const neuralnetwork *nn);
 
-double *nn_forwardpropagate(neuralnetwork *nn, double *input);
-double nn_backpropagate(neuralnetwork *nn, double *input, double *target, double learningrate);
+nn_real *nn_forwardpropagate(neuralnetwork *nn, const nn_real *input);
+double nn_backpropagate(neuralnetwork *nn, const nn_real *input, const nn_real *target,
+                        double learningrate);
+
+nn_real *nn_forwardpropagate_batch(neuralnetwork *nn, const nn_real *input, int n);
+double nn_train_batch(neuralnetwork *nn, const nn_real *input, const nn_real *target, int n,
+                      double learningrate);
 
 void nn_destroy(neuralnetwork *nn);
 
+nn_context *nn_context_create(const neuralnetwork *nn);
+void nn_context_destroy(nn_context *ctx);
+
+nn_real *nn_context_forwardpropagate(nn_context *ctx, const nn_real *input);
+nn_real *nn_context_forwardpropagate_batch(nn_context *ctx, const nn_real *input, int n);
+
+int nn_setsparsity(neuralnetwork *nn, double threshold);
+nn_real *nn_forwardpropagate_sparse(neuralnetwork *nn, const int *start, const int *index,
+                                    const nn_real *value, int n);
+nn_real *nn_context_forwardpropagate_sparse(nn_context *ctx, const int *start, const int *index,
+                                            const nn_real *value, int n);
+double nn_train_sparse(neuralnetwork *nn, const int *start, const int *index, const nn_real *value,
+                       const nn_real *target, int n, double learningrate);
+
+size_t arena_padded(size_t n);
+nn_real *arena_create(size_t n);
+void nn_mapparams(neuralnetwork *nn, nn_real *params, void *mapping, size_t mapsize);
+double context_train(nn_context *ctx, const nn_real *input, const nn_real *target, int n,
+                     nn_real scale, nn_real *grads);
+double context_step(nn_context *ctx, const nn_real *input, const nn_real *target,
+                    nn_real scale);
+
 #endif
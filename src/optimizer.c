@@ -0,0 +1,180 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "optimizer.h"
+#include "neuralnetwork.h"
+#include "simd.h"
+
+#if SIMD_X86
+#include <immintrin.h>
+#endif
+
+/* Every kernel updates the parameters p with the gradients g scaled by optimizer_scale,
+ * i.e. pointing downhill, together with the state m and v, in a single pass. */
+
+/* p += g, the learning rate is already applied. */
+static void sgd_update(nn_real *p, const nn_real *g, nn_real *m, nn_real *v,
+                       size_t n, const optimizer_step *s) {
+    for (size_t i = 0; i < n; i++) p[i] += g[i];
+}
+
+/* m = beta*m + g, p += lr*m */
+static void momentum_update(nn_real *p, const nn_real *g, nn_real *m, nn_real *v,
+                            size_t n, const optimizer_step *s) {
+    for (size_t i = 0; i < n; i++) {
+        m[i] = s->beta1 * m[i] + g[i];
+        p[i] += s->lr * m[i];
+    }
+}
+
+/* m = beta*m + g, p += lr*(beta*m + g), looking ahead along the new velocity. */
+static void nesterov_update(nn_real *p, const nn_real *g, nn_real *m, nn_real *v,
+                            size_t n, const optimizer_step *s) {
+    for (size_t i = 0; i < n; i++) {
+        m[i] = s->beta1 * m[i] + g[i];
+        p[i] += s->lr * (s->beta1 * m[i] + g[i]);
+    }
+}
+
+/* m = beta1*m + (1-beta1)*g, v = beta2*v + (1-beta2)*g^2,
+ * p += lr * m/(1-beta1^t) / (sqrt(v/(1-beta2^t)) + epsilon) */
+static void adam_update(nn_real *p, const nn_real *g, nn_real *m, nn_real *v,
+                        size_t n, const optimizer_step *s) {
+    for (size_t i = 0; i < n; i++) {
+        m[i] = s->beta1 * m[i] + (1 - s->beta1) * g[i];
+        v[i] = s->beta2 * v[i] + (1 - s->beta2) * g[i] * g[i];
+        p[i] += s->a * m[i] / (sqrt(v[i]) + s->epsilon);
+    }
+}
+
+#if SIMD_X86
+#define SIMD_TARGET SIMD_SSE2
+#include "simd_ops.h"
+#include "optimizer_kernels.h"
+#undef SIMD_TARGET
+
+#define SIMD_TARGET SIMD_AVX2
+#include "simd_ops.h"
+#include "optimizer_kernels.h"
+#undef SIMD_TARGET
+
+#define SIMD_TARGET SIMD_AVX512
+#include "simd_ops.h"
+#include "optimizer_kernels.h"
+#undef SIMD_TARGET
+#endif
+
+typedef void (*update_kernel)(nn_real *p, const nn_real *g, nn_real *m, nn_real *v,
+                              size_t n, const optimizer_step *s);
+
+/* Kernels indexed by the instruction set and the optimizer. */
+static const update_kernel update_kernels[SIMD_ISA_N][OPTIMIZERS_N] = {
+    { sgd_update, momentum_update, nesterov_update, adam_update },
+#if SIMD_X86
+    { sgd_update_sse2, momentum_update_sse2, nesterov_update_sse2, adam_update_sse2 },
+    { sgd_update_avx2, momentum_update_avx2, nesterov_update_avx2, adam_update_avx2 },
+    { sgd_update_avx512, momentum_update_avx512, nesterov_update_avx512, adam_update_avx512 },
+#endif
+};
+
+/* Number of state arenas of the optimizer. */
+int optimizer_nstates(int type) {
+    switch (type) {
+    case MOMENTUM:
+    case NESTEROV:
+        return 1;
+    case ADAM:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+/* Frees the state, the next step starts from scratch. */
+void optimizer_reset(nn_optimizer *opt) {
+    for (int k = 0; k < 2; k++) {
+        free(opt->state[k]);
+        opt->state[k] = NULL;
+    }
+    opt->steps = 0;
+}
+
+int nn_setoptimizer(neuralnetwork *nn, int optimizer, double beta1, double beta2) {
+    if (optimizer < 0 || optimizer >= OPTIMIZERS_N || beta1 < 0 || beta1 >= 1 ||
+        beta2 < 0 || beta2 >= 1) {
+        fprintf(stderr, "%s: invalid optimizer or coefficients\n", __func__);
+        return 0;
+    }
+
+    nn_optimizer *opt = &nn->optimizer;
+    optimizer_reset(opt);
+    opt->type = optimizer;
+    opt->beta1 = beta1 != 0 ? beta1 : OPTIMIZER_BETA1;
+    opt->beta2 = beta2 != 0 ? beta2 : OPTIMIZER_BETA2;
+    return 1;
+}
+
+/* Returns the scale of the gradients summed over n samples, which the kernels expect.
+ * SGD applies the learning rate along with it and needs no further multiplication.
+ * 0 is returned for the learning rate of 0, no step is to be taken then. */
+nn_real optimizer_scale(const neuralnetwork *nn, double learningrate, int n) {
+    if (learningrate == 0)
+        return 0;
+
+    return nn->optimizer.type == SGD ? -learningrate / n : -1.0 / n;
+}
+
+/* Allocates the state on the first call and accounts for nsteps steps,
+ * returning the number of the first one, counting from 1. */
+long optimizer_begin(neuralnetwork *nn, int nsteps) {
+    nn_optimizer *opt = &nn->optimizer;
+    for (int k = 0; k < optimizer_nstates(opt->type); k++) {
+        if (opt->state[k] == NULL)
+            opt->state[k] = arena_create(nn->nparams);
+    }
+
+    long first = opt->steps + 1;
+    opt->steps += nsteps;
+    return first;
+}
+
+void optimizer_coefficients(const neuralnetwork *nn, double learningrate, long step,
+                            optimizer_step *s) {
+    const nn_optimizer *opt = &nn->optimizer;
+    s->lr = opt->type == SGD ? 1 : learningrate;
+    s->beta1 = opt->beta1;
+    s->beta2 = opt->beta2;
+
+    /* Bias corrections are folded into the step size and epsilon:
+     * lr*c1 * m / (sqrt(c2*v) + eps) = (lr*c1/sqrt(c2)) * m / (sqrt(v) + eps/sqrt(c2)) */
+    double c1 = 1 / (1 - pow(opt->beta1, step));
+    double c2 = 1 / (1 - pow(opt->beta2, step));
+    s->a = learningrate * c1 / sqrt(c2);
+    s->epsilon = ADAM_EPSILON / sqrt(c2);
+}
+
+/* Updates the parameters [lo, hi) along with the optimizer's state, using the gradients
+ * of an arena laid out like the parameters. Disjoint ranges may be updated concurrently. */
+void optimizer_update(const neuralnetwork *nn, const optimizer_step *s,
+                      const nn_real *grads, size_t lo, size_t hi) {
+    const nn_optimizer *opt = &nn->optimizer;
+    nn_real *m = opt->state[0] ? opt->state[0] + lo : NULL;
+    nn_real *v = opt->state[1] ? opt->state[1] + lo : NULL;
+
+    update_kernels[simd_isa()][opt->type](nn->params + lo, grads + lo, m, v, hi - lo, s);
+}
@@ -0,0 +1,63 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+#ifndef NN_OPTIMIZER_H
+#define NN_OPTIMIZER_H
+
+#include <stddef.h>
+
+#include "matrix.h"
+
+enum optimizers {
+    SGD = 0, MOMENTUM, NESTEROV, ADAM,
+    OPTIMIZERS_N /* used as the array size for declaration */
+};
+
+/* Defaults of the coefficients. */
+#define OPTIMIZER_BETA1 0.9
+#define OPTIMIZER_BETA2 0.999
+#define ADAM_EPSILON 1e-8
+
+/* Optimizer of the network's training steps and its state. */
+typedef struct nn_optimizer {
+    int type;
+    double beta1; /* momentum, or decay of the first moment of Adam */
+    double beta2; /* decay of the second moment of Adam */
+
+    long steps; /* taken so far, for the bias correction of Adam */
+    nn_real *state[2]; /* velocity, or the first and second moments of Adam,
+                          laid out like the parameters, allocated on the first step */
+} nn_optimizer;
+
+/* Coefficients of a single step, computed once for all the parameters. */
+typedef struct optimizer_step {
+    nn_real lr; /* learning rate, 1 for SGD as it is already applied to the gradients */
+    nn_real beta1, beta2;
+    nn_real a, epsilon; /* Adam step is a * m / (sqrt(v) + epsilon), bias corrections included */
+} optimizer_step;
+
+struct neuralnetwork;
+
+int nn_setoptimizer(struct neuralnetwork *nn, int optimizer, double beta1, double beta2);
+
+void optimizer_reset(nn_optimizer *opt);
+nn_real optimizer_scale(const struct neuralnetwork *nn, double learningrate, int n);
+long optimizer_begin(struct neuralnetwork *nn, int nsteps);
+void optimizer_coefficients(const struct neuralnetwork *nn, double learningrate, long step,
+                            optimizer_step *s);
+void optimizer_update(const struct neuralnetwork *nn, const optimizer_step *s,
+                      const nn_real *grads, size_t lo, size_t hi);
+int optimizer_nstates(int type);
+
+#endif
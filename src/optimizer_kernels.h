@@ -0,0 +1,67 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+/* Update kernels, instantiated by optimizer.c once per instruction set.
+ * Has no include guard on purpose, see simd_ops.h. Arenas are padded to NN_ALIGN,
+ * so the scalar kernels only ever see the tail of an unaligned range. */
+
+static SIMD_ATTR void K(sgd_update)(nn_real *p, const nn_real *g, nn_real *m, nn_real *v,
+                                   size_t n, const optimizer_step *s) {
+    size_t i = 0;
+    for (; i + VW <= n; i += VW)
+        vstore(p + i, vadd(vload(p + i), vload(g + i)));
+    sgd_update(p + i, g + i, m, v, n - i, s);
+}
+
+static SIMD_ATTR void K(momentum_update)(nn_real *p, const nn_real *g, nn_real *m, nn_real *v,
+                                        size_t n, const optimizer_step *s) {
+    vreal lr = vset1(s->lr), beta = vset1(s->beta1);
+    size_t i = 0;
+    for (; i + VW <= n; i += VW) {
+        vreal mi = vfma(beta, vload(m + i), vload(g + i));
+        vstore(m + i, mi);
+        vstore(p + i, vfma(lr, mi, vload(p + i)));
+    }
+    momentum_update(p + i, g + i, m + i, v, n - i, s);
+}
+
+static SIMD_ATTR void K(nesterov_update)(nn_real *p, const nn_real *g, nn_real *m, nn_real *v,
+                                        size_t n, const optimizer_step *s) {
+    vreal lr = vset1(s->lr), beta = vset1(s->beta1);
+    size_t i = 0;
+    for (; i + VW <= n; i += VW) {
+        vreal gi = vload(g + i);
+        vreal mi = vfma(beta, vload(m + i), gi);
+        vstore(m + i, mi);
+        vstore(p + i, vfma(lr, vfma(beta, mi, gi), vload(p + i)));
+    }
+    nesterov_update(p + i, g + i, m + i, v, n - i, s);
+}
+
+static SIMD_ATTR void K(adam_update)(nn_real *p, const nn_real *g, nn_real *m, nn_real *v,
+                                    size_t n, const optimizer_step *s) {
+    vreal beta1 = vset1(s->beta1), beta2 = vset1(s->beta2);
+    vreal rest1 = vset1(1 - s->beta1), rest2 = vset1(1 - s->beta2);
+    vreal a = vset1(s->a), epsilon = vset1(s->epsilon);
+    size_t i = 0;
+    for (; i + VW <= n; i += VW) {
+        vreal gi = vload(g + i);
+        vreal mi = vfma(beta1, vload(m + i), vmul(rest1, gi));
+        vreal vi = vfma(beta2, vload(v + i), vmul(rest2, vmul(gi, gi)));
+        vstore(m + i, mi);
+        vstore(v + i, vi);
+        vstore(p + i, vfma(a, vdiv(mi, vadd(vsqrt(vi), epsilon)), vload(p + i)));
+    }
+    adam_update(p + i, g + i, m + i, v + i, n - i, s);
+}
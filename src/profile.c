@@ -0,0 +1,219 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "profile.h"
+
+#ifdef NN_PROFILE
+
+static const char *phase_names[NN_PROFILE_PHASES] = {
+    "forward", "loss", "backward", "gradient", "update"
+};
+
+/* Totals of every layer and phase, the network's row first.
+ * Updated with relaxed atomics, so that any number of threads may record. */
+static struct {
+    atomic_ullong calls, ns, flops, bytes;
+} totals[PROFILE_LAYERS + 1][NN_PROFILE_PHASES];
+
+static atomic_int nlayers; /* greatest recorded layer + 1 */
+
+/* Trace of the first PROFILE_EVENTS records. */
+static struct event {
+    uint64_t start, duration;
+    short layer, phase;
+    int thread;
+} events[PROFILE_EVENTS];
+
+static atomic_int nevents; /* may exceed PROFILE_EVENTS, counting the dropped ones */
+static atomic_ullong epoch; /* time of the reset, the trace starts at 0 */
+
+static atomic_int nthreads;
+static _Thread_local int thread_id = -1;
+
+uint64_t profile_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void profile_record(uint64_t start, int layer, int phase, double flops, double bytes) {
+    uint64_t end = profile_now();
+    if (layer >= PROFILE_LAYERS) return;
+
+    int row = layer + 1;
+    atomic_fetch_add_explicit(&totals[row][phase].calls, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&totals[row][phase].ns, end - start, memory_order_relaxed);
+    atomic_fetch_add_explicit(&totals[row][phase].flops, flops, memory_order_relaxed);
+    atomic_fetch_add_explicit(&totals[row][phase].bytes, bytes, memory_order_relaxed);
+
+    int n = atomic_load_explicit(&nlayers, memory_order_relaxed);
+    while (layer + 1 > n &&
+           !atomic_compare_exchange_weak_explicit(&nlayers, &n, layer + 1,
+                                                  memory_order_relaxed, memory_order_relaxed));
+
+    if (thread_id < 0)
+        thread_id = atomic_fetch_add_explicit(&nthreads, 1, memory_order_relaxed);
+
+    int k = atomic_fetch_add_explicit(&nevents, 1, memory_order_relaxed);
+    if (k < PROFILE_EVENTS)
+        events[k] = (struct event) { start, end - start, layer, phase, thread_id };
+}
+
+int nn_profile_enabled(void) {
+    return 1;
+}
+
+/* Not to be called concurrently with the profiled functions. */
+void nn_profile_reset(void) {
+    for (int i = 0; i <= PROFILE_LAYERS; i++) {
+        for (int p = 0; p < NN_PROFILE_PHASES; p++) {
+            atomic_store(&totals[i][p].calls, 0);
+            atomic_store(&totals[i][p].ns, 0);
+            atomic_store(&totals[i][p].flops, 0);
+            atomic_store(&totals[i][p].bytes, 0);
+        }
+    }
+
+    atomic_store(&nlayers, 0);
+    atomic_store(&nevents, 0);
+    atomic_store(&epoch, profile_now());
+}
+
+int nn_profile_nlayers(void) {
+    return atomic_load(&nlayers);
+}
+
+int nn_profile_get(int layer, int phase, nn_profile_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (layer < NN_PROFILE_NETWORK || layer >= PROFILE_LAYERS || phase < 0 || phase >= NN_PROFILE_PHASES)
+        return 0;
+
+    int row = layer + 1;
+    stats->calls = atomic_load(&totals[row][phase].calls);
+    stats->seconds = atomic_load(&totals[row][phase].ns) * 1e-9;
+    stats->flops = atomic_load(&totals[row][phase].flops);
+    stats->bytes = atomic_load(&totals[row][phase].bytes);
+    return 1;
+}
+
+void nn_profile_print(void) {
+    double total = 0;
+    for (int i = NN_PROFILE_NETWORK; i < nn_profile_nlayers(); i++) {
+        for (int p = 0; p < NN_PROFILE_PHASES; p++) {
+            nn_profile_stats s;
+            nn_profile_get(i, p, &s);
+            total += s.seconds;
+        }
+    }
+
+    printf("%-8s %-9s %10s %11s %7s %10s %9s %8s\n", "layer", "phase", "calls", "total ms",
+           "%", "avg us", "GFLOP/s", "GB/s");
+
+    for (int i = NN_PROFILE_NETWORK; i < nn_profile_nlayers(); i++) {
+        for (int p = 0; p < NN_PROFILE_PHASES; p++) {
+            nn_profile_stats s;
+            nn_profile_get(i, p, &s);
+            if (s.calls == 0) continue;
+
+            char name[16];
+            if (i == NN_PROFILE_NETWORK) {
+                snprintf(name, sizeof(name), "network");
+            } else snprintf(name, sizeof(name), "%d", i);
+
+            double seconds = s.seconds > 0 ? s.seconds : 1e-9;
+            printf("%-8s %-9s %10llu %11.3f %6.1f%% %10.2f %9.2f %8.2f\n", name, phase_names[p],
+                   s.calls, s.seconds * 1e3, total > 0 ? 100 * s.seconds / total : 0,
+                   s.seconds / s.calls * 1e6, s.flops / seconds * 1e-9, s.bytes / seconds * 1e-9);
+        }
+    }
+
+    int n = atomic_load(&nevents);
+    if (n > PROFILE_EVENTS)
+        printf("%d of %d events dropped from the trace\n", n - PROFILE_EVENTS, n);
+}
+
+/* Complete events of the Chrome trace format, viewable in chrome://tracing or Perfetto. */
+int nn_profile_write_trace(const char *filename) {
+    FILE *file = fopen(filename, "w");
+    if (!file) {
+        perror(__func__);
+        return 0;
+    }
+
+    int n = atomic_load(&nevents);
+    if (n > PROFILE_EVENTS) n = PROFILE_EVENTS;
+    uint64_t start = atomic_load(&epoch);
+    if (start == 0 && n > 0)
+        start = events[0].start; /* never reset */
+
+    fprintf(file, "{\"traceEvents\": [\n");
+    for (int k = 0; k < n; k++) {
+        const struct event *e = &events[k];
+        char name[32];
+        if (e->layer == NN_PROFILE_NETWORK) {
+            snprintf(name, sizeof(name), "network %s", phase_names[e->phase]);
+        } else snprintf(name, sizeof(name), "layer %d %s", e->layer, phase_names[e->phase]);
+
+        /* Events recorded before a reset are clamped to its time. */
+        double ts = (e->start > start ? e->start - start : 0) * 1e-3;
+        fprintf(file, "  {\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, "
+                "\"dur\": %.3f, \"pid\": 1, \"tid\": %d}%s\n", name, phase_names[e->phase],
+                ts, e->duration * 1e-3, e->thread, k + 1 < n ? "," : "");
+    }
+    fprintf(file, "], \"displayTimeUnit\": \"ns\"}\n");
+
+    int ok = fclose(file) == 0;
+    if (!ok)
+        perror(__func__);
+    return ok;
+}
+
+#else
+
+/* Profiling is not compiled in, there is nothing to report. */
+
+int nn_profile_enabled(void) {
+    return 0;
+}
+
+void nn_profile_reset(void) {
+}
+
+int nn_profile_nlayers(void) {
+    return 0;
+}
+
+int nn_profile_get(int layer, int phase, nn_profile_stats *stats) {
+    (void)layer;
+    (void)phase;
+    memset(stats, 0, sizeof(*stats));
+    return 0;
+}
+
+void nn_profile_print(void) {
+    printf("Profiling is disabled, configure with -DNN_PROFILE=ON\n");
+}
+
+int nn_profile_write_trace(const char *filename) {
+    (void)filename;
+    fprintf(stderr, "%s: Profiling is disabled\n", __func__);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,64 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+#ifndef NN_PROFILE_H
+#define NN_PROFILE_H
+
+#include <stdint.h>
+
+/* Phases of the hot paths, see nn_profile_phase in nn/nn.h. */
+enum {
+    NN_PROFILE_FORWARD = 0, NN_PROFILE_LOSS, NN_PROFILE_BACKWARD, NN_PROFILE_GRADIENT,
+    NN_PROFILE_UPDATE,
+    NN_PROFILE_PHASES /* used as the array size for declaration */
+};
+
+/* Pseudo layer of the work not belonging to any single layer. */
+#define NN_PROFILE_NETWORK -1
+
+/* Largest number of layers recorded separately, deeper ones are not recorded. */
+#define PROFILE_LAYERS 256
+
+/* Events kept for the trace, later ones are only counted. */
+#define PROFILE_EVENTS 65536
+
+typedef struct nn_profile_stats {
+    unsigned long long calls;
+    double seconds;
+    double flops;
+    double bytes;
+} nn_profile_stats;
+
+/* Instrumentation of the hot paths. Unless the library is built with NN_PROFILE,
+ * the macros expand to nothing and their arguments are never evaluated. */
+#ifdef NN_PROFILE
+#define PROFILE_START(name) uint64_t name = profile_now()
+#define PROFILE_STOP(name, layer, phase, flops, bytes) \
+    profile_record(name, layer, phase, flops, bytes)
+
+uint64_t profile_now(void);
+void profile_record(uint64_t start, int layer, int phase, double flops, double bytes);
+#else
+#define PROFILE_START(name) ((void)0)
+#define PROFILE_STOP(name, layer, phase, flops, bytes) ((void)0)
+#endif
+
+int nn_profile_enabled(void);
+void nn_profile_reset(void);
+int nn_profile_nlayers(void);
+int nn_profile_get(int layer, int phase, nn_profile_stats *stats);
+void nn_profile_print(void);
+int nn_profile_write_trace(const char *filename);
+
+#endif
@@ -0,0 +1,147 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "prune.h"
+
+static int compare_real(const void *a, const void *b) {
+    nn_real x = *(const nn_real *)a, y = *(const nn_real *)b;
+    return (x > y) - (x < y);
+}
+
+/* Zeroes the weights of magnitude below the threshold, and the smallest ones
+ * until at least the given fraction of the weights are zero. */
+static void prune_weights(layer *l, double sparsity, double threshold) {
+    size_t n = (size_t)l->weights.rows * l->weights.cols;
+    nn_real *w = l->weights.data;
+
+    nn_real *magnitudes = malloc(n * sizeof(nn_real));
+    if (n > 0 && magnitudes == NULL) {
+        perror(__func__);
+        assert(magnitudes != NULL);
+    }
+    for (size_t k = 0; k < n; k++)
+        magnitudes[k] = fabs(w[k]);
+    qsort(magnitudes, n, sizeof(nn_real), compare_real);
+
+    /* The weights equal to the k-th smallest magnitude are zeroed as long as needed. */
+    size_t k = (size_t)(sparsity * n);
+    nn_real cutoff = k < n ? magnitudes[k] : INFINITY;
+    if (cutoff < threshold)
+        cutoff = threshold;
+
+    size_t zeros = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (fabs(w[i]) < cutoff) {
+            w[i] = 0;
+            zeros++;
+        }
+    }
+    for (size_t i = 0; i < n && zeros < k; i++) {
+        if (w[i] != 0 && fabs(w[i]) == cutoff) {
+            w[i] = 0;
+            zeros++;
+        }
+    }
+
+    free(magnitudes);
+}
+
+void prune_build(layer *l) {
+    sparse_matrix *s = &l->csr;
+    const matrix *w = &l->weights;
+
+    size_t nnz = 0;
+    for (size_t k = 0; k < (size_t)w->rows * w->cols; k++)
+        nnz += w->data[k] != 0;
+
+    s->rows = w->rows;
+    s->cols = w->cols;
+    s->start = realloc(s->start, (w->rows + 1) * sizeof(int));
+    s->index = realloc(s->index, (nnz > 0 ? nnz : 1) * sizeof(int));
+    s->value = realloc(s->value, (nnz > 0 ? nnz : 1) * sizeof(nn_real));
+    if (s->start == NULL || s->index == NULL || s->value == NULL) {
+        perror(__func__);
+        assert(s->start != NULL && s->index != NULL && s->value != NULL);
+    }
+
+    int p = 0;
+    for (int i = 0; i < w->rows; i++) {
+        s->start[i] = p;
+        for (int j = 0; j < w->cols; j++) {
+            nn_real x = matrix_get(w, i, j);
+            if (x != 0) {
+                s->index[p] = j;
+                s->value[p++] = x;
+            }
+        }
+    }
+    s->start[w->rows] = p;
+}
+
+void prune_free(layer *l) {
+    free(l->csr.start);
+    free(l->csr.index);
+    free(l->csr.value);
+    l->csr = (sparse_matrix) { 0 };
+}
+
+/* The columns of every row are ascending, the gaps between them being the pruned weights. */
+void prune_sync(const layer *l) {
+    const sparse_matrix *s = &l->csr;
+    if (s->start == NULL)
+        return;
+
+    for (int i = 0; i < s->rows; i++) {
+        nn_real *row = l->weights.data + (size_t)i * s->cols;
+        int next = 0; /* first column not known to be kept */
+        for (int p = s->start[i]; p < s->start[i+1]; p++) {
+            int j = s->index[p];
+            memset(row + next, 0, (j - next) * sizeof(nn_real));
+            s->value[p] = row[j];
+            next = j + 1;
+        }
+        memset(row + next, 0, (s->cols - next) * sizeof(nn_real));
+    }
+}
+
+void prune_syncall(const neuralnetwork *nn) {
+    for (int i = 0; i < nn->nlayers; i++)
+        prune_sync(&nn->layers[i]);
+}
+
+/* Pruning is cumulative: weights which are already zero stay pruned. */
+long nn_prune(neuralnetwork *nn, int layer, double sparsity, double threshold) {
+    if (nn == NULL || layer < -1 || layer >= nn->nlayers || !(sparsity >= 0 && sparsity <= 1) ||
+        !(threshold >= 0)) {
+        fprintf(stderr, "%s: invalid layer or arguments\n", __func__);
+        return -1;
+    }
+
+    int first = layer < 0 ? 0 : layer, last = layer < 0 ? nn->nlayers : layer + 1;
+    long nonzero = 0;
+    for (int i = first; i < last; i++) {
+        struct layer *l = &nn->layers[i];
+        prune_weights(l, sparsity, threshold);
+        prune_build(l);
+        nonzero += l->csr.start[l->csr.rows];
+    }
+
+    return nonzero;
+}
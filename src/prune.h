@@ -0,0 +1,43 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+#ifndef NN_PRUNE_H
+#define NN_PRUNE_H
+
+#include "neuralnetwork.h"
+
+/* Largest fraction of nonzero weights, at which a pruned layer is evaluated
+ * by the sparse kernels rather than the dense ones. */
+#define PRUNE_DENSITY 0.25
+
+long nn_prune(neuralnetwork *nn, int layer, double sparsity, double threshold);
+
+/* (Re)builds the compressed rows of the layer's nonzero weights, marking it pruned. */
+void prune_build(layer *l);
+
+/* Frees the compressed rows of the layer, if it is pruned. */
+void prune_free(layer *l);
+
+/* Zeroes the pruned weights of the layer again after an update of its dense weights,
+ * and copies the rest into its compressed rows. Does nothing for unpruned layers. */
+void prune_sync(const layer *l);
+void prune_syncall(const neuralnetwork *nn);
+
+/* Whether the forward pass evaluates the layer by its compressed rows. */
+static inline int prune_sparse(const layer *l) {
+    return l->csr.start != NULL &&
+           l->csr.start[l->csr.rows] <= PRUNE_DENSITY * l->csr.rows * l->csr.cols;
+}
+
+#endif
@@ -0,0 +1,298 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "quantize.h"
+#include "activations.h"
+#include "simd.h"
+
+#if SIMD_X86
+#include <immintrin.h>
+#endif
+
+/* Samples propagated at once during the calibration. */
+#define CALIBRATION_BATCH 256
+
+/* Integer matrix-vector kernels: y = A*x for the m x n int8 matrix A and int16 vector x,
+ * n being a multiple of QUANT_PAD. Both operands are within [-127, 127],
+ * so the int32 sums can not overflow for n below 2^17. */
+
+static void qgemv_scalar(int m, int n, const int8_t *a, int lda, const int16_t *x, int32_t *y) {
+    for (int i = 0; i < m; i++) {
+        const int8_t *row = a + i*lda;
+        int32_t sum = 0;
+        for (int k = 0; k < n; k++)
+            sum += row[k] * x[k];
+        y[i] = sum;
+    }
+}
+
+#if SIMD_X86
+static inline __attribute__((target("sse2"))) int32_t hsum_epi32(__m128i s) {
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+    return _mm_cvtsi128_si32(s);
+}
+
+static __attribute__((target("sse2")))
+void qgemv_sse2(int m, int n, const int8_t *a, int lda, const int16_t *x, int32_t *y) {
+    for (int i = 0; i < m; i++) {
+        const int8_t *row = a + i*lda;
+        __m128i s = _mm_setzero_si128();
+
+        for (int k = 0; k < n; k += 16) {
+            __m128i w = _mm_loadu_si128((const __m128i *)(row + k));
+            /* No sign extending move in SSE2: bytes are doubled and shifted back. */
+            __m128i lo = _mm_srai_epi16(_mm_unpacklo_epi8(w, w), 8);
+            __m128i hi = _mm_srai_epi16(_mm_unpackhi_epi8(w, w), 8);
+            s = _mm_add_epi32(s, _mm_madd_epi16(lo, _mm_loadu_si128((const __m128i *)(x + k))));
+            s = _mm_add_epi32(s, _mm_madd_epi16(hi, _mm_loadu_si128((const __m128i *)(x + k + 8))));
+        }
+
+        y[i] = hsum_epi32(s);
+    }
+}
+
+static __attribute__((target("avx2")))
+void qgemv_avx2(int m, int n, const int8_t *a, int lda, const int16_t *x, int32_t *y) {
+    int i = 0;
+
+    /* Two rows at a time, sharing the loads of x. */
+    for (; i + 2 <= m; i += 2) {
+        const int8_t *r0 = a + i*lda, *r1 = r0 + lda;
+        __m256i s0 = _mm256_setzero_si256(), s1 = _mm256_setzero_si256();
+
+        for (int k = 0; k < n; k += 16) {
+            __m256i xv = _mm256_loadu_si256((const __m256i *)(x + k));
+            __m256i w0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(r0 + k)));
+            __m256i w1 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(r1 + k)));
+            s0 = _mm256_add_epi32(s0, _mm256_madd_epi16(w0, xv));
+            s1 = _mm256_add_epi32(s1, _mm256_madd_epi16(w1, xv));
+        }
+
+        y[i] = hsum_epi32(_mm_add_epi32(_mm256_castsi256_si128(s0), _mm256_extracti128_si256(s0, 1)));
+        y[i+1] = hsum_epi32(_mm_add_epi32(_mm256_castsi256_si128(s1), _mm256_extracti128_si256(s1, 1)));
+    }
+
+    for (; i < m; i++) {
+        const int8_t *row = a + i*lda;
+        __m256i s = _mm256_setzero_si256();
+
+        for (int k = 0; k < n; k += 16) {
+            __m256i w = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(row + k)));
+            s = _mm256_add_epi32(s, _mm256_madd_epi16(w, _mm256_loadu_si256((const __m256i *)(x + k))));
+        }
+
+        y[i] = hsum_epi32(_mm_add_epi32(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1)));
+    }
+}
+#endif
+
+/* Kernels indexed by the instruction set. The int8 products of AVX-512 need AVX512BW
+ * on top of the detected AVX512F, so that level uses the AVX2 kernel. */
+static void (*const qgemv_kernels[SIMD_ISA_N])(int m, int n, const int8_t *a, int lda,
+                                               const int16_t *x, int32_t *y) = {
+    qgemv_scalar,
+#if SIMD_X86
+    qgemv_sse2,
+    qgemv_avx2,
+    qgemv_avx2,
+#endif
+};
+
+/* Allocates size bytes, there is no point in continuing on failure. */
+static void *quantized_alloc(size_t size) {
+    void *p = calloc(1, size);
+    if (p == NULL) {
+        perror(__func__);
+        assert(p != NULL);
+    }
+    return p;
+}
+
+static int quant_padded(int n) {
+    return (n + QUANT_PAD - 1) / QUANT_PAD * QUANT_PAD;
+}
+
+nn_quantized *quantized_create(int inputs, int nlayers) {
+    nn_quantized *q = quantized_alloc(sizeof(nn_quantized));
+    q->inputs = inputs;
+    q->outputs = 0;
+    q->nlayers = nlayers;
+    q->layers = quantized_alloc(nlayers * sizeof(qlayer));
+    return q;
+}
+
+void quantized_setlayer(nn_quantized *q, int i, int rows, int activation) {
+    qlayer *l = &q->layers[i];
+
+    l->rows = rows;
+    l->cols = i > 0 ? q->layers[i-1].rows : q->inputs;
+    l->stride = quant_padded(l->cols);
+    l->weights = quantized_alloc((size_t)rows * l->stride);
+    l->scales = quantized_alloc(rows * sizeof(float));
+    l->in_scale = 1;
+    l->biases = quantized_alloc(rows * sizeof(nn_real));
+    l->activation = activation;
+
+    if (i == q->nlayers - 1)
+        q->outputs = rows;
+}
+
+void nn_quantized_destroy(nn_quantized *q) {
+    if (!q) return;
+
+    for (int i = 0; i < q->nlayers; i++) {
+        free(q->layers[i].weights);
+        free(q->layers[i].scales);
+        free(q->layers[i].biases);
+    }
+    free(q->layers);
+
+    free(q->xq);
+    free(q->acc);
+    free(q->out[0]);
+    free(q->out[1]);
+    free(q);
+}
+
+/* Symmetric scale mapping [-range, range] to [-127, 127]. */
+static float quant_scale(double range) {
+    return range > 0 ? range / 127 : 1;
+}
+
+/* Quantizes the weights of the layer with a scale per row. */
+static void quantize_weights(qlayer *ql, const layer *l) {
+    for (int r = 0; r < ql->rows; r++) {
+        double range = 0;
+        for (int k = 0; k < ql->cols; k++)
+            range = fmax(range, fabs(matrix_get(&l->weights, r, k)));
+
+        ql->scales[r] = quant_scale(range);
+        for (int k = 0; k < ql->cols; k++)
+            ql->weights[r*ql->stride + k] = lrint(matrix_get(&l->weights, r, k) / ql->scales[r]);
+    }
+}
+
+/* Records the largest magnitude of the input of every layer over the n samples. */
+static int calibrate(const neuralnetwork *nn, const nn_real *input, int n, double *range) {
+    nn_context *ctx = nn_context_create(nn);
+    if (ctx == NULL)
+        return 0;
+
+    for (int k = 0; k < n * nn->inputs; k++)
+        range[0] = fmax(range[0], fabs(input[k]));
+
+    for (int s = 0; s < n; s += CALIBRATION_BATCH) {
+        int batch = n - s < CALIBRATION_BATCH ? n - s : CALIBRATION_BATCH;
+        nn_context_forwardpropagate_batch(ctx, input + s*nn->inputs, batch);
+
+        /* Outputs of the hidden layers are kept in the context. */
+        for (int i = 1; i < nn->nlayers; i++) {
+            const matrix *out = ctx->layers[i-1].out;
+            for (int k = 0; k < out->rows * out->cols; k++)
+                range[i] = fmax(range[i], fabs(out->data[k]));
+        }
+    }
+
+    nn_context_destroy(ctx);
+    return 1;
+}
+
+/* Weights are quantized per row, inputs of every layer per layer,
+ * with scales covering the range seen over the n samples. */
+nn_quantized *nn_quantize(const neuralnetwork *nn, const nn_real *input, int n) {
+    if (nn == NULL || nn->nlayers == 0 || input == NULL || n < 1) {
+        fprintf(stderr, "%s: Nothing to quantize or calibrate on\n", __func__);
+        return NULL;
+    }
+
+    double *range = calloc(nn->nlayers, sizeof(double));
+    if (range == NULL || !calibrate(nn, input, n, range)) {
+        perror(__func__);
+        free(range);
+        return NULL;
+    }
+
+    nn_quantized *q = quantized_create(nn->inputs, nn->nlayers);
+    for (int i = 0; i < nn->nlayers; i++) {
+        const layer *l = &nn->layers[i];
+        qlayer *ql = &q->layers[i];
+
+        quantized_setlayer(q, i, l->weights.rows, l->activation);
+        quantize_weights(ql, l);
+        ql->in_scale = quant_scale(range[i]);
+        memcpy(ql->biases, l->biases.data, ql->rows * sizeof(nn_real));
+    }
+
+    free(range);
+    return q;
+}
+
+/* Allocates the buffers of the forward propagation for the widest layer. */
+static void quantized_buffers(nn_quantized *q) {
+    int width = q->inputs;
+    for (int i = 0; i < q->nlayers; i++) {
+        if (q->layers[i].rows > width)
+            width = q->layers[i].rows;
+    }
+
+    q->xq = quantized_alloc(quant_padded(width) * sizeof(int16_t));
+    q->acc = quantized_alloc(width * sizeof(int32_t));
+    q->out[0] = quantized_alloc(width * sizeof(nn_real));
+    q->out[1] = quantized_alloc(width * sizeof(nn_real));
+}
+
+/* Quantizes n elements of x, leaving the padding of xq at zero.
+ * Values beyond the calibrated range are saturated. */
+static void quantize_input(const nn_real *x, int n, float scale, int16_t *xq) {
+    float inv = 1 / scale;
+    for (int k = 0; k < n; k++) {
+        float v = x[k] * inv;
+        v = v > 127 ? 127 : v < -127 ? -127 : v;
+        xq[k] = lrintf(v);
+    }
+}
+
+/* Uses the buffers of the network, hence concurrent calls are not allowed. */
+nn_real *nn_quantized_forwardpropagate(nn_quantized *q, const nn_real *input) {
+    if (q == NULL || q->nlayers == 0) return NULL;
+
+    if (q->xq == NULL)
+        quantized_buffers(q);
+
+    int isa = simd_isa();
+    const nn_real *in = input;
+    for (int i = 0; i < q->nlayers; i++) {
+        const qlayer *l = &q->layers[i];
+        nn_real *out = q->out[i % 2];
+
+        quantize_input(in, l->cols, l->in_scale, q->xq);
+        qgemv_kernels[isa](l->rows, l->stride, l->weights, l->stride, q->xq, q->acc);
+
+        /* Dequantized net, the activation is applied in place. */
+        for (int r = 0; r < l->rows; r++)
+            out[r] = q->acc[r] * (l->scales[r] * l->in_scale) + l->biases[r];
+        activation_forward(l->activation, out, out, l->rows, 1);
+
+        in = out;
+    }
+
+    return (nn_real *)in;
+}
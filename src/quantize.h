@@ -0,0 +1,67 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+#ifndef NN_QUANTIZE_H
+#define NN_QUANTIZE_H
+
+#include <stdint.h>
+
+#include "neuralnetwork.h"
+
+/* Rows of the int8 weights are padded with zeroes to a multiple of it,
+ * so that the kernels only process whole vectors. */
+#define QUANT_PAD 16
+
+/* Layer with int8 weights, evaluated as
+ * out = f(scales[row] * in_scale * (weights * round(in / in_scale)) + biases). */
+typedef struct qlayer {
+    int rows, cols;
+    int stride; /* distance between the rows of weights, cols padded to QUANT_PAD */
+
+    int8_t *weights; /* rows x stride, symmetrically quantized to [-127, 127] */
+    float *scales; /* per row scale of the weights */
+    float in_scale; /* scale of the input, calibrated on the sample data */
+    nn_real *biases;
+
+    int activation;
+} qlayer;
+
+typedef struct nn_quantized {
+    int inputs;
+    int outputs;
+
+    int nlayers;
+    qlayer *layers;
+
+    /* Buffers of the forward propagation, sized for the widest layer. */
+    int16_t *xq; /* quantized input of the current layer */
+    int32_t *acc; /* integer products */
+    nn_real *out[2]; /* outputs of the consecutive layers */
+} nn_quantized;
+
+/* Allocates a quantized network of nlayers layers, which are set up by quantized_setlayer. */
+nn_quantized *quantized_create(int inputs, int nlayers);
+
+/* Allocates the arrays of the i-th layer, taking the output of the previous one.
+ * Weights are zeroed, including the padding. */
+void quantized_setlayer(nn_quantized *q, int i, int rows, int activation);
+
+nn_quantized *nn_quantize(const neuralnetwork *nn, const nn_real *input, int n);
+void nn_quantized_destroy(nn_quantized *q);
+nn_real *nn_quantized_forwardpropagate(nn_quantized *q, const nn_real *input);
+
+int nn_quantized_writefile(const nn_quantized *q, const char *filename);
+nn_quantized *nn_quantized_readfile(const char *filename);
+
+#endif
@@ -0,0 +1,193 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "random.h"
+#include "neuralnetwork.h"
+#include "simd.h"
+
+#if SIMD_X86
+#include <immintrin.h>
+#endif
+
+/* Pairs of normal numbers generated at once, a chunk of 2 * RNG_CHUNK elements. */
+#define RNG_CHUNK 256
+/* Elements filled by a thread at least, smaller arrays are not worth a thread. */
+#define RNG_GRAIN (1 << 16)
+#define RNG_THREADS 64
+
+/* Position within the stream of SplitMix64 seeded with the key, i.e. a counter
+ * scrambled by a 64-bit finalizer, which passes BigCrush. */
+uint64_t rng_bits(uint64_t key, uint64_t counter) {
+    uint64_t z = key + (counter + 1) * 0x9e3779b97f4a7c15;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+void rng_seed(nn_rng *rng, uint64_t seed) {
+    rng->key = seed;
+    rng->counter = 0;
+}
+
+/* Seed of a network not given one: the clock, told apart from the other networks
+ * created within its resolution by a count of them. */
+uint64_t rng_default_seed(void) {
+    static atomic_ullong created;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    unsigned long long n = atomic_fetch_add_explicit(&created, 1, memory_order_relaxed);
+    return rng_bits((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec, n);
+}
+
+void nn_seed(neuralnetwork *nn, unsigned long long seed) {
+    rng_seed(&nn->rng, seed);
+}
+
+/* Box-Muller transform of the pairs of uniform numbers (u, phi) into pairs of normal
+ * numbers (z0, z1) of deviation sigma, clamped to [-max, max]. The angle is
+ * phi + pi/4 in [0, pi/2), turned into any quadrant by the signs of z0 and z1. */
+static void normal_pairs(int n, const nn_real *u, const nn_real *phi,
+                         const nn_real *sign0, const nn_real *sign1,
+                         nn_real sigma, nn_real max, nn_real *z0, nn_real *z1) {
+    for (int j = 0; j < n; j++) {
+        double r = sqrt(-2 * log(u[j])) * sigma * M_SQRT1_2;
+        double c = cos(phi[j]), s = sin(phi[j]);
+        z0[j] = fmin(fmax(r * (c - s) * sign0[j], -max), max);
+        z1[j] = fmin(fmax(r * (c + s) * sign1[j], -max), max);
+    }
+}
+
+#if SIMD_X86
+#define SIMD_TARGET SIMD_SSE2
+#include "simd_ops.h"
+#include "simd_math.h"
+#include "random_kernels.h"
+#undef SIMD_TARGET
+
+#define SIMD_TARGET SIMD_AVX2
+#include "simd_ops.h"
+#include "simd_math.h"
+#include "random_kernels.h"
+#undef SIMD_TARGET
+
+#define SIMD_TARGET SIMD_AVX512
+#include "simd_ops.h"
+#include "simd_math.h"
+#include "random_kernels.h"
+#undef SIMD_TARGET
+#endif
+
+typedef void (*normal_kernel)(int n, const nn_real *u, const nn_real *phi,
+                              const nn_real *sign0, const nn_real *sign1,
+                              nn_real sigma, nn_real max, nn_real *z0, nn_real *z1);
+
+static const normal_kernel normal_kernels[SIMD_ISA_N] = {
+    normal_pairs,
+#if SIMD_X86
+    normal_pairs_sse2, normal_pairs_avx2, normal_pairs_avx512,
+#endif
+};
+
+/* Fills the m <= 2 * RNG_CHUNK elements of a chunk, starting at the counter.
+ * The first numbers of the pairs go to the first half of the chunk, the second
+ * ones to the second half, so that neither has to be interleaved. */
+static void normal_chunk(uint64_t key, uint64_t counter, nn_real *out, int m,
+                         nn_real sigma, nn_real max) {
+    nn_real u[RNG_CHUNK], phi[RNG_CHUNK], sign0[RNG_CHUNK], sign1[RNG_CHUNK], tail[RNG_CHUNK];
+    int npairs = (m + 1) / 2;
+
+    for (int j = 0; j < npairs; j++) {
+        uint64_t b0 = rng_bits(key, counter + 2*j), b1 = rng_bits(key, counter + 2*j + 1);
+        /* 53 high bits as a uniform number in (0, 1] and [-pi/4, pi/4),
+         * the low ones are independent of them and pick the quadrant
+         * (arithmetically, as they are random branches). */
+        u[j] = ((b0 >> 11) + 1) * 0x1p-53;
+        phi[j] = ((b1 >> 11) * 0x1p-53 - 0.5) * M_PI_2;
+        sign0[j] = 1 - (nn_real)(b1 & 1) * 2;
+        sign1[j] = 1 - (nn_real)(b1 & 2);
+    }
+
+    /* An odd chunk has one element less in the second half. */
+    nn_real *z1 = m % 2 == 0 ? out + npairs : tail;
+    normal_kernels[simd_isa()](npairs, u, phi, sign0, sign1, sigma, max, out, z1);
+    if (z1 == tail)
+        memcpy(out + npairs, tail, (m - npairs) * sizeof(nn_real));
+}
+
+/* Contiguous range of the chunks of an array, filled by a thread. */
+struct normal_job {
+    uint64_t key, counter; /* of the array's first element */
+    nn_real *out;
+    size_t n; /* elements of the whole array */
+    size_t first, last; /* chunks of the job */
+    nn_real sigma, max;
+};
+
+static void *normal_main(void *arg) {
+    struct normal_job *job = arg;
+    for (size_t k = job->first; k < job->last; k++) {
+        size_t start = k * 2 * RNG_CHUNK;
+        size_t m = job->n - start < 2 * RNG_CHUNK ? job->n - start : 2 * RNG_CHUNK;
+        normal_chunk(job->key, job->counter + start, job->out + start, m, job->sigma, job->max);
+    }
+    return NULL;
+}
+
+/* Fills the array with n normal numbers of deviation sigma, truncated to [-max, max].
+ * Every element depends only on the key and its position within the stream,
+ * large arrays are filled by several threads with the same result as by one. */
+void rng_normal(nn_rng *rng, nn_real *out, size_t n, double sigma, double max) {
+    size_t nchunks = (n + 2 * RNG_CHUNK - 1) / (2 * RNG_CHUNK);
+
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = n / RNG_GRAIN;
+    if (online > 0 && nthreads > (size_t)online) nthreads = online;
+    if (nthreads > RNG_THREADS) nthreads = RNG_THREADS;
+    if (nthreads < 1) nthreads = 1;
+
+    struct normal_job jobs[RNG_THREADS];
+    pthread_t threads[RNG_THREADS];
+    int started[RNG_THREADS] = { 0 };
+
+    for (size_t k = 0; k < nthreads; k++) {
+        jobs[k] = (struct normal_job) {
+            rng->key, rng->counter, out, n,
+            nchunks * k / nthreads, nchunks * (k + 1) / nthreads, sigma, max
+        };
+        /* A job whose thread fails to start is done by the caller. */
+        if (k > 0)
+            started[k] = pthread_create(&threads[k], NULL, normal_main, &jobs[k]) == 0;
+    }
+
+    normal_main(&jobs[0]);
+    for (size_t k = 1; k < nthreads; k++) {
+        if (started[k]) {
+            pthread_join(threads[k], NULL);
+        } else normal_main(&jobs[k]);
+    }
+
+    /* Whole chunks are consumed, so the streams of consecutive arrays never overlap. */
+    rng->counter += nchunks * 2 * RNG_CHUNK;
+}
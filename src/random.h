@@ -0,0 +1,41 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+
+#ifndef NN_RANDOM_H
+#define NN_RANDOM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "matrix.h"
+
+/* Counter-based generator: a number of the stream is a function of the key and its
+ * position only, so that any part of the stream is generated independently of the rest,
+ * e.g. by several threads, with the same result. */
+typedef struct nn_rng {
+    uint64_t key;
+    uint64_t counter; /* position of the first number not used yet */
+} nn_rng;
+
+struct neuralnetwork;
+
+void nn_seed(struct neuralnetwork *nn, unsigned long long seed);
+
+uint64_t rng_default_seed(void);
+void rng_seed(nn_rng *rng, uint64_t seed);
+uint64_t rng_bits(uint64_t key, uint64_t counter);
+void rng_normal(nn_rng *rng, nn_real *out, size_t n, double sigma, double max);
+
+#endif
@@ -0,0 +1,35 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+
+/* Normal distribution kernels, instantiated by random.c once per instruction set.
+ * Has no include guard on purpose, see simd_ops.h. Requires simd_math.h. */
+
+static SIMD_ATTR void K(normal_pairs)(int n, const nn_real *u, const nn_real *phi,
+                                      const nn_real *sign0, const nn_real *sign1,
+                                      nn_real sigma, nn_real max, nn_real *z0, nn_real *z1) {
+    vreal k = vset1(sigma * M_SQRT1_2), m2 = vset1(-2.0);
+    vreal hi = vset1(max), lo = vset1(-max);
+
+    int j = 0;
+    for (; j + VW <= n; j += VW) {
+        vreal r = vmul(vsqrt(vmul(m2, K(vlog)(vload(u + j)))), k);
+        vreal s, c;
+        K(vsincos)(vload(phi + j), &s, &c);
+
+        vstore(z0 + j, vmin(vmax(vmul(vmul(r, vsub(c, s)), vload(sign0 + j)), lo), hi));
+        vstore(z1 + j, vmin(vmax(vmul(vmul(r, vadd(c, s)), vload(sign1 + j)), lo), hi));
+    }
+    normal_pairs(n - j, u + j, phi + j, sign0 + j, sign1 + j, sigma, max, z0 + j, z1 + j);
+}
@@ -0,0 +1,62 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "simd.h"
+
+static const char *names[SIMD_ISA_N] = { "scalar", "sse2", "avx2", "avx512" };
+
+/* Detected instruction set, -1 until the first call. */
+static atomic_int detected = -1;
+
+static int simd_detect(void) {
+    int isa = SIMD_SCALAR;
+
+#if SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) isa = SIMD_SSE2;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) isa = SIMD_AVX2;
+    if (__builtin_cpu_supports("avx512f")) isa = SIMD_AVX512;
+#endif
+
+    /* Allow to force a lesser instruction set, e.g. for comparison. */
+    const char *env = getenv("NN_SIMD");
+    if (env) {
+        for (int i = 0; i < isa; i++) {
+            if (strcmp(env, names[i]) == 0) {
+                isa = i;
+                break;
+            }
+        }
+    }
+
+    return isa;
+}
+
+int simd_isa(void) {
+    int isa = atomic_load_explicit(&detected, memory_order_relaxed);
+    if (isa < 0) {
+        /* Detection is idempotent, concurrent callers store the same value. */
+        isa = simd_detect();
+        atomic_store_explicit(&detected, isa, memory_order_relaxed);
+    }
+    return isa;
+}
+
+const char *simd_isa_name(int isa) {
+    return (isa >= 0 && isa < SIMD_ISA_N) ? names[isa] : "unknown";
+}
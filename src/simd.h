@@ -0,0 +1,41 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+#ifndef NN_SIMD_H
+#define NN_SIMD_H
+
+/* Instruction sets the kernels are compiled for.
+ * Ordered, so that a greater value implies support of all the lesser ones.
+ * Macros rather than an enum, as the kernel templates select on them with #if. */
+#define SIMD_SCALAR 0
+#define SIMD_SSE2 1
+#define SIMD_AVX2 2
+#define SIMD_AVX512 3
+#define SIMD_ISA_N 4 /* used as the array size for declaration */
+
+/* x86 vector kernels are built with per-function target attributes,
+ * so the library itself does not require any -m flags. */
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define SIMD_X86 1
+#else
+#define SIMD_X86 0
+#endif
+
+/* Returns the best instruction set supported by both the library and the CPU.
+ * NN_SIMD environment variable (scalar, sse2, avx2, avx512) may lower it. */
+int simd_isa(void);
+
+const char *simd_isa_name(int isa);
+
+#endif
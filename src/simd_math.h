@@ -0,0 +1,152 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+/* Vector math functions shared by the kernel templates.
+ * Has no include guard on purpose, include it after simd_ops.h. */
+
+#ifdef NN_FLOAT
+
+/* e^x, evaluated as 2^n * e^r with |r| <= ln(2)/2 and a degree 7 Taylor polynomial
+ * for e^r, which is accurate to a couple of ulp. Arguments are clamped to [-87, 88],
+ * so the result neither overflows nor becomes subnormal. */
+static inline SIMD_ATTR vreal K(vexp)(vreal x) {
+    const vreal magic = vset1(0x1.8p23f); /* rounds to integer when added */
+
+    x = vmax(vmin(x, vset1(88.0f)), vset1(-87.0f));
+
+    /* n = round(x / ln(2)) */
+    vreal t = vfma(x, vset1(1.44269504f), magic);
+    vreal n = vsub(t, magic);
+
+    /* r = x - n*ln(2), with ln(2) split in two so that n*LN2_HI is exact. */
+    vreal r = vfma(n, vset1(-0.693359375f), x);
+    r = vfma(n, vset1(2.12194440e-4f), r);
+
+    vreal p = vset1(1.0f / 5040);
+    p = vfma(p, r, vset1(1.0f / 720));
+    p = vfma(p, r, vset1(1.0f / 120));
+    p = vfma(p, r, vset1(1.0f / 24));
+    p = vfma(p, r, vset1(1.0f / 6));
+    p = vfma(p, r, vset1(0.5f));
+    p = vfma(p, r, vset1(1.0f));
+    p = vfma(p, r, vset1(1.0f));
+
+    return vmul(p, vpow2n(t));
+}
+
+#else
+
+/* e^x, evaluated as 2^n * e^r with |r| <= ln(2)/2 and a degree 12 Taylor polynomial
+ * for e^r, which is accurate to a few ulp. Arguments are clamped to [-708, 709],
+ * so the result neither overflows nor becomes subnormal. */
+static inline SIMD_ATTR vreal K(vexp)(vreal x) {
+    const vreal magic = vset1(0x1.8p52); /* rounds to integer when added */
+
+    x = vmax(vmin(x, vset1(709.0)), vset1(-708.0));
+
+    /* n = round(x / ln(2)) */
+    vreal t = vfma(x, vset1(1.44269504088896340736), magic);
+    vreal n = vsub(t, magic);
+
+    /* r = x - n*ln(2), with ln(2) split in two so that n*LN2_HI is exact. */
+    vreal r = vfma(n, vset1(-6.93147180369123816490e-01), x);
+    r = vfma(n, vset1(-1.90821492927058770002e-10), r);
+
+    vreal p = vset1(1.0 / 479001600);
+    p = vfma(p, r, vset1(1.0 / 39916800));
+    p = vfma(p, r, vset1(1.0 / 3628800));
+    p = vfma(p, r, vset1(1.0 / 362880));
+    p = vfma(p, r, vset1(1.0 / 40320));
+    p = vfma(p, r, vset1(1.0 / 5040));
+    p = vfma(p, r, vset1(1.0 / 720));
+    p = vfma(p, r, vset1(1.0 / 120));
+    p = vfma(p, r, vset1(1.0 / 24));
+    p = vfma(p, r, vset1(1.0 / 6));
+    p = vfma(p, r, vset1(0.5));
+    p = vfma(p, r, vset1(1.0));
+    p = vfma(p, r, vset1(1.0));
+
+    return vmul(p, vpow2n(t));
+}
+
+#endif
+
+/* 1 / (1 + e^-x) */
+static inline SIMD_ATTR vreal K(vsigmoid)(vreal x) {
+    vreal one = vset1(1.0);
+    return vdiv(one, vadd(one, K(vexp)(vsub(vzero(), x))));
+}
+
+/* tanh(x) = 1 - 2 / (e^2x + 1), absolute error is within a few epsilon of nn_real. */
+static inline SIMD_ATTR vreal K(vtanh)(vreal x) {
+    vreal one = vset1(1.0);
+    return vsub(one, vdiv(vset1(2.0), vadd(K(vexp)(vadd(x, x)), one)));
+}
+
+/* e^(-x^2) */
+static inline SIMD_ATTR vreal K(vgaussian)(vreal x) {
+    return K(vexp)(vmul(vsub(vzero(), x), x));
+}
+
+/* Natural logarithm of a positive normal x = 2^e * m, with m brought to [sqrt(1/2), sqrt(2)).
+ * log(m) = 2*atanh(s) for s = (m-1)/(m+1), |s| < 0.172, is summed up to s^19,
+ * which is accurate to a few ulp of double. */
+static inline SIMD_ATTR vreal K(vlog)(vreal x) {
+    vreal one = vset1(1.0);
+    vreal e = vgetexp(x), m = vgetmant(x);
+
+    vreal big = vsub(m, vset1(1.41421356237309504880));
+    m = vselect(big, vmul(m, vset1(0.5)), m);
+    e = vselect(big, vadd(e, one), e);
+
+    vreal s = vdiv(vsub(m, one), vadd(m, one)), s2 = vmul(s, s);
+    vreal p = vset1(1.0 / 19);
+    p = vfma(p, s2, vset1(1.0 / 17));
+    p = vfma(p, s2, vset1(1.0 / 15));
+    p = vfma(p, s2, vset1(1.0 / 13));
+    p = vfma(p, s2, vset1(1.0 / 11));
+    p = vfma(p, s2, vset1(1.0 / 9));
+    p = vfma(p, s2, vset1(1.0 / 7));
+    p = vfma(p, s2, vset1(1.0 / 5));
+    p = vfma(p, s2, vset1(1.0 / 3));
+    p = vfma(p, s2, one);
+
+    return vfma(e, vset1(0.69314718055994530942), vmul(vadd(s, s), p));
+}
+
+/* sin(x) and cos(x) for |x| <= pi/4 by their Taylor polynomials up to x^15 and x^16,
+ * accurate to a few ulp of double. */
+static inline SIMD_ATTR void K(vsincos)(vreal x, vreal *vs, vreal *vc) {
+    vreal x2 = vmul(x, x);
+
+    vreal s = vset1(-1.0 / 1307674368000);
+    s = vfma(s, x2, vset1(1.0 / 6227020800));
+    s = vfma(s, x2, vset1(-1.0 / 39916800));
+    s = vfma(s, x2, vset1(1.0 / 362880));
+    s = vfma(s, x2, vset1(-1.0 / 5040));
+    s = vfma(s, x2, vset1(1.0 / 120));
+    s = vfma(s, x2, vset1(-1.0 / 6));
+    s = vfma(s, x2, vset1(1.0));
+    *vs = vmul(s, x);
+
+    vreal c = vset1(1.0 / 20922789888000);
+    c = vfma(c, x2, vset1(-1.0 / 87178291200));
+    c = vfma(c, x2, vset1(1.0 / 479001600));
+    c = vfma(c, x2, vset1(-1.0 / 3628800));
+    c = vfma(c, x2, vset1(1.0 / 40320));
+    c = vfma(c, x2, vset1(-1.0 / 720));
+    c = vfma(c, x2, vset1(1.0 / 24));
+    c = vfma(c, x2, vset1(-0.5));
+    *vc = vfma(c, x2, vset1(1.0));
+}
@@ -0,0 +1,261 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+/* Vector operations for the kernel templates.
+ * Intentionally has no include guard: define SIMD_TARGET to one of the SIMD_*
+ * instruction set values and include this file before each kernel template.
+ * <immintrin.h> has to be included by the translation unit beforehand. */
+
+#undef SIMD_ATTR
+#undef K
+#undef K_
+#undef K__
+#undef VW
+#undef vreal
+#undef vzero
+#undef vset1
+#undef vload
+#undef vstore
+#undef vadd
+#undef vsub
+#undef vmul
+#undef vdiv
+#undef vmin
+#undef vmax
+#undef vsqrt
+#undef vselect
+#undef vgetexp
+#undef vgetmant
+#undef vfma
+#undef vgather
+#undef vpow2n
+#undef vfirst
+
+/* Every instruction set has a double and a single precision (NN_FLOAT) version,
+ * vreal holding VW elements of nn_real.
+ *
+ * vselect(x, a, b) picks a for the elements where x > 0, and b elsewhere, NaN included.
+ *
+ * vgetexp(x) and vgetmant(x) split a positive normal x into 2^e * m: vgetexp returns e
+ * and vgetmant m in [1, 2), both as vreal.
+ *
+ * vgather(p, index) loads p[index[0]], ..., p[index[VW-1]], index pointing to VW ints.
+ *
+ * vpow2n(t) returns 2^n for t = n + 0x1.8p52 (0x1.8p23 for floats), where n is an integer
+ * within the exponent range. The low bits of t's mantissa hold n then,
+ * which are shifted into the exponent. */
+
+/* Appends the instruction set suffix to a kernel name. */
+#define K__(name, isa) name##_##isa
+#define K_(name, isa) K__(name, isa)
+
+#if SIMD_TARGET == SIMD_SSE2 && defined(NN_FLOAT)
+
+#define SIMD_ATTR __attribute__((target("sse2")))
+#define K(name) K_(name, sse2)
+#define VW 4
+#define vreal __m128
+#define vzero() _mm_setzero_ps()
+#define vset1(x) _mm_set1_ps(x)
+#define vload(p) _mm_loadu_ps(p)
+#define vstore(p, v) _mm_storeu_ps(p, v)
+#define vadd(a, b) _mm_add_ps(a, b)
+#define vsub(a, b) _mm_sub_ps(a, b)
+#define vmul(a, b) _mm_mul_ps(a, b)
+#define vdiv(a, b) _mm_div_ps(a, b)
+#define vmin(a, b) _mm_min_ps(a, b)
+#define vmax(a, b) _mm_max_ps(a, b)
+#define vsqrt(a) _mm_sqrt_ps(a)
+#define vselect(x, a, b) _mm_or_ps(_mm_and_ps(_mm_cmpgt_ps(x, _mm_setzero_ps()), a), \
+            _mm_andnot_ps(_mm_cmpgt_ps(x, _mm_setzero_ps()), b))
+#define vgetexp(x) _mm_sub_ps(_mm_cvtepi32_ps(_mm_srli_epi32(_mm_castps_si128(x), 23)), \
+            _mm_set1_ps(127.0f))
+#define vgetmant(x) _mm_or_ps(_mm_and_ps(x, _mm_castsi128_ps(_mm_set1_epi32(0x007fffff))), \
+            _mm_set1_ps(1.0f))
+#define vfma(a, b, c) _mm_add_ps(_mm_mul_ps(a, b), c) /* no FMA in SSE2 */
+#define vgather(p, index) _mm_setr_ps((p)[(index)[0]], (p)[(index)[1]], (p)[(index)[2]], \
+            (p)[(index)[3]]) /* no gather in SSE2 */
+#define vfirst(v) _mm_cvtss_f32(v)
+#define vpow2n(t) _mm_castsi128_ps(_mm_slli_epi32( \
+            _mm_add_epi32(_mm_castps_si128(t), _mm_set1_epi32(127)), 23))
+
+static inline SIMD_ATTR float K(vhsum)(vreal v) {
+    __m128 s = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, 1)));
+}
+
+#elif SIMD_TARGET == SIMD_SSE2
+
+#define SIMD_ATTR __attribute__((target("sse2")))
+#define K(name) K_(name, sse2)
+#define VW 2
+#define vreal __m128d
+#define vzero() _mm_setzero_pd()
+#define vset1(x) _mm_set1_pd(x)
+#define vload(p) _mm_loadu_pd(p)
+#define vstore(p, v) _mm_storeu_pd(p, v)
+#define vadd(a, b) _mm_add_pd(a, b)
+#define vsub(a, b) _mm_sub_pd(a, b)
+#define vmul(a, b) _mm_mul_pd(a, b)
+#define vdiv(a, b) _mm_div_pd(a, b)
+#define vmin(a, b) _mm_min_pd(a, b)
+#define vmax(a, b) _mm_max_pd(a, b)
+#define vsqrt(a) _mm_sqrt_pd(a)
+#define vselect(x, a, b) _mm_or_pd(_mm_and_pd(_mm_cmpgt_pd(x, _mm_setzero_pd()), a), \
+            _mm_andnot_pd(_mm_cmpgt_pd(x, _mm_setzero_pd()), b))
+#define vgetexp(x) _mm_sub_pd(_mm_castsi128_pd(_mm_or_si128(_mm_srli_epi64(_mm_castpd_si128(x), 52), \
+            _mm_castpd_si128(_mm_set1_pd(0x1p52)))), _mm_set1_pd(0x1p52 + 1023))
+#define vgetmant(x) _mm_or_pd(_mm_and_pd(x, _mm_castsi128_pd(_mm_set1_epi64x(0x000fffffffffffffLL))), \
+            _mm_set1_pd(1.0))
+#define vfma(a, b, c) _mm_add_pd(_mm_mul_pd(a, b), c) /* no FMA in SSE2 */
+#define vgather(p, index) _mm_setr_pd((p)[(index)[0]], (p)[(index)[1]]) /* no gather in SSE2 */
+#define vfirst(v) _mm_cvtsd_f64(v)
+#define vpow2n(t) _mm_castsi128_pd(_mm_slli_epi64( \
+            _mm_add_epi64(_mm_castpd_si128(t), _mm_set1_epi64x(1023)), 52))
+
+static inline SIMD_ATTR double K(vhsum)(vreal v) {
+    return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+#elif SIMD_TARGET == SIMD_AVX2 && defined(NN_FLOAT)
+
+#define SIMD_ATTR __attribute__((target("avx2,fma")))
+#define K(name) K_(name, avx2)
+#define VW 8
+#define vreal __m256
+#define vzero() _mm256_setzero_ps()
+#define vset1(x) _mm256_set1_ps(x)
+#define vload(p) _mm256_loadu_ps(p)
+#define vstore(p, v) _mm256_storeu_ps(p, v)
+#define vadd(a, b) _mm256_add_ps(a, b)
+#define vsub(a, b) _mm256_sub_ps(a, b)
+#define vmul(a, b) _mm256_mul_ps(a, b)
+#define vdiv(a, b) _mm256_div_ps(a, b)
+#define vmin(a, b) _mm256_min_ps(a, b)
+#define vmax(a, b) _mm256_max_ps(a, b)
+#define vsqrt(a) _mm256_sqrt_ps(a)
+#define vselect(x, a, b) _mm256_blendv_ps(b, a, _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_GT_OQ))
+#define vgetexp(x) _mm256_sub_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(_mm256_castps_si256(x), 23)), \
+            _mm256_set1_ps(127.0f))
+#define vgetmant(x) _mm256_or_ps(_mm256_and_ps(x, _mm256_castsi256_ps(_mm256_set1_epi32(0x007fffff))), \
+            _mm256_set1_ps(1.0f))
+#define vfma(a, b, c) _mm256_fmadd_ps(a, b, c)
+#define vgather(p, index) _mm256_i32gather_ps(p, _mm256_loadu_si256((const __m256i *)(index)), 4)
+#define vfirst(v) _mm256_cvtss_f32(v)
+#define vpow2n(t) _mm256_castsi256_ps(_mm256_slli_epi32( \
+            _mm256_add_epi32(_mm256_castps_si256(t), _mm256_set1_epi32(127)), 23))
+
+static inline SIMD_ATTR float K(vhsum)(vreal v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, 1)));
+}
+
+#elif SIMD_TARGET == SIMD_AVX2
+
+#define SIMD_ATTR __attribute__((target("avx2,fma")))
+#define K(name) K_(name, avx2)
+#define VW 4
+#define vreal __m256d
+#define vzero() _mm256_setzero_pd()
+#define vset1(x) _mm256_set1_pd(x)
+#define vload(p) _mm256_loadu_pd(p)
+#define vstore(p, v) _mm256_storeu_pd(p, v)
+#define vadd(a, b) _mm256_add_pd(a, b)
+#define vsub(a, b) _mm256_sub_pd(a, b)
+#define vmul(a, b) _mm256_mul_pd(a, b)
+#define vdiv(a, b) _mm256_div_pd(a, b)
+#define vmin(a, b) _mm256_min_pd(a, b)
+#define vmax(a, b) _mm256_max_pd(a, b)
+#define vsqrt(a) _mm256_sqrt_pd(a)
+#define vselect(x, a, b) _mm256_blendv_pd(b, a, _mm256_cmp_pd(x, _mm256_setzero_pd(), _CMP_GT_OQ))
+#define vgetexp(x) _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256( \
+            _mm256_srli_epi64(_mm256_castpd_si256(x), 52), _mm256_castpd_si256(_mm256_set1_pd(0x1p52)))), \
+            _mm256_set1_pd(0x1p52 + 1023))
+#define vgetmant(x) _mm256_or_pd(_mm256_and_pd(x, \
+            _mm256_castsi256_pd(_mm256_set1_epi64x(0x000fffffffffffffLL))), _mm256_set1_pd(1.0))
+#define vfma(a, b, c) _mm256_fmadd_pd(a, b, c)
+#define vgather(p, index) _mm256_i32gather_pd(p, _mm_loadu_si128((const __m128i *)(index)), 8)
+#define vfirst(v) _mm256_cvtsd_f64(v)
+#define vpow2n(t) _mm256_castsi256_pd(_mm256_slli_epi64( \
+            _mm256_add_epi64(_mm256_castpd_si256(t), _mm256_set1_epi64x(1023)), 52))
+
+static inline SIMD_ATTR double K(vhsum)(vreal v) {
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+
+#elif SIMD_TARGET == SIMD_AVX512 && defined(NN_FLOAT)
+
+#define SIMD_ATTR __attribute__((target("avx512f")))
+#define K(name) K_(name, avx512)
+#define VW 16
+#define vreal __m512
+#define vzero() _mm512_setzero_ps()
+#define vset1(x) _mm512_set1_ps(x)
+#define vload(p) _mm512_loadu_ps(p)
+#define vstore(p, v) _mm512_storeu_ps(p, v)
+#define vadd(a, b) _mm512_add_ps(a, b)
+#define vsub(a, b) _mm512_sub_ps(a, b)
+#define vmul(a, b) _mm512_mul_ps(a, b)
+#define vdiv(a, b) _mm512_div_ps(a, b)
+#define vmin(a, b) _mm512_min_ps(a, b)
+#define vmax(a, b) _mm512_max_ps(a, b)
+#define vsqrt(a) _mm512_sqrt_ps(a)
+#define vselect(x, a, b) _mm512_mask_blend_ps(_mm512_cmp_ps_mask(x, _mm512_setzero_ps(), _CMP_GT_OQ), b, a)
+#define vgetexp(x) _mm512_getexp_ps(x)
+#define vgetmant(x) _mm512_getmant_ps(x, _MM_MANT_NORM_1_2, _MM_MANT_SIGN_src)
+#define vfma(a, b, c) _mm512_fmadd_ps(a, b, c)
+#define vgather(p, index) _mm512_i32gather_ps(_mm512_loadu_si512(index), p, 4)
+#define vfirst(v) _mm512_cvtss_f32(v)
+#define vpow2n(t) _mm512_castsi512_ps(_mm512_slli_epi32( \
+            _mm512_add_epi32(_mm512_castps_si512(t), _mm512_set1_epi32(127)), 23))
+
+static inline SIMD_ATTR float K(vhsum)(vreal v) {
+    return _mm512_reduce_add_ps(v);
+}
+
+#elif SIMD_TARGET == SIMD_AVX512
+
+#define SIMD_ATTR __attribute__((target("avx512f")))
+#define K(name) K_(name, avx512)
+#define VW 8
+#define vreal __m512d
+#define vzero() _mm512_setzero_pd()
+#define vset1(x) _mm512_set1_pd(x)
+#define vload(p) _mm512_loadu_pd(p)
+#define vstore(p, v) _mm512_storeu_pd(p, v)
+#define vadd(a, b) _mm512_add_pd(a, b)
+#define vsub(a, b) _mm512_sub_pd(a, b)
+#define vmul(a, b) _mm512_mul_pd(a, b)
+#define vdiv(a, b) _mm512_div_pd(a, b)
+#define vmin(a, b) _mm512_min_pd(a, b)
+#define vmax(a, b) _mm512_max_pd(a, b)
+#define vsqrt(a) _mm512_sqrt_pd(a)
+#define vselect(x, a, b) _mm512_mask_blend_pd(_mm512_cmp_pd_mask(x, _mm512_setzero_pd(), _CMP_GT_OQ), b, a)
+#define vgetexp(x) _mm512_getexp_pd(x)
+#define vgetmant(x) _mm512_getmant_pd(x, _MM_MANT_NORM_1_2, _MM_MANT_SIGN_src)
+#define vfma(a, b, c) _mm512_fmadd_pd(a, b, c)
+#define vgather(p, index) _mm512_i32gather_pd(_mm256_loadu_si256((const __m256i *)(index)), p, 8)
+#define vfirst(v) _mm512_cvtsd_f64(v)
+#define vpow2n(t) _mm512_castsi512_pd(_mm512_slli_epi64( \
+            _mm512_add_epi64(_mm512_castpd_si512(t), _mm512_set1_epi64(1023)), 52))
+
+static inline SIMD_ATTR double K(vhsum)(vreal v) {
+    return _mm512_reduce_add_pd(v);
+}
+
+#else
+#error "simd_ops.h: SIMD_TARGET is not a vector instruction set"
+#endif
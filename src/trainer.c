@@ -0,0 +1,290 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "trainer.h"
+#include "matrix.h"
+#include "profile.h"
+#include "prune.h"
+
+/* Computes the gradients of the worker's part of the batch,
+ * then reduces its slice of the gradient arenas into the parameters. */
+static void worker_sync(trainer_worker *w, int first) {
+    nn_trainer *t = w->trainer;
+    const neuralnetwork *nn = t->nn;
+
+    if (w->nsamples > 0) {
+        w->error = context_train(w->ctx, t->input + first * nn->inputs,
+                                 t->target + first * nn->outputs, w->nsamples,
+                                 t->scale, t->scale != 0 ? w->grads : NULL);
+    }
+
+    pthread_barrier_wait(&t->barrier);
+
+    if (t->scale != 0) {
+        PROFILE_START(tupdate);
+
+        /* Slices are whole cache lines, so that no two workers write the same one. */
+        size_t pad = NN_ALIGN / sizeof(nn_real), lines = nn->nparams / pad;
+        size_t lo = lines * w->index / t->nthreads * pad;
+        size_t hi = lines * (w->index + 1) / t->nthreads * pad;
+
+        /* Gradients of all the workers are summed into the first one's,
+         * always in the same order, and then applied at once. */
+        matrix sum = { 0 };
+        for (int k = 0; k < t->nthreads && hi > lo; k++) {
+            if (t->workers[k].nsamples == 0) continue;
+
+            matrix grads = { 1, hi - lo, t->workers[k].grads + lo };
+            if (sum.data == NULL) {
+                sum = grads;
+            } else matrix_add(&sum, &grads);
+        }
+
+        if (sum.data) {
+            /* sum.data is the slice of the arena holding the sum. */
+            optimizer_step step;
+            optimizer_coefficients(nn, t->learningrate, t->step, &step);
+            optimizer_update(nn, &step, sum.data - lo, lo, hi);
+        }
+
+        PROFILE_STOP(tupdate, NN_PROFILE_NETWORK, NN_PROFILE_UPDATE,
+                     (t->nthreads + 4.0 * optimizer_nstates(nn->optimizer.type)) * (hi - lo),
+                     (t->nthreads + 2.0 + 2 * optimizer_nstates(nn->optimizer.type)) *
+                     sizeof(nn_real) * (hi - lo));
+    }
+}
+
+/* Performs a gradient descent step for every sample of the worker's part,
+ * applying the gradients to the shared parameters without any synchronization.
+ * Other workers may update the parameters, as well as the optimizer's state, in the
+ * middle of the step. Such races lose or mix in single updates only, as an aligned
+ * element is never torn. Plain SGD steps are applied in place, see context_step. */
+static void worker_hogwild(trainer_worker *w, int first, int last) {
+    nn_trainer *t = w->trainer;
+    neuralnetwork *nn = t->nn;
+
+    for (int s = first; s < last; s++) {
+        const nn_real *input = t->input + s * nn->inputs, *target = t->target + s * nn->outputs;
+        if (t->scale != 0 && nn->optimizer.type == SGD) {
+            w->error += context_step(w->ctx, input, target, t->scale);
+            continue;
+        }
+
+        w->error += context_train(w->ctx, input, target, 1, t->scale,
+                                  t->scale != 0 ? w->grads : NULL);
+        if (t->scale != 0) {
+            PROFILE_START(tupdate);
+
+            /* Steps are numbered by the samples, whichever worker takes them. */
+            optimizer_step step;
+            optimizer_coefficients(nn, t->learningrate, t->step + s, &step);
+            optimizer_update(nn, &step, w->grads, 0, nn->nparams);
+            prune_syncall(nn);
+            PROFILE_STOP(tupdate, NN_PROFILE_NETWORK, NN_PROFILE_UPDATE,
+                         (1 + 4.0 * optimizer_nstates(nn->optimizer.type)) * nn->nparams,
+                         (3.0 + 2 * optimizer_nstates(nn->optimizer.type)) *
+                         sizeof(nn_real) * nn->nparams);
+        }
+    }
+}
+
+static void worker_batch(trainer_worker *w) {
+    nn_trainer *t = w->trainer;
+
+    /* Contiguous part of the batch's rows. */
+    int first = (long)t->n * w->index / t->nthreads;
+    int last = (long)t->n * (w->index + 1) / t->nthreads;
+
+    w->nsamples = last - first;
+    w->error = 0;
+
+    if (t->hogwild) {
+        worker_hogwild(w, first, last);
+    } else worker_sync(w, first);
+
+    pthread_barrier_wait(&t->barrier);
+}
+
+static void *worker_main(void *arg) {
+    trainer_worker *w = arg;
+    nn_trainer *t = w->trainer;
+
+    pthread_mutex_lock(&t->lock);
+    while (t->ready == 0)
+        pthread_cond_wait(&t->created, &t->lock);
+    int ready = t->ready;
+    pthread_mutex_unlock(&t->lock);
+    if (ready < 0) return NULL;
+
+    while (1) {
+        /* Wait for the next batch. */
+        pthread_barrier_wait(&t->barrier);
+        if (t->quit) break;
+
+        worker_batch(w);
+    }
+
+    return NULL;
+}
+
+/* Lets the started workers go, either to wait for the batches, or to terminate
+ * if ready is -1, in which case they are joined and the trainer is freed. */
+static nn_trainer *trainer_start(nn_trainer *t, int started, int ready) {
+    pthread_mutex_lock(&t->lock);
+    t->ready = ready;
+    pthread_cond_broadcast(&t->created);
+    pthread_mutex_unlock(&t->lock);
+    if (ready > 0)
+        return t;
+
+    for (int k = 1; k < started; k++)
+        pthread_join(t->workers[k].thread, NULL);
+    for (int k = 0; k < t->nthreads; k++)
+        nn_context_destroy(t->workers[k].ctx);
+
+    pthread_cond_destroy(&t->created);
+    pthread_mutex_destroy(&t->lock);
+    free(t->workers);
+    free(t);
+    return NULL;
+}
+
+nn_trainer *nn_trainer_create(neuralnetwork *nn, int nthreads) {
+    if (nn == NULL || nn->nlayers == 0) return NULL;
+
+    if (nthreads < 1) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = online > 0 ? online : 1;
+    }
+
+    nn_trainer *t = calloc(1, sizeof(nn_trainer));
+    trainer_worker *workers = calloc(nthreads, sizeof(trainer_worker));
+    if (t == NULL || workers == NULL) {
+        perror(__func__);
+        free(t);
+        free(workers);
+        return NULL;
+    }
+
+    t->nn = nn;
+    t->nthreads = nthreads;
+    t->workers = workers;
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->created, NULL);
+
+    for (int k = 0; k < nthreads; k++) {
+        trainer_worker *w = &t->workers[k];
+        w->trainer = t;
+        w->index = k;
+        w->ctx = nn_context_create(nn);
+        if (w->ctx == NULL)
+            return trainer_start(t, 1, -1);
+    }
+
+    /* The calling thread is the first worker. */
+    for (int k = 1; k < nthreads; k++) {
+        int err = pthread_create(&t->workers[k].thread, NULL, worker_main, &t->workers[k]);
+        if (err) {
+            fprintf(stderr, "%s: pthread_create failed with %d\n", __func__, err);
+            return trainer_start(t, k, -1);
+        }
+    }
+
+    /* The barrier waits for every thread, so it is set up only once the pool is complete. */
+    int err = pthread_barrier_init(&t->barrier, NULL, nthreads);
+    if (err) {
+        fprintf(stderr, "%s: pthread_barrier_init failed with %d\n", __func__, err);
+        return trainer_start(t, nthreads, -1);
+    }
+
+    return trainer_start(t, nthreads, 1);
+}
+
+void nn_trainer_destroy(nn_trainer *t) {
+    if (!t) return;
+
+    t->quit = 1;
+    pthread_barrier_wait(&t->barrier);
+
+    for (int k = 0; k < t->nthreads; k++) {
+        if (k > 0)
+            pthread_join(t->workers[k].thread, NULL);
+
+        nn_context_destroy(t->workers[k].ctx);
+        free(t->workers[k].grads);
+    }
+
+    pthread_barrier_destroy(&t->barrier);
+    pthread_cond_destroy(&t->created);
+    pthread_mutex_destroy(&t->lock);
+    free(t->workers);
+    free(t);
+}
+
+/* Posts the batch to the workers and takes part as the first one.
+ * Returns the error averaged over the batch. */
+static double trainer_run(nn_trainer *t, const nn_real *input, const nn_real *target, int n,
+                          double learningrate, int hogwild) {
+    t->input = input;
+    t->target = target;
+    t->n = n;
+    t->scale = optimizer_scale(t->nn, learningrate, hogwild ? 1 : n);
+    t->learningrate = learningrate;
+    t->hogwild = hogwild;
+
+    /* A step for the batch, or for every sample in Hogwild mode. */
+    if (t->scale != 0)
+        t->step = optimizer_begin(t->nn, hogwild ? n : 1);
+
+    /* The gradients are stored, unless all the steps are applied in place. */
+    if (t->scale != 0 && !(hogwild && t->nn->optimizer.type == SGD)) {
+        for (int k = 0; k < t->nthreads; k++) {
+            if (t->workers[k].grads == NULL)
+                t->workers[k].grads = arena_create(t->nn->nparams);
+        }
+    }
+
+    pthread_barrier_wait(&t->barrier);
+    worker_batch(&t->workers[0]);
+
+    /* The workers update slices of the arena, which do not follow the layers. */
+    if (t->scale != 0 && !t->hogwild)
+        prune_syncall(t->nn);
+
+    double etotal = 0;
+    for (int k = 0; k < t->nthreads; k++)
+        etotal += t->workers[k].error;
+
+    return etotal / n;
+}
+
+/* Gradients are averaged over the whole batch, as in nn_train_batch. */
+double nn_trainer_train_batch(nn_trainer *t, const nn_real *input, const nn_real *target, int n,
+                              double learningrate) {
+    if (t == NULL || n < 1) return 0;
+
+    return trainer_run(t, input, target, n, learningrate, 0);
+}
+
+/* Every sample is a step of its own, as in nn_backpropagate. */
+double nn_trainer_train_hogwild(nn_trainer *t, const nn_real *input, const nn_real *target,
+                                int n, double learningrate) {
+    if (t == NULL || n < 1) return 0;
+
+    return trainer_run(t, input, target, n, learningrate, 1);
+}
@@ -0,0 +1,74 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+#ifndef NN_TRAINER_H
+#define NN_TRAINER_H
+
+#include <pthread.h>
+
+#include "neuralnetwork.h"
+
+/* Thread of the pool, the first one being the calling thread. */
+typedef struct trainer_worker {
+    struct nn_trainer *trainer;
+    int index;
+    pthread_t thread;
+
+    nn_context *ctx; /* training buffers of the worker */
+    nn_real *grads; /* gradients of the worker's part of the batch, laid out like the parameters,
+                       allocated on the first batch which needs them */
+
+    int nsamples; /* samples of the current batch, 0 if the worker has got none */
+    double error; /* sum of the errors of the worker's samples */
+} trainer_worker;
+
+/* Data-parallel mini-batch trainer. Every batch is split among the workers,
+ * which compute the gradients of their parts independently and then reduce
+ * a slice of the parameters each, so the weights are updated only once.
+ * In Hogwild mode the workers update the parameters after every sample instead,
+ * without any synchronization. */
+typedef struct nn_trainer {
+    neuralnetwork *nn;
+
+    int nthreads;
+    trainer_worker *workers;
+
+    /* Synchronizes the workers at the start of a batch, after the gradients
+     * (only if synchronous) and after the update. */
+    pthread_barrier_t barrier;
+    int quit; /* set before the last start, terminates the workers */
+
+    /* The workers wait for the whole pool to be created before using the barrier. */
+    pthread_mutex_t lock;
+    pthread_cond_t created;
+    int ready; /* 1 once the pool is complete, -1 if its creation failed */
+
+    /* Current batch. */
+    const nn_real *input;
+    const nn_real *target;
+    int n;
+    nn_real scale; /* applied to the gradients, 0 if only the error is computed */
+    double learningrate;
+    long step; /* number of the first optimizer step of the batch */
+    int hogwild; /* whether the samples are applied one by one, without synchronization */
+} nn_trainer;
+
+nn_trainer *nn_trainer_create(neuralnetwork *nn, int nthreads);
+void nn_trainer_destroy(nn_trainer *trainer);
+double nn_trainer_train_batch(nn_trainer *trainer, const nn_real *input, const nn_real *target,
+                              int n, double learningrate);
+double nn_trainer_train_hogwild(nn_trainer *trainer, const nn_real *input, const nn_real *target,
+                                int n, double learningrate);
+
+#endif
@@ -13,90 +13,440 @@
  */
 
 #include <stdlib.h>
-#include <math.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "util.h"
 #include "neuralnetwork.h"
+#include "quantize.h"
+#include "prune.h"
 
-/* Box-Muller algorithm of generating normal distribution using uniform RNG. */
-double rand_normal_distribution(double mu, double sigma) {
-    static double z0;
-    static double z1;
+/* Model files start with a header and a table of the layers, followed by the
+ * parameter arena exactly as it is laid out in memory: every tensor begins at
+ * a NN_ALIGN byte boundary, the padding is zero. The reader maps the file and
+ * points the network straight into it, so nothing is read or copied upfront
+ * and processes loading the same file share its pages in the page cache.
+ * Integers are stored in the byte order of the writer, which is marked by
+ * the byteorder field, and offsets are counted in bytes from the start.
+ * Version 2 stores the weights of pruned layers as compressed rows when it is smaller:
+ * the uint32 row starts and column indices followed by the nonzero weights at the next
+ * NN_ALIGN boundary. Such files are read into an allocated arena instead.
+ * Files without pruned layers are still written as version 1. */
+#define FILE_VERSION 2
+#define FILE_BYTEORDER 0x01020304
 
-    static double generated = 0;
-    generated = !generated;
+static const char file_magic[4] = { 'N', 'N', 'M', 'F' };
 
-    /* If the function was previously called,
-     * there is no point in generating again.
-     * return z1 from the previous pass */
-    if (generated) return z1 * sigma + mu;
+struct file_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t byteorder;
+    uint32_t dtype; /* size of the stored elements in bytes, i.e. sizeof(nn_real) of the writer */
+    uint32_t inputs;
+    uint32_t nlayers;
+    uint64_t size; /* of the whole file */
+    uint64_t params; /* offset of the parameter arena */
+    uint64_t nparams; /* elements of the arena, including padding and compressed rows */
+};
 
-    double u1, u2;
-    do {
-        u1 = (double) rand() / RAND_MAX;
-        u2 = (double) rand() / RAND_MAX;
-    } while (u1 == 0.0); /* u1 cannot be zero */
+struct file_layer {
+    uint32_t outputs;
+    uint32_t inputs;
+    uint32_t activation;
+    uint32_t encoding; /* of the weights */
+    uint64_t weights; /* offset of the outputs x inputs weights matrix, or its compressed rows */
+    uint64_t biases; /* offset of the biases vector */
+};
 
-    z0 = sqrt(-2 * log(u1)) * cos(2*M_PI * u2);
-    z1 = sqrt(-2 * log(u1)) * sin(2*M_PI * u2);
+enum file_encodings {
+    FILE_DENSE, FILE_CSR
+};
 
-    return z0 * sigma + mu;
+/* Files without any magic predate the format and store every layer's outputs and inputs,
+ * weights and biases as doubles and activation. Reads n of those doubles, converting them
+ * to nn_real. Returns the number of elements read. */
+static int read_doubles(nn_real *data, int n, FILE *file) {
+    if (sizeof(double) == sizeof(nn_real))
+        return fread(data, sizeof(double), n, file);
+
+    int i = 0;
+    for (; i < n; i++) {
+        double d;
+        if (fread(&d, sizeof(d), 1, file) < 1) break;
+        data[i] = d;
+    }
+
+    return i;
 }
 
-int nn_writefile(const neuralnetwork *nn, const char *filename) {
-    FILE *file = fopen(filename, "wb");
+/* Converts n elements of the given size from the mapping to nn_real. */
+static void convert_reals(nn_real *data, const char *src, size_t size, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (size == sizeof(double)) {
+            double d;
+            memcpy(&d, src + i*size, size);
+            data[i] = d;
+        } else {
+            float f;
+            memcpy(&f, src + i*size, size);
+            data[i] = f;
+        }
+    }
+}
+
+static size_t file_aligned(size_t offset) {
+    return (offset + NN_ALIGN - 1) / NN_ALIGN * NN_ALIGN;
+}
+
+/* Whether the weights of the layer are stored as compressed rows. */
+static int file_compressed(const layer *l) {
+    if (l->csr.start == NULL)
+        return 0;
+
+    size_t nnz = l->csr.start[l->csr.rows];
+    return (l->csr.rows + 1 + nnz) * sizeof(uint32_t) + nnz * sizeof(nn_real) <
+        (size_t)l->csr.rows * l->csr.cols * sizeof(nn_real);
+}
+
+/* Bytes taken by the weights of the layer in the file, including the padding. */
+static size_t file_weights_size(const layer *l) {
+    if (!file_compressed(l))
+        return arena_padded((size_t)l->weights.rows * l->weights.cols) * sizeof(nn_real);
+
+    size_t nnz = l->csr.start[l->csr.rows];
+    return file_aligned((l->csr.rows + 1 + nnz) * sizeof(uint32_t)) +
+        file_aligned(nnz * sizeof(nn_real));
+}
+
+/* Writes n bytes of data followed by the zero padding up to NN_ALIGN. */
+static int write_aligned(const void *data, size_t n, FILE *file) {
+    static const char zeros[NN_ALIGN];
+    size_t pad = file_aligned(n) - n;
+    return fwrite(data, 1, n, file) == n && fwrite(zeros, 1, pad, file) == pad;
+}
+
+/* The row starts and column indices are ints in memory, written as they are. */
+static int write_compressed(const sparse_matrix *s, FILE *file) {
+    size_t nnz = s->start[s->rows];
+    int ok = fwrite(s->start, sizeof(int), s->rows + 1, file) == (size_t)s->rows + 1 &&
+        fwrite(s->index, sizeof(int), nnz, file) == nnz;
+
+    static const char zeros[NN_ALIGN];
+    size_t indices = (s->rows + 1 + nnz) * sizeof(uint32_t);
+    size_t pad = file_aligned(indices) - indices;
+    ok = ok && fwrite(zeros, 1, pad, file) == pad;
+    return ok && write_aligned(s->value, nnz * sizeof(nn_real), file);
+}
+
+/* Files are written under a temporary name and renamed over the target, so that
+ * networks still mapping the previous version of it keep their pages, and a failed
+ * write never leaves a truncated file behind. Opens the temporary file,
+ * whose name is returned in tmpname. Errors are reported on behalf of the caller. */
+static FILE *tmpfile_open(const char *filename, char **tmpname, const char *caller) {
+    *tmpname = malloc(strlen(filename) + sizeof(".tmp"));
+    if (!*tmpname) {
+        perror(caller);
+        return NULL;
+    }
+    sprintf(*tmpname, "%s.tmp", filename);
+
+    FILE *file = fopen(*tmpname, "wb");
     if (!file) {
-        perror(__func__);
+        perror(caller);
+
+        free(*tmpname);
+        return NULL;
+    }
+
+    return file;
+}
+
+/* Closes the temporary file and, if everything has been written (ok),
+ * renames it over the target. Otherwise it is removed. Returns whether it succeeded. */
+static int tmpfile_commit(FILE *file, char *tmpname, const char *filename, int ok,
+                          const char *caller) {
+    ok = fclose(file) == 0 && ok;
+    ok = ok && rename(tmpname, filename) == 0;
+    if (!ok) {
+        perror(caller);
+        remove(tmpname);
+    }
+
+    free(tmpname);
+    return ok;
+}
+
+int nn_writefile(const neuralnetwork *nn, const char *filename) {
+    char *tmpname;
+    FILE *file = tmpfile_open(filename, &tmpname, __func__);
+    if (!file)
         return 0;
+
+    size_t table_end = sizeof(struct file_header) + nn->nlayers * sizeof(struct file_layer);
+    size_t params = file_aligned(table_end);
+
+    /* Without compressed layers, the tensors are written exactly as the arena. */
+    size_t size = params;
+    int version = 1;
+    for (int i = 0; i < nn->nlayers; i++) {
+        const layer *l = &nn->layers[i];
+        size += file_weights_size(l) + arena_padded(l->biases.rows) * sizeof(nn_real);
+        if (file_compressed(l))
+            version = 2;
     }
 
-    layer *start = nn->head;
-    while (start != NULL) {
-        int rows = start->weights->rows;
-        int cols = start->weights->cols;
+    struct file_header header = {
+        .version = version,
+        .byteorder = FILE_BYTEORDER,
+        .dtype = sizeof(nn_real),
+        .inputs = nn->inputs,
+        .nlayers = nn->nlayers,
+        .size = size,
+        .params = params,
+        .nparams = (size - params) / sizeof(nn_real),
+    };
+    memcpy(header.magic, file_magic, sizeof(file_magic));
 
-        int acc_written = 0;
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1;
 
-        /* Data written for each layer:
-         * 1) Number of outputs
-         * 2) Number of inputs
-         * 3) Weights matrix
-         * 4) Biases matrix
-         * 5) Activation function */
-        
-        acc_written += fwrite(&rows, sizeof(rows), 1, file); /* Num. of outputs */
-        acc_written += fwrite(&cols, sizeof(cols), 1, file); /* Num. of inputs */
-        acc_written += fwrite(start->weights->data, sizeof(double),
-                              rows * cols, file); /* Write weights matrix */
-        acc_written += fwrite(start->biases->data, sizeof(double), rows, file); /* Write biases matrix */
-        
-        acc_written += fwrite(&start->activation, sizeof(int), 1, file);
-
-        if (acc_written < (2 + rows * cols + rows + 1)) {
-            perror(__func__);
+    size_t offset = params;
+    for (int i = 0; ok && i < nn->nlayers; i++) {
+        const layer *l = &nn->layers[i];
+        struct file_layer entry = {
+            .outputs = l->weights.rows,
+            .inputs = l->weights.cols,
+            .activation = l->activation,
+            .encoding = file_compressed(l) ? FILE_CSR : FILE_DENSE,
+            .weights = offset,
+            .biases = offset + file_weights_size(l),
+        };
+        offset = entry.biases + arena_padded(l->biases.rows) * sizeof(nn_real);
+        ok = fwrite(&entry, sizeof(entry), 1, file) == 1;
+    }
 
-            fclose(file);
+    static const char zeros[NN_ALIGN];
+    ok = ok && fwrite(zeros, 1, params - table_end, file) == params - table_end;
+
+    for (int i = 0; ok && i < nn->nlayers; i++) {
+        const layer *l = &nn->layers[i];
+        if (file_compressed(l))
+            ok = write_compressed(&l->csr, file);
+        else
+            ok = write_aligned(l->weights.data,
+                               (size_t)l->weights.rows * l->weights.cols * sizeof(nn_real), file);
+        ok = ok && write_aligned(l->biases.data, l->biases.rows * sizeof(nn_real), file);
+    }
+
+    return tmpfile_commit(file, tmpname, filename, ok, __func__);
+}
+
+static uint32_t file_u32(const char *p) {
+    uint32_t x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+}
+
+/* Checks the compressed rows of a layer stored at the given offset: the row starts
+ * ascend from 0, the columns are in range and the values within the file. */
+static int file_check_compressed(const char *map, size_t size, size_t dtype,
+                                 const struct file_layer *l) {
+    uint64_t rows = l->outputs;
+    if (l->weights > size || rows + 1 > (size - l->weights) / sizeof(uint32_t))
+        return 0;
+
+    const char *start = map + l->weights;
+    if (file_u32(start) != 0)
+        return 0;
+    for (uint64_t i = 0; i < rows; i++) {
+        if (file_u32(start + (i+1) * sizeof(uint32_t)) < file_u32(start + i * sizeof(uint32_t)))
+            return 0;
+    }
+
+    uint64_t nnz = file_u32(start + rows * sizeof(uint32_t));
+    uint64_t indices = l->weights + (rows + 1) * sizeof(uint32_t);
+    if (nnz > rows * l->inputs || nnz > (size - indices) / sizeof(uint32_t))
+        return 0;
+    for (uint64_t k = 0; k < nnz; k++) {
+        if (file_u32(map + indices + k * sizeof(uint32_t)) >= l->inputs)
+            return 0;
+    }
+
+    uint64_t values = file_aligned(indices + nnz * sizeof(uint32_t));
+    return values <= size && nnz <= (size - values) / dtype;
+}
+
+/* Checks the header and layer table of a mapped file.
+ * Returns whether the arena can be used in place, i.e. it is stored in
+ * the library's precision and laid out exactly as nn_layout would do it. */
+static int file_check(const struct file_header *h, const struct file_layer *table,
+                      const char *map, size_t size, int *inplace) {
+    if (h->version < 1 || h->version > FILE_VERSION || h->byteorder != FILE_BYTEORDER ||
+        (h->dtype != sizeof(double) && h->dtype != sizeof(float)) || h->inputs < 1 ||
+        h->size != size || h->nlayers > (size - sizeof(*h)) / sizeof(*table) ||
+        h->params < sizeof(*h) + h->nlayers * sizeof(*table) || h->params > size ||
+        h->nparams > (size - h->params) / h->dtype) {
+        return 0;
+    }
+
+    *inplace = h->dtype == sizeof(nn_real) && h->params % NN_ALIGN == 0;
+
+    size_t offset = h->params;
+    uint32_t inputs = h->inputs;
+    for (uint32_t i = 0; i < h->nlayers; i++) {
+        const struct file_layer *l = &table[i];
+        if (l->outputs < 1 || l->inputs != inputs || l->activation >= ACTIVATIONS_N)
+            return 0;
+
+        uint64_t nweights = (uint64_t)l->outputs * l->inputs;
+        if (l->encoding == FILE_CSR && h->version >= 2) {
+            if (!file_check_compressed(map, size, h->dtype, l))
+                return 0;
+            *inplace = 0;
+        } else if (l->encoding != FILE_DENSE ||
+                   l->weights > size || nweights > (size - l->weights) / h->dtype) {
             return 0;
         }
+        if (l->biases > size || l->outputs > (size - l->biases) / h->dtype)
+            return 0;
+
+        /* Matches the arena of a network built by nn_addlayer. */
+        *inplace = *inplace && l->weights == offset;
+        offset += arena_padded(nweights) * sizeof(nn_real);
+        *inplace = *inplace && l->biases == offset;
+        offset += arena_padded(l->outputs) * sizeof(nn_real);
 
-        start = start->next;
+        inputs = l->outputs;
     }
 
-    fclose(file);
-    
+    *inplace = *inplace && offset == h->params + h->nparams * sizeof(nn_real);
     return 1;
 }
 
-neuralnetwork *nn_readfile(const char *filename) {
-    FILE *file = fopen(filename, "rb");
-    if (!file) {
+/* Decodes the compressed rows of a layer into the zeroed weights matrix. */
+static void decode_compressed(nn_real *weights, const char *map, size_t dtype,
+                              const struct file_layer *l) {
+    const char *start = map + l->weights;
+    size_t nnz = file_u32(start + (size_t)l->outputs * sizeof(uint32_t));
+    const char *index = start + ((size_t)l->outputs + 1) * sizeof(uint32_t);
+    const char *value = map + file_aligned(l->weights + ((size_t)l->outputs + 1 + nnz) * sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < l->outputs; i++) {
+        uint32_t end = file_u32(start + (i+1) * sizeof(uint32_t));
+        for (uint32_t p = file_u32(start + i * sizeof(uint32_t)); p < end; p++) {
+            uint32_t j = file_u32(index + p * sizeof(uint32_t));
+            convert_reals(&weights[(size_t)i * l->inputs + j], value + p * dtype, dtype, 1);
+        }
+    }
+}
+
+/* Maps a model file, the network's parameters point into the mapping.
+ * Files of another precision or layout are converted into an allocated arena. */
+static neuralnetwork *readfile_mapped(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror(__func__);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror(__func__);
+
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = st.st_size;
+    if (size < sizeof(struct file_header)) {
+        fprintf(stderr, "%s: Unexpected EOF\n", __func__);
+
+        close(fd);
+        return NULL;
+    }
+
+    /* Private and writable, training the network does not touch the file. */
+    char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
         perror(__func__);
         return NULL;
     }
 
+    const struct file_header *h = (const struct file_header *)map;
+    const struct file_layer *table = (const struct file_layer *)(map + sizeof(*h));
+
+    int inplace;
+    if (!file_check(h, table, map, size, &inplace)) {
+        fprintf(stderr, "%s: Invalid header\n", __func__);
+
+        munmap(map, size);
+        return NULL;
+    }
+
+    neuralnetwork *nn = nn_create(h->inputs);
+
+    if (inplace) {
+        nn->layers = malloc(h->nlayers * sizeof(layer));
+        if (h->nlayers > 0 && nn->layers == NULL) {
+            perror(__func__);
+            assert(nn->layers != NULL);
+        }
+
+        for (uint32_t i = 0; i < h->nlayers; i++) {
+            nn->layers[i].weights = (matrix) { table[i].outputs, table[i].inputs, NULL };
+            nn->layers[i].biases = (matrix) { table[i].outputs, 1, NULL };
+            nn->layers[i].activation = table[i].activation;
+            nn->layers[i].csr = (sparse_matrix) { 0 };
+        }
+        nn->nlayers = h->nlayers;
+        nn->outputs = h->nlayers > 0 ? table[h->nlayers-1].outputs : 0;
+
+        nn_mapparams(nn, (nn_real *)(map + h->params), map, size);
+        return nn;
+    }
+
+    for (uint32_t i = 0; i < h->nlayers; i++) {
+        const struct file_layer *l = &table[i];
+        nn_real *weights = malloc((size_t)l->outputs * l->inputs * sizeof(nn_real));
+        nn_real *biases = malloc(l->outputs * sizeof(nn_real));
+        if (!weights || !biases) {
+            perror(__func__);
+
+            free(weights);
+            free(biases);
+            nn_destroy(nn);
+            munmap(map, size);
+            return NULL;
+        }
+
+        if (l->encoding == FILE_CSR) {
+            memset(weights, 0, (size_t)l->outputs * l->inputs * sizeof(nn_real));
+            decode_compressed(weights, map, h->dtype, l);
+        } else convert_reals(weights, map + l->weights, h->dtype, (size_t)l->outputs * l->inputs);
+        convert_reals(biases, map + l->biases, h->dtype, l->outputs);
+        nn_addlayer(nn, l->outputs, weights, biases, l->activation);
+
+        /* The zeros of a compressed layer stay pruned. */
+        if (l->encoding == FILE_CSR)
+            prune_build(&nn->layers[i]);
+
+        free(weights);
+        free(biases);
+    }
+
+    munmap(map, size);
+    return nn;
+}
+
+/* Reads a file of the format without magic layer by layer. */
+static neuralnetwork *readfile_stream(FILE *file) {
     neuralnetwork *nn = NULL;
     while (1) {
         int acc_read = 0; /* counter of elements read */
@@ -108,13 +458,13 @@ neuralnetwork *nn_readfile(const char *filename) {
             nn = nn_create(inputs);
 
         if (acc_read >= 2) {
-            double *weights_data = malloc(outputs*inputs * sizeof(double));
-            double *biases_data = malloc(outputs * sizeof(double));
+            nn_real *weights_data = malloc(outputs*inputs * sizeof(nn_real));
+            nn_real *biases_data = malloc(outputs * sizeof(nn_real));
             int activation;
             if (weights_data && biases_data) {
                 /* Successful allocation. */
-                acc_read += fread(weights_data, sizeof(double), outputs*inputs, file);
-                acc_read += fread(biases_data, sizeof(double), outputs, file);
+                acc_read += read_doubles(weights_data, outputs*inputs, file);
+                acc_read += read_doubles(biases_data, outputs, file);
                 acc_read += fread(&activation, sizeof(int), 1, file);
             
                 if (acc_read >= (2 + outputs*inputs + outputs + 1)) {                
@@ -147,6 +497,160 @@ neuralnetwork *nn_readfile(const char *filename) {
         break;
     }
 
+    return nn;
+}
+
+neuralnetwork *nn_readfile(const char *filename) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        perror(__func__);
+        return NULL;
+    }
+
+    char magic[4];
+    int found = fread(magic, sizeof(magic), 1, file) == 1;
+
+    if (found && memcmp(magic, file_magic, sizeof(magic)) == 0) {
+        fclose(file);
+        return readfile_mapped(filename);
+    }
+
+    rewind(file);
+    neuralnetwork *nn = readfile_stream(file);
+
     fclose(file);
     return nn;
 }
+
+/* Quantized networks are stored in a format of their own: the magic, version,
+ * byte order mark (as in the model files), number of inputs and layers as 32-bit integers,
+ * followed by every layer's outputs, inputs and activation, the input scale,
+ * row scales and biases as floats and the int8 weights without padding. */
+#define QUANTIZED_VERSION 1
+
+static const char quantized_magic[4] = { 'N', 'N', 'Q', '8' };
+
+/* The file is replaced the same way as by nn_writefile. */
+int nn_quantized_writefile(const nn_quantized *q, const char *filename) {
+    char *tmpname;
+    FILE *file = tmpfile_open(filename, &tmpname, __func__);
+    if (!file)
+        return 0;
+
+    const uint32_t header[2] = { QUANTIZED_VERSION, FILE_BYTEORDER };
+    int ok = fwrite(quantized_magic, sizeof(quantized_magic), 1, file) +
+        fwrite(header, sizeof(header), 1, file) +
+        fwrite(&q->inputs, sizeof(int), 1, file) + fwrite(&q->nlayers, sizeof(int), 1, file) == 4;
+
+    for (int i = 0; ok && i < q->nlayers; i++) {
+        const qlayer *l = &q->layers[i];
+        int acc_written = 0;
+
+        acc_written += fwrite(&l->rows, sizeof(int), 1, file);
+        acc_written += fwrite(&l->cols, sizeof(int), 1, file);
+        acc_written += fwrite(&l->activation, sizeof(int), 1, file);
+        acc_written += fwrite(&l->in_scale, sizeof(float), 1, file);
+        acc_written += fwrite(l->scales, sizeof(float), l->rows, file);
+        for (int r = 0; r < l->rows; r++) {
+            float bias = l->biases[r];
+            acc_written += fwrite(&bias, sizeof(float), 1, file);
+        }
+        for (int r = 0; r < l->rows; r++)
+            acc_written += fwrite(l->weights + r*l->stride, 1, l->cols, file);
+
+        ok = acc_written == 4 + 2*l->rows + l->rows*l->cols;
+    }
+
+    return tmpfile_commit(file, tmpname, filename, ok, __func__);
+}
+
+/* Every size is checked against the bytes left in the file before anything is allocated,
+ * so that a corrupt or truncated file can not ask for more memory than it could fill. */
+nn_quantized *nn_quantized_readfile(const char *filename) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        perror(__func__);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fileno(file), &st) < 0) {
+        perror(__func__);
+
+        fclose(file);
+        return NULL;
+    }
+
+    /* Outputs, inputs, activation and input scale of a layer. */
+    const uint64_t layer_header = 3 * sizeof(int) + sizeof(float);
+
+    char magic[sizeof(quantized_magic)];
+    uint32_t header[2];
+    int inputs, nlayers;
+    uint64_t left = st.st_size; /* bytes not read yet */
+    if (fread(magic, sizeof(magic), 1, file) < 1 || memcmp(magic, quantized_magic, sizeof(magic)) != 0 ||
+        fread(header, sizeof(header), 1, file) < 1 || header[0] != QUANTIZED_VERSION ||
+        header[1] != FILE_BYTEORDER ||
+        fread(&inputs, sizeof(int), 1, file) < 1 || fread(&nlayers, sizeof(int), 1, file) < 1 ||
+        inputs < 1 || nlayers < 1 ||
+        (left -= sizeof(magic) + sizeof(header) + 2 * sizeof(int)) / layer_header < (uint64_t)nlayers) {
+        fprintf(stderr, "%s: Invalid header\n", __func__);
+
+        fclose(file);
+        return NULL;
+    }
+
+    nn_quantized *q = quantized_create(inputs, nlayers);
+    for (int i = 0; i < nlayers; i++) {
+        int rows, cols, activation;
+        if (fread(&rows, sizeof(int), 1, file) + fread(&cols, sizeof(int), 1, file) +
+            fread(&activation, sizeof(int), 1, file) < 3) {
+            break;
+        }
+
+        /* The scales and biases are floats, the weights bytes. */
+        int expected = i > 0 ? q->layers[i-1].rows : inputs;
+        uint64_t size = layer_header + (rows > 0 ? (uint64_t)rows * (2 * sizeof(float) + cols) : 0);
+        if (rows < 1 || cols != expected || activation < 0 || activation >= ACTIVATIONS_N ||
+            size > left) {
+            fprintf(stderr, "%s: Invalid layer %d\n", __func__, i);
+
+            nn_quantized_destroy(q);
+            fclose(file);
+            return NULL;
+        }
+        left -= size;
+
+        quantized_setlayer(q, i, rows, activation);
+        qlayer *l = &q->layers[i];
+
+        size_t acc_read = 0;
+        acc_read += fread(&l->in_scale, sizeof(float), 1, file);
+        acc_read += fread(l->scales, sizeof(float), rows, file);
+        for (int r = 0; r < rows; r++) {
+            float bias;
+            if (fread(&bias, sizeof(float), 1, file) < 1) break;
+            l->biases[r] = bias;
+            acc_read++;
+        }
+        for (int r = 0; r < rows; r++)
+            acc_read += fread(l->weights + (size_t)r * l->stride, 1, cols, file);
+
+        if (acc_read < 1 + 2 * (size_t)rows + (size_t)rows * cols)
+            break;
+
+        if (i == nlayers - 1) {
+            fclose(file);
+            return q;
+        }
+    }
+
+    /* Every layer is expected to be complete. */
+    if (feof(file)) {
+        fprintf(stderr, "%s: Unexpected EOF\n", __func__);
+    } else perror(__func__);
+
+    nn_quantized_destroy(q);
+    fclose(file);
+    return NULL;
+}
@@ -0,0 +1,320 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+/* Generates standalone C code of a network read from a file of nn_writefile:
+ * name.h declaring name_forward and name.c defining it, with the layers' shapes
+ * as constants and the parameters as aligned static arrays. The code depends on
+ * libm only. Compiled with -DNAME_SELFTEST, name.c gets a main comparing it with
+ * the outputs of nn_forwardpropagate recorded at generation time.
+ *
+ * The layers are read directly, hence the tool is built against the internal headers. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "neuralnetwork.h"
+#include "util.h"
+
+#define SELFTEST_SAMPLES 4
+
+/* Outputs of every layer are padded to whole vectors of the widest instruction set. */
+#define CODEGEN_ALIGN 64
+#define CODEGEN_PAD ((int)(CODEGEN_ALIGN / sizeof(nn_real)))
+
+static const int single = sizeof(nn_real) == sizeof(float);
+
+static int padded(int n) {
+    return (n + CODEGEN_PAD - 1) / CODEGEN_PAD * CODEGEN_PAD;
+}
+
+/* Hexadecimal literals convert back exactly, in either precision. */
+static void print_real(FILE *f, nn_real x) {
+    if (x == 0) {
+        fprintf(f, "0");
+    } else fprintf(f, single ? "%af" : "%a", (double)x);
+}
+
+/* Initializer of n elements, eight per line, indented by depth levels. */
+static void print_array(FILE *f, const nn_real *v, int n, int depth) {
+    fprintf(f, "{");
+    for (int i = 0; i < n; i++) {
+        if (i % 8 == 0) {
+            fprintf(f, "\n%*s", 4 * (depth + 1), "");
+        } else fprintf(f, " ");
+        print_real(f, v[i]);
+        if (i + 1 < n) fprintf(f, ",");
+    }
+    fprintf(f, "\n%*s}", 4 * depth, "");
+}
+
+/* Elementwise activations as inline functions, with the formulas of activations.c. */
+static void print_activation(FILE *f, int activation) {
+    const char *real = single ? "float" : "double", *sfx = single ? "f" : "";
+
+    switch (activation) {
+    case STEP:
+        fprintf(f, "static inline %s step(%s x) { return x > 0 ? 1 : 0; }\n", real, real);
+        break;
+    case TANH:
+        fprintf(f, "static inline %s act_tanh(%s x) { return tanh%s(x); }\n", real, real, sfx);
+        break;
+    case RELU:
+        fprintf(f, "static inline %s relu(%s x) { return x > 0 ? x : 0; }\n", real, real);
+        break;
+    case RELU_LEAKY:
+        fprintf(f, "static inline %s relu_leaky(%s x) { return x > 0 ? x : ", real, real);
+        print_real(f, RELU_LEAKY_LEAKAGE);
+        fprintf(f, " * x; }\n");
+        break;
+    case GAUSSIAN:
+        fprintf(f, "static inline %s gaussian(%s x) { return exp%s(-x*x); }\n", real, real, sfx);
+        break;
+    case SIGMOID:
+        fprintf(f, "static inline %s sigmoid(%s x) { return 1 / (1 + exp%s(-x)); }\n", real, real, sfx);
+        break;
+    case SOFTPLUS:
+        fprintf(f, "static inline %s softplus(%s x) { return log%s(1 + exp%s(x)); }\n",
+                real, real, sfx, sfx);
+        break;
+    }
+}
+
+static const char *activation_function(int activation) {
+    static const char *names[ACTIVATIONS_N] = {
+        NULL, "step", "act_tanh", "relu", "relu_leaky", "gaussian", "sigmoid", "softplus", NULL
+    };
+    return names[activation];
+}
+
+/* out = f(W * in + b), accumulated a column of W at a time into all the outputs,
+ * which the compiler vectorizes without reordering any sum. */
+static void print_layer(FILE *f, const layer *l, int index) {
+    const char *real = single ? "float" : "double", *sfx = single ? "f" : "";
+    int outputs = l->weights.rows, inputs = l->weights.cols, width = padded(outputs);
+
+    fprintf(f, "/* %d -> %d */\n", inputs, outputs);
+    fprintf(f, "static void layer%d(const %s *restrict in, %s *restrict out) {\n", index, real, real);
+    fprintf(f, "    memcpy(out, b%d, sizeof(b%d));\n", index, index);
+    fprintf(f, "    for (int j = 0; j < %d; j++) {\n", inputs);
+    fprintf(f, "        %s x = in[j];\n", real);
+    fprintf(f, "        for (int i = 0; i < %d; i++) out[i] += w%d[j][i] * x;\n", width, index);
+    fprintf(f, "    }\n");
+
+    if (l->activation == SOFTMAX) {
+        fprintf(f, "\n    %s max = out[0], sum = 0;\n", real);
+        fprintf(f, "    for (int i = 1; i < %d; i++) max = out[i] > max ? out[i] : max;\n", outputs);
+        fprintf(f, "    for (int i = 0; i < %d; i++) {\n", outputs);
+        fprintf(f, "        out[i] = exp%s(out[i] - max);\n", sfx);
+        fprintf(f, "        sum += out[i];\n");
+        fprintf(f, "    }\n");
+        fprintf(f, "    for (int i = 0; i < %d; i++) out[i] /= sum;\n", outputs);
+    } else if (activation_function(l->activation)) {
+        fprintf(f, "    for (int i = 0; i < %d; i++) out[i] = %s(out[i]);\n",
+                outputs, activation_function(l->activation));
+    }
+    fprintf(f, "}\n\n");
+}
+
+static void print_header(FILE *f, const neuralnetwork *nn, const char *name, const char *macro) {
+    const char *real = single ? "float" : "double";
+
+    fprintf(f, "/* Generated by nn_codegen, do not edit. */\n\n");
+    fprintf(f, "#ifndef %s_H\n#define %s_H\n\n", macro, macro);
+    fprintf(f, "#define %s_INPUTS %d\n", macro, nn->inputs);
+    fprintf(f, "#define %s_OUTPUTS %d\n\n", macro, nn->outputs);
+    fprintf(f, "/* Forward propagates %s_INPUTS inputs into %s_OUTPUTS outputs.\n", macro, macro);
+    fprintf(f, " * Allocates nothing and may be called from any number of threads. */\n");
+    fprintf(f, "void %s_forward(const %s *input, %s *output);\n\n", name, real, real);
+    fprintf(f, "#endif\n");
+}
+
+static void print_source(FILE *f, const neuralnetwork *nn, const char *name, const char *filename) {
+    const char *real = single ? "float" : "double";
+
+    fprintf(f, "/* Generated by nn_codegen from %s, do not edit.\n * Topology: %d", filename, nn->inputs);
+    for (int i = 0; i < nn->nlayers; i++)
+        fprintf(f, "-%d", nn->layers[i].weights.rows);
+    fprintf(f, ", %s precision. */\n\n", real);
+    fprintf(f, "#include <string.h>\n#include <math.h>\n\n#include \"%s.h\"\n\n", name);
+
+    /* Weights are stored transposed, an input's row padded to whole vectors. */
+    int widest = 0;
+    for (int i = 0; i < nn->nlayers; i++) {
+        const layer *l = &nn->layers[i];
+        int outputs = l->weights.rows, inputs = l->weights.cols, width = padded(outputs);
+        if (width > widest) widest = width;
+
+        nn_real *row = calloc(width, sizeof(nn_real));
+        if (row == NULL) {
+            perror(__func__);
+            exit(1);
+        }
+
+        fprintf(f, "static _Alignas(%d) const %s w%d[%d][%d] = {", CODEGEN_ALIGN, real, i, inputs, width);
+        for (int j = 0; j < inputs; j++) {
+            for (int k = 0; k < outputs; k++)
+                row[k] = matrix_get(&l->weights, k, j);
+            fprintf(f, j ? ", " : "\n    ");
+            print_array(f, row, width, 1);
+        }
+        fprintf(f, "\n};\n\n");
+
+        memset(row, 0, width * sizeof(nn_real));
+        memcpy(row, l->biases.data, outputs * sizeof(nn_real));
+        fprintf(f, "static _Alignas(%d) const %s b%d[%d] = ", CODEGEN_ALIGN, real, i, width);
+        print_array(f, row, width, 0);
+        fprintf(f, ";\n\n");
+        free(row);
+    }
+
+    int used[ACTIVATIONS_N] = { 0 };
+    for (int i = 0; i < nn->nlayers; i++) {
+        if (!used[nn->layers[i].activation]++)
+            print_activation(f, nn->layers[i].activation);
+    }
+    fprintf(f, "\n");
+
+    for (int i = 0; i < nn->nlayers; i++)
+        print_layer(f, &nn->layers[i], i);
+
+    fprintf(f, "void %s_forward(const %s *input, %s *output) {\n", name, real, real);
+    fprintf(f, "    _Alignas(%d) %s a[%d], b[%d];\n", CODEGEN_ALIGN, real, widest, widest);
+    for (int i = 0; i < nn->nlayers; i++) {
+        const char *in = i == 0 ? "input" : i % 2 ? "a" : "b";
+        fprintf(f, "    layer%d(%s, %s);\n", i, in, i % 2 ? "b" : "a");
+    }
+    fprintf(f, "    memcpy(output, %s, %d * sizeof(%s));\n}\n",
+            nn->nlayers % 2 ? "a" : "b", nn->outputs, real);
+}
+
+/* Appends a main comparing name_forward with the outputs of the library. */
+static void print_selftest(FILE *f, neuralnetwork *nn, const char *name, const char *macro) {
+    const char *real = single ? "float" : "double";
+
+    nn_real *input = malloc(SELFTEST_SAMPLES * nn->inputs * sizeof(nn_real));
+    nn_real *output = malloc(SELFTEST_SAMPLES * nn->outputs * sizeof(nn_real));
+    if (input == NULL || output == NULL) {
+        perror(__func__);
+        exit(1);
+    }
+
+    srand(1);
+    for (int i = 0; i < SELFTEST_SAMPLES * nn->inputs; i++)
+        input[i] = (nn_real)rand() / RAND_MAX;
+    for (int s = 0; s < SELFTEST_SAMPLES; s++) {
+        memcpy(output + s * nn->outputs, nn_forwardpropagate(nn, input + s * nn->inputs),
+               nn->outputs * sizeof(nn_real));
+    }
+
+    fprintf(f, "\n#ifdef %s_SELFTEST\n#include <stdio.h>\n\n", macro);
+    fprintf(f, "/* Outputs of nn_forwardpropagate for the inputs. */\n");
+    fprintf(f, "static const %s selftest_input[%d][%d] = {", real, SELFTEST_SAMPLES, nn->inputs);
+    for (int s = 0; s < SELFTEST_SAMPLES; s++) {
+        fprintf(f, s ? ", " : "\n    ");
+        print_array(f, input + s * nn->inputs, nn->inputs, 1);
+    }
+    fprintf(f, "\n};\n\n");
+    fprintf(f, "static const %s selftest_output[%d][%d] = {", real, SELFTEST_SAMPLES, nn->outputs);
+    for (int s = 0; s < SELFTEST_SAMPLES; s++) {
+        fprintf(f, s ? ", " : "\n    ");
+        print_array(f, output + s * nn->outputs, nn->outputs, 1);
+    }
+    fprintf(f, "\n};\n\n");
+
+    /* The library evaluates exp() by its own kernels and sums in another order. */
+    fprintf(f, "int main(void) {\n");
+    fprintf(f, "    double worst = 0;\n");
+    fprintf(f, "    for (int s = 0; s < %d; s++) {\n", SELFTEST_SAMPLES);
+    fprintf(f, "        %s out[%d];\n", real, nn->outputs);
+    fprintf(f, "        %s_forward(selftest_input[s], out);\n", name);
+    fprintf(f, "        for (int i = 0; i < %d; i++) {\n", nn->outputs);
+    fprintf(f, "            double e = fabs(out[i] - selftest_output[s][i]) / (1 + fabs(selftest_output[s][i]));\n");
+    fprintf(f, "            if (!(e <= worst)) worst = e;\n");
+    fprintf(f, "        }\n    }\n\n");
+    fprintf(f, "    int ok = worst <= %g;\n", single ? 1e-4 : 1e-9);
+    fprintf(f, "    printf(\"%s: largest relative difference %%g, %%s\\n\", worst, ok ? \"ok\" : \"FAILED\");\n", name);
+    fprintf(f, "    return !ok;\n}\n#endif\n");
+
+    free(input);
+    free(output);
+}
+
+static FILE *open_output(const char *directory, const char *name, const char *ext) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s.%s", directory, name, ext);
+
+    FILE *f = fopen(path, "w");
+    if (f == NULL)
+        perror(path);
+    return f;
+}
+
+static int close_output(FILE *f) {
+    int ok = !ferror(f);
+    if (fclose(f) != 0 || !ok) {
+        perror(__func__);
+        return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "Usage: %s network.nn name [directory]\n", argv[0]);
+        return 1;
+    }
+
+    const char *name = argv[2], *directory = argc == 4 ? argv[3] : ".";
+    char macro[256];
+    size_t len = strlen(name);
+    int valid = len > 0 && len < sizeof(macro) && !isdigit((unsigned char)name[0]);
+    for (size_t i = 0; i < len && valid; i++) {
+        valid = isalnum((unsigned char)name[i]) || name[i] == '_';
+        macro[i] = toupper((unsigned char)name[i]);
+    }
+    if (!valid) {
+        fprintf(stderr, "%s: name must be a C identifier\n", argv[0]);
+        return 1;
+    }
+    macro[len] = '\0';
+
+    neuralnetwork *nn = nn_readfile(argv[1]);
+    if (!nn) return 1;
+    if (nn->nlayers == 0) {
+        fprintf(stderr, "%s: network has no layers\n", argv[0]);
+        nn_destroy(nn);
+        return 1;
+    }
+
+    FILE *header = open_output(directory, name, "h");
+    FILE *source = header ? open_output(directory, name, "c") : NULL;
+    if (!source) {
+        if (header) fclose(header);
+        nn_destroy(nn);
+        return 1;
+    }
+
+    print_header(header, nn, name, macro);
+    print_source(source, nn, name, argv[1]);
+    print_selftest(source, nn, name, macro);
+
+    int ok = close_output(header) & close_output(source);
+    if (ok)
+        printf("%s/%s.c and %s/%s.h written\n", directory, name, directory, name);
+
+    nn_destroy(nn);
+    return !ok;
+}
@@ -0,0 +1,157 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+/* Prunes every layer of a trained network by magnitude, optionally fine-tunes
+ * the remaining weights on MNIST train, and compares both versions on MNIST t10k. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+
+#include "nn/nn.h"
+#include "tools.h"
+
+#define SPARSITY 0.9
+#define LEARNING_RATE 0.05
+#define BATCH 64
+
+static const char *train_images = "mnist/train-images-idx3-ubyte";
+static const char *train_labels = "mnist/train-labels-idx1-ubyte";
+static const char *test_images = "mnist/t10k-images-idx3-ubyte";
+static const char *test_labels = "mnist/t10k-labels-idx1-ubyte";
+
+/* Fine-tunes the network sample by sample, as the digits example trains it. */
+static int finetune(neuralnetwork *nn, int epochs, double learningrate) {
+    nn_dataset *ds = nn_dataset_open(train_images, train_labels, BATCH, 1);
+    if (!ds || nn_dataset_ninputs(ds) != nn_ninputs(nn) || nn_dataset_nclasses(ds) > nn_noutputs(nn)) {
+        if (ds)
+            fprintf(stderr, "%s: dataset does not match the network\n", train_images);
+        nn_dataset_close(ds);
+        return 0;
+    }
+
+    int inputs = nn_ninputs(nn), outputs = nn_noutputs(nn);
+    nn_real *target = calloc((size_t)BATCH * outputs, sizeof(nn_real));
+    if (!target) {
+        perror(__func__);
+        nn_dataset_close(ds);
+        return 0;
+    }
+
+    for (int e = 0; e < epochs; e++) {
+        int n, samples = 0;
+        double Etotal = 0;
+        nn_real *pixels;
+        const unsigned char *classes;
+        while ((n = nn_dataset_next(ds, &pixels, NULL, &classes)) > 0) {
+            for (int s = 0; s < n; s++) {
+                nn_real *t = target + (size_t)s * outputs;
+                t[classes[s]] = 1;
+                Etotal += nn_backpropagate(nn, pixels + (size_t)s * inputs, t, learningrate);
+                t[classes[s]] = 0;
+            }
+            samples += n;
+        }
+        printf("Fine-tuning epoch %d: error %.5f\n", e + 1, Etotal / samples);
+    }
+
+    free(target);
+    nn_dataset_close(ds);
+    return 1;
+}
+
+/* Returns the accuracy in percent and the forward time per sample in us. */
+static int evaluate(neuralnetwork *nn, double *accuracy, double *time) {
+    nn_dataset *ds = nn_dataset_open(test_images, test_labels, BATCH, 0);
+    if (!ds || nn_dataset_ninputs(ds) != nn_ninputs(nn)) {
+        if (ds)
+            fprintf(stderr, "%s: dataset does not match the network\n", test_images);
+        nn_dataset_close(ds);
+        return 0;
+    }
+
+    int inputs = nn_ninputs(nn), outputs = nn_noutputs(nn);
+    int n, correct = 0;
+    double elapsed = 0;
+    nn_real *pixels;
+    const unsigned char *classes;
+    while ((n = nn_dataset_next(ds, &pixels, NULL, &classes)) > 0) {
+        for (int s = 0; s < n; s++) {
+            double t0 = seconds();
+            int k = argmax(nn_forwardpropagate(nn, pixels + (size_t)s * inputs), outputs);
+            elapsed += seconds() - t0;
+            correct += k == classes[s];
+        }
+    }
+
+    int size = nn_dataset_size(ds);
+    *accuracy = 100.0 * correct / size;
+    *time = elapsed / size * 1e6;
+    nn_dataset_close(ds);
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    double sparsity = SPARSITY, threshold = 0, learningrate = LEARNING_RATE;
+    int epochs = 0, opt, invalid = 0;
+    while ((opt = getopt(argc, argv, "s:t:e:r:")) != -1) {
+        switch (opt) {
+        case 's': sparsity = atof(optarg); break;
+        case 't': threshold = atof(optarg); break;
+        case 'e': epochs = atoi(optarg); break;
+        case 'r': learningrate = atof(optarg); break;
+        default: invalid = 1; break;
+        }
+    }
+    if (invalid || argc - optind != 2 || epochs < 0) {
+        fprintf(stderr, "Usage: %s [-s sparsity] [-t threshold] [-e fine-tuning epochs] "
+                "[-r learning rate] network.nn output.nn\n", argv[0]);
+        return 1;
+    }
+    const char *input = argv[optind], *output = argv[optind + 1];
+
+    /* Both are private mappings, pruning one leaves the other intact. */
+    neuralnetwork *orig = nn_readfile(input);
+    neuralnetwork *nn = nn_readfile(input);
+    if (!orig || !nn) {
+        if (orig) nn_destroy(orig);
+        return 1;
+    }
+
+    long nonzero = nn_prune(nn, -1, sparsity, threshold);
+    if (nonzero < 0 || (epochs > 0 && !finetune(nn, epochs, learningrate)) ||
+        !nn_writefile(nn, output)) {
+        nn_destroy(nn);
+        nn_destroy(orig);
+        return 1;
+    }
+
+    double acc, time, acc_p, time_p;
+    if (!evaluate(orig, &acc, &time) || !evaluate(nn, &acc_p, &time_p)) {
+        nn_destroy(nn);
+        nn_destroy(orig);
+        return 1;
+    }
+
+    printf("Nonzero weights left: %ld\n", nonzero);
+    printf("original network: accuracy %6.2f%%, %8.2f us/sample, %6.2f MB\n",
+           acc, time, filesize_mb(input));
+    printf("pruned   network: accuracy %6.2f%%, %8.2f us/sample, %6.2f MB\n",
+           acc_p, time_p, filesize_mb(output));
+    printf("Accuracy delta: %+.2f percentage points\n", acc_p - acc);
+
+    nn_destroy(nn);
+    nn_destroy(orig);
+    return 0;
+}
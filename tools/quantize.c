@@ -0,0 +1,96 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+/* Quantizes a trained network to int8 weights and compares both versions
+ * on a labelled IDX dataset, MNIST t10k by default. The first samples
+ * are used for the calibration, the rest are held out for the comparison. */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "nn/nn.h"
+#include "tools.h"
+
+#define CALIBRATION_SAMPLES 1000
+
+int main(int argc, char *argv[]) {
+    if (argc != 3 && argc != 5) {
+        fprintf(stderr, "Usage: %s network.nn output.nnq [images labels]\n", argv[0]);
+        return 1;
+    }
+
+    const char *images = argc == 5 ? argv[3] : "mnist/t10k-images-idx3-ubyte";
+    const char *labels = argc == 5 ? argv[4] : "mnist/t10k-labels-idx1-ubyte";
+
+    neuralnetwork *nn = nn_readfile(argv[1]);
+    if (!nn) return 1;
+
+    /* The first batch is the calibration set. */
+    nn_dataset *ds = nn_dataset_open(images, labels, CALIBRATION_SAMPLES, 0);
+    if (!ds || nn_dataset_ninputs(ds) != nn_ninputs(nn) || nn_dataset_size(ds) <= CALIBRATION_SAMPLES) {
+        if (ds)
+            fprintf(stderr, "%s: need more than %d samples of %d inputs\n", argv[0],
+                    CALIBRATION_SAMPLES, nn_ninputs(nn));
+        nn_dataset_close(ds);
+        nn_destroy(nn);
+        return 1;
+    }
+
+    nn_real *pixels;
+    const unsigned char *classes;
+    int n = nn_dataset_next(ds, &pixels, NULL, &classes);
+    nn_quantized *q = nn_quantize(nn, pixels, n);
+    if (!q || !nn_quantized_writefile(q, argv[2])) {
+        nn_dataset_close(ds);
+        nn_destroy(nn);
+        return 1;
+    }
+
+    /* Compare both networks sample by sample on the held-out part. */
+    int outputs = nn_noutputs(nn), inputs = nn_ninputs(nn);
+    int correct = 0, correct_q = 0, agree = 0;
+    double time = 0, time_q = 0;
+    while ((n = nn_dataset_next(ds, &pixels, NULL, &classes)) > 0) {
+        for (int s = 0; s < n; s++) {
+            const nn_real *x = pixels + (size_t)s * inputs;
+
+            double t0 = seconds();
+            int k = argmax(nn_forwardpropagate(nn, x), outputs);
+            double t1 = seconds();
+            int kq = argmax(nn_quantized_forwardpropagate(q, x), outputs);
+            double t2 = seconds();
+
+            time += t1 - t0;
+            time_q += t2 - t1;
+            correct += k == classes[s];
+            correct_q += kq == classes[s];
+            agree += k == kq;
+        }
+    }
+
+    int held = nn_dataset_size(ds) - CALIBRATION_SAMPLES;
+    double acc = 100.0 * correct / held, acc_q = 100.0 * correct_q / held;
+    printf("Calibration samples: %d, held-out samples: %d\n", CALIBRATION_SAMPLES, held);
+    printf("%-6s network: accuracy %6.2f%%, %8.2f us/sample, %6.2f MB\n",
+           sizeof(nn_real) == sizeof(double) ? "double" : "float", acc, time / held * 1e6, filesize_mb(argv[1]));
+    printf("int8   network: accuracy %6.2f%%, %8.2f us/sample, %6.2f MB\n",
+           acc_q, time_q / held * 1e6, filesize_mb(argv[2]));
+    printf("Accuracy delta: %+.2f percentage points, predictions agree on %.2f%% of samples\n",
+           acc_q - acc, 100.0 * agree / held);
+
+    nn_dataset_close(ds);
+    nn_quantized_destroy(q);
+    nn_destroy(nn);
+    return 0;
+}
@@ -0,0 +1,457 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+/* Serves a network over a Unix domain socket, see server.h for the protocol.
+ * Every connection is read by its own thread, which queues the requests for the batcher.
+ * The batcher coalesces the queued requests until either the batch is full or the oldest
+ * one has waited for the deadline, then runs a single batched forward pass for them all.
+ * Latency percentiles and the histogram of batch sizes are sent on request
+ * and printed on exit, i.e. SIGINT or SIGTERM. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "nn/nn.h"
+#include "server.h"
+
+#define MAX_BATCH 32
+#define DEADLINE_US 1000
+
+/* Latencies are counted in buckets growing by 2^(1/8), about 9% apart. */
+#define LATENCY_STEPS 8
+#define LATENCY_BUCKETS (32 * LATENCY_STEPS)
+/* Batch sizes are counted in power of two buckets, [1], [2, 3], [4, 7], ... */
+#define BATCH_BUCKETS 32
+
+#define STATS_SIZE 4096
+
+typedef struct request {
+    nn_real *input, *output;
+    int64_t arrival; /* ns */
+    int done;
+    struct request *next;
+} request;
+
+typedef struct server {
+    const neuralnetwork *nn;
+    int inputs, outputs;
+    int maxbatch;
+    int64_t deadline; /* ns */
+
+    pthread_mutex_t lock;
+    pthread_cond_t queued; /* signals the batcher */
+    pthread_cond_t served; /* broadcast to the connections after every batch */
+    request *head, *tail;
+    int nqueued;
+    int nconnections; /* each has at most a single request queued */
+    int quit;
+
+    atomic_ullong latency[LATENCY_BUCKETS];
+    atomic_ullong batches[BATCH_BUCKETS];
+    atomic_ullong nbatches;
+    atomic_ullong maxlatency;
+} server;
+
+typedef struct connection {
+    server *s;
+    int fd;
+} connection;
+
+static int selfpipe[2];
+
+/* Wakes up the accepting loop, whichever thread receives the signal. */
+static void on_signal(int sig) {
+    int saved = errno;
+    (void)sig;
+    ssize_t ignored = write(selfpipe[1], "", 1);
+    (void)ignored;
+    errno = saved;
+}
+
+static int64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int latency_bucket(int64_t ns) {
+    int k = (int)(LATENCY_STEPS * log2(1 + ns / 1e3));
+    return k < LATENCY_BUCKETS ? k : LATENCY_BUCKETS - 1;
+}
+
+/* Upper bound of the bucket in microseconds. */
+static double latency_bound(int k) {
+    return exp2((double)(k + 1) / LATENCY_STEPS) - 1;
+}
+
+static int batch_bucket(int n) {
+    int k = 0;
+    while (n > 1) {
+        n >>= 1;
+        k++;
+    }
+    return k;
+}
+
+static void record_latency(server *s, int64_t ns) {
+    atomic_fetch_add_explicit(&s->latency[latency_bucket(ns)], 1, memory_order_relaxed);
+
+    unsigned long long max = atomic_load_explicit(&s->maxlatency, memory_order_relaxed);
+    while ((unsigned long long)ns > max &&
+           !atomic_compare_exchange_weak_explicit(&s->maxlatency, &max, ns,
+                                                  memory_order_relaxed, memory_order_relaxed));
+}
+
+/* Latency in microseconds below which the fraction p of the requests was served. */
+static double percentile(const unsigned long long *hist, unsigned long long total, double p) {
+    unsigned long long rank = (unsigned long long)ceil(p * total), seen = 0;
+    for (int k = 0; k < LATENCY_BUCKETS; k++) {
+        seen += hist[k];
+        if (seen >= rank && seen > 0)
+            return latency_bound(k);
+    }
+    return 0;
+}
+
+/* Formats the statistics into buf of STATS_SIZE bytes, returns the length. */
+static int format_stats(server *s, char *buf) {
+    unsigned long long hist[LATENCY_BUCKETS], total = 0;
+    for (int k = 0; k < LATENCY_BUCKETS; k++) {
+        hist[k] = atomic_load_explicit(&s->latency[k], memory_order_relaxed);
+        total += hist[k];
+    }
+    unsigned long long nbatches = atomic_load_explicit(&s->nbatches, memory_order_relaxed);
+    double max = atomic_load_explicit(&s->maxlatency, memory_order_relaxed) / 1e3;
+
+    int len = snprintf(buf, STATS_SIZE,
+                       "requests %llu, batches %llu, mean batch %.2f\n"
+                       "latency (us): p50 %.0f, p90 %.0f, p99 %.0f, p99.9 %.0f, max %.0f\n"
+                       "batch size:\n",
+                       total, nbatches, nbatches ? (double)total / nbatches : 0,
+                       percentile(hist, total, 0.5), percentile(hist, total, 0.9),
+                       percentile(hist, total, 0.99), percentile(hist, total, 0.999), max);
+
+    for (int k = 0; k < BATCH_BUCKETS && len < STATS_SIZE; k++) {
+        unsigned long long n = atomic_load_explicit(&s->batches[k], memory_order_relaxed);
+        if (n == 0) continue;
+
+        int lo = 1 << k, hi = (1 << k) * 2 - 1;
+        if (hi > s->maxbatch) hi = s->maxbatch;
+        char range[32];
+        if (lo == hi) snprintf(range, sizeof(range), "%d", lo);
+        else snprintf(range, sizeof(range), "%d-%d", lo, hi);
+        len += snprintf(buf + len, STATS_SIZE - len, "%12s %12llu %6.2f%%\n",
+                        range, n, 100.0 * n / nbatches);
+    }
+    return len < STATS_SIZE ? len : STATS_SIZE - 1;
+}
+
+static void *batcher_main(void *arg) {
+    server *s = arg;
+    nn_context *ctx = nn_context_create(s->nn);
+    nn_real *input = malloc((size_t)s->maxbatch * s->inputs * sizeof(nn_real));
+    request **batch = malloc(s->maxbatch * sizeof(request *));
+    if (!ctx || !input || !batch) {
+        perror(__func__);
+        exit(1);
+    }
+
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        while (s->nqueued == 0 && !s->quit)
+            pthread_cond_wait(&s->queued, &s->lock);
+        if (s->nqueued == 0)
+            break; /* quitting with nothing left to serve */
+
+        /* Waits for more requests until the batch is full or the oldest one is due,
+         * unless all the clients are waiting already and no more can arrive. */
+        int64_t due = s->head->arrival + s->deadline;
+        while (s->nqueued < s->maxbatch && s->nqueued < s->nconnections && !s->quit) {
+            int64_t left = due - now();
+            if (left <= 0) break;
+
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            left += ts.tv_nsec;
+            ts.tv_sec += left / 1000000000;
+            ts.tv_nsec = left % 1000000000;
+            pthread_cond_timedwait(&s->queued, &s->lock, &ts);
+        }
+
+        int n = 0;
+        while (n < s->maxbatch && s->head) {
+            batch[n++] = s->head;
+            s->head = s->head->next;
+        }
+        if (!s->head) s->tail = NULL;
+        s->nqueued -= n;
+        pthread_mutex_unlock(&s->lock);
+
+        for (int i = 0; i < n; i++)
+            memcpy(input + (size_t)i * s->inputs, batch[i]->input, s->inputs * sizeof(nn_real));
+        nn_real *output = nn_context_forwardpropagate_batch(ctx, input, n);
+        for (int i = 0; i < n; i++)
+            memcpy(batch[i]->output, output + (size_t)i * s->outputs, s->outputs * sizeof(nn_real));
+
+        atomic_fetch_add_explicit(&s->batches[batch_bucket(n)], 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&s->nbatches, 1, memory_order_relaxed);
+
+        pthread_mutex_lock(&s->lock);
+        for (int i = 0; i < n; i++)
+            batch[i]->done = 1;
+        pthread_cond_broadcast(&s->served);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    free(batch);
+    free(input);
+    nn_context_destroy(ctx);
+    return NULL;
+}
+
+/* Queues the request and waits for the batcher to serve it. */
+static void infer(server *s, request *r) {
+    pthread_mutex_lock(&s->lock);
+    r->done = 0;
+    r->next = NULL;
+    if (s->tail) s->tail->next = r;
+    else s->head = r;
+    s->tail = r;
+    if (++s->nqueued == 1 || s->nqueued >= s->maxbatch || s->nqueued >= s->nconnections)
+        pthread_cond_signal(&s->queued);
+
+    while (!r->done)
+        pthread_cond_wait(&s->served, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void *connection_main(void *arg) {
+    connection *c = arg;
+    server *s = c->s;
+    request r = {
+        .input = malloc(s->inputs * sizeof(nn_real)),
+        .output = malloc(s->outputs * sizeof(nn_real)),
+    };
+    if (!r.input || !r.output) {
+        perror(__func__);
+        goto done;
+    }
+
+    server_hello hello = {
+        .magic = SERVER_MAGIC, .version = SERVER_VERSION, .realsize = sizeof(nn_real),
+        .inputs = s->inputs, .outputs = s->outputs,
+    };
+    if (!write_full(c->fd, &hello, sizeof(hello)))
+        goto done;
+
+    pthread_mutex_lock(&s->lock);
+    s->nconnections++;
+    pthread_mutex_unlock(&s->lock);
+
+    uint32_t op;
+    while (read_full(c->fd, &op, sizeof(op))) {
+        if (op == SERVER_INFER) {
+            if (!read_full(c->fd, r.input, s->inputs * sizeof(nn_real)))
+                break;
+            r.arrival = now();
+            infer(s, &r);
+            if (!write_full(c->fd, r.output, s->outputs * sizeof(nn_real)))
+                break;
+            record_latency(s, now() - r.arrival);
+        } else if (op == SERVER_STATS) {
+            char text[STATS_SIZE];
+            uint32_t len = format_stats(s, text);
+            if (!write_full(c->fd, &len, sizeof(len)) || !write_full(c->fd, text, len))
+                break;
+        } else {
+            break;
+        }
+    }
+
+    /* Wakes up the batcher, which may be waiting for this connection. */
+    pthread_mutex_lock(&s->lock);
+    s->nconnections--;
+    pthread_cond_signal(&s->queued);
+    pthread_mutex_unlock(&s->lock);
+
+done:
+    close(c->fd);
+    free(r.input);
+    free(r.output);
+    free(c);
+    return NULL;
+}
+
+/* Binds the socket, replacing a stale one left behind, but not one still being served. */
+static int listen_socket(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            fprintf(stderr, "%s: already served\n", path);
+            close(fd);
+            return -1;
+        }
+        unlink(path);
+    }
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char *argv[]) {
+    int maxbatch = MAX_BATCH;
+    long deadline = DEADLINE_US;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:d:")) != -1) {
+        switch (opt) {
+        case 'b': maxbatch = atoi(optarg); break;
+        case 'd': deadline = atol(optarg); break;
+        default: maxbatch = 0; break;
+        }
+    }
+    if (argc - optind != 2 || maxbatch < 1 || deadline < 0) {
+        fprintf(stderr, "Usage: %s [-b max batch] [-d deadline us] network.nn socket\n", argv[0]);
+        return 1;
+    }
+    const char *path = argv[optind + 1];
+
+    neuralnetwork *nn = nn_readfile(argv[optind]);
+    if (!nn) {
+        fprintf(stderr, "%s: failed to read the network\n", argv[optind]);
+        return 1;
+    }
+
+    server *s = calloc(1, sizeof(server));
+    if (!s) {
+        perror(argv[0]);
+        return 1;
+    }
+    s->nn = nn;
+    s->inputs = nn_ninputs(nn);
+    s->outputs = nn_noutputs(nn);
+    s->maxbatch = maxbatch;
+    s->deadline = (int64_t)deadline * 1000;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->queued, &attr);
+    pthread_cond_init(&s->served, NULL);
+    pthread_condattr_destroy(&attr);
+
+    int fd = listen_socket(path);
+    if (fd < 0 || pipe(selfpipe) < 0) {
+        if (fd >= 0) perror(argv[0]);
+        return 1;
+    }
+
+    struct sigaction sa = { .sa_handler = on_signal };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN); /* clients gone away are handled as write errors */
+
+    pthread_t batcher;
+    if (pthread_create(&batcher, NULL, batcher_main, s) != 0) {
+        perror(argv[0]);
+        return 1;
+    }
+
+    fprintf(stderr, "serving %s (%d inputs, %d outputs) on %s, batches of up to %d, deadline %ld us\n",
+            argv[optind], s->inputs, s->outputs, path, maxbatch, deadline);
+
+    struct pollfd fds[2] = { { .fd = fd, .events = POLLIN }, { .fd = selfpipe[0], .events = POLLIN } };
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        if (fds[1].revents)
+            break;
+        if (!fds[0].revents)
+            continue;
+
+        int client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) perror("accept");
+            continue;
+        }
+
+        connection *c = malloc(sizeof(connection));
+        pthread_t thread;
+        if (!c) {
+            perror("accept");
+            close(client);
+            continue;
+        }
+        c->s = s;
+        c->fd = client;
+        if (pthread_create(&thread, NULL, connection_main, c) != 0) {
+            perror("accept");
+            close(client);
+            free(c);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    close(fd);
+    unlink(path);
+
+    /* The batcher serves the requests queued so far before it quits. Connections
+     * still open are left to the exit, the network is kept alive until then. */
+    pthread_mutex_lock(&s->lock);
+    s->quit = 1;
+    pthread_cond_signal(&s->queued);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(batcher, NULL);
+
+    char text[STATS_SIZE];
+    format_stats(s, text);
+    fputs(text, stderr);
+    return 0;
+}
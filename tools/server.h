@@ -0,0 +1,71 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+/* Protocol of nn_server over a Unix domain stream socket.
+ * Being local only, everything is sent in the native byte order and precision.
+ *
+ * On connection, the server sends the hello. Then the client sends requests,
+ * each starting with the 32-bit operation, and waits for the reply:
+ *   SERVER_INFER  followed by inputs nn_reals, replied with outputs nn_reals;
+ *   SERVER_STATS  replied with the 32-bit length and the text of the statistics.
+ * The server closes the connection on an unknown operation. */
+
+#ifndef NN_SERVER_H
+#define NN_SERVER_H
+
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define SERVER_MAGIC 0x56534e4e /* "NNSV" */
+#define SERVER_VERSION 1
+
+enum server_ops {
+    SERVER_INFER = 1, SERVER_STATS
+};
+
+typedef struct server_hello {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t realsize; /* sizeof(nn_real) of the server */
+    uint32_t inputs;
+    uint32_t outputs;
+} server_hello;
+
+/* Returns 0 on error or end of file before all n bytes are read. */
+static inline int read_full(int fd, void *buf, size_t n) {
+    char *p = buf;
+    while (n > 0) {
+        ssize_t k = read(fd, p, n);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return 0;
+        p += k;
+        n -= k;
+    }
+    return 1;
+}
+
+static inline int write_full(int fd, const void *buf, size_t n) {
+    const char *p = buf;
+    while (n > 0) {
+        ssize_t k = write(fd, p, n);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return 0;
+        p += k;
+        n -= k;
+    }
+    return 1;
+}
+
+#endif
@@ -0,0 +1,44 @@
+/**
+ * Copyright (c) 2019 Illia Ostapyshyn
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ */
+
+/* Helpers shared by the tools and the digits example. Included after nn/nn.h. */
+
+#ifndef NN_TOOLS_H
+#define NN_TOOLS_H
+
+#include <time.h>
+#include <sys/stat.h>
+
+/* Returns the index of the largest of n elements, the first one on ties. */
+static inline int argmax(const nn_real *v, int n) {
+    int k = 0;
+    for (int i = 1; i < n; i++) {
+        if (v[i] > v[k]) k = i;
+    }
+    return k;
+}
+
+static inline double seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Returns 0 if the file can not be stat'ed. */
+static inline double filesize_mb(const char *filename) {
+    struct stat st;
+    return stat(filename, &st) == 0 ? st.st_size / 1e6 : 0;
+}
+
+#endif